@@ -0,0 +1,432 @@
+/*
+ * Offline defragmenter for SFS images of both versions (see also the "defrag"
+ * command of the driver). Every file with more than one extent is copied to a
+ * free run that holds all of it, in passes that each write the data, the
+ * entries and the freed chains with an fsync in between, so a crash leaves at
+ * most orphan blocks. Clones stay where they are. -t measures the sequential
+ * read speed of all files before and after.
+ */
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sfs.h"
+#include "sfsimage.h"
+
+#define IO_CHUNK    (1 << 20)   // largest single read or write of file data
+
+/* Options passed from commandline arguments */
+struct options {
+    int dry_run;
+    int time;
+    int verbose;
+} options;
+
+#define debug(...) do { if (options.verbose) printf(__VA_ARGS__); } while (0)
+
+/* A file of the image, found by walking the directories. */
+struct file {
+    char *path;
+    struct image_entry entry;
+    off_t entry_off;
+    unsigned nblocks;
+    unsigned extents;           // before defragmenting
+    sfs2_blockidx_t old_first;  // chain to free at the end of the pass, or 0
+    bool done;                  // in a single extent
+};
+
+static struct sfs_image img;
+static struct file *files;
+static size_t nfiles, files_cap;
+static char *buf;               // IO_CHUNK bytes
+
+static uint32_t cursor;         // table index where find_free_run() starts
+static unsigned too_big;        // length of a run known not to exist, or 0
+
+
+void file_add(const char *dir_path, const struct image_entry *entry, off_t entry_off) {
+    if (nfiles == files_cap) {
+        files_cap = files_cap * 2 + 1024;
+        files = realloc(files, files_cap * sizeof(struct file));
+        if (files == NULL) {
+            perror("Could not allocate files");
+            exit(1);
+        }
+    }
+
+    struct file *file = &files[nfiles++];
+    memset(file, 0, sizeof(struct file));
+    file->entry = *entry;
+    file->entry_off = entry_off;
+    if (asprintf(&file->path, "%s/%s", dir_path, entry->filename) < 0) {
+        perror("Could not allocate files");
+        exit(1);
+    }
+}
+
+// number of blocks and extents of the chain of `file`; exits if it is broken
+void file_measure(struct file *file) {
+    uint64_t size = file->entry.size & SFS2_SIZEMASK;
+    uint64_t expected = (size + img.block_size - 1) / img.block_size;
+    sfs2_blockidx_t block = file->entry.first_block;
+
+    // a sparse file may have blocks reserved past its end
+    uint64_t max = file->entry.size & SFS2_SPARSE ? img.nblocks : expected;
+    for (; block != SFS2_BLOCKIDX_END; file->nblocks++) {
+        if (block == SFS2_BLOCKIDX_EMPTY || block > img.nblocks || file->nblocks == max) {
+            fprintf(stderr, "Error: %s: broken chain, run fsck first\n", file->path);
+            exit(1);
+        }
+
+        sfs2_blockidx_t next = img.table[block - 1];
+        if (next != block + 1) file->extents++;
+        block = next;
+    }
+
+    // a sparse file's chain ends where its hole begins
+    if (file->nblocks < expected && !(file->entry.size & SFS2_SPARSE)) {
+        fprintf(stderr, "Error: %s: chain too short, run fsck first\n", file->path);
+        exit(1);
+    }
+}
+
+/*
+ * Load the files of directory `path` (starting at `first_block`, or the root
+ * directory when that is SFS2_BLOCKIDX_EMPTY) and below.
+ */
+void walk(const char *path, sfs2_blockidx_t first_block) {
+    static char raw[SFS_ROOTDIR_SIZE];
+    unsigned unit_blocks = (img.dir_size + img.block_size - 1) / img.block_size;
+    unsigned max_units = img.nblocks / unit_blocks + 1;
+
+    struct image_entry *dirs = NULL;
+    size_t ndirs = 0, dirs_cap = 0;
+
+    for (unsigned unit = 0; unit == 0 || first_block != SFS2_BLOCKIDX_END; unit++) {
+        off_t unit_off;
+        unsigned nentries;
+
+        if (first_block == SFS2_BLOCKIDX_EMPTY) {
+            unit_off = img.rootdir_off;
+            nentries = SFS_ROOTDIR_NENTRIES;
+            image_read(&img, raw, SFS_ROOTDIR_SIZE, unit_off);
+        } else {
+            if (first_block > img.nblocks || unit == max_units) {
+                fprintf(stderr, "Error: %s: broken directory, run fsck first\n", path);
+                exit(1);
+            }
+            unit_off = image_block_offset(&img, first_block);
+            nentries = img.dir_size / IMAGE_ENTRY_SIZE;
+            image_read(&img, raw, img.dir_size, unit_off);
+        }
+
+        for (unsigned i = 0; i < nentries; i++) {
+            struct image_entry entry;
+            image_entry_decode(&img, raw + i * IMAGE_ENTRY_SIZE, &entry);
+            if (entry.filename[0] == '\0' || entry.filename[0] == SFS_INLINE_MARK) continue;
+            entry.filename[img.filename_max - 1] = '\0';
+
+            if (entry.size & SFS2_DIRECTORY) {
+                if (ndirs == dirs_cap) {
+                    dirs_cap = dirs_cap * 2 + 16;
+                    dirs = realloc(dirs, dirs_cap * sizeof(struct image_entry));
+                    if (dirs == NULL) {
+                        perror("Could not allocate directories");
+                        exit(1);
+                    }
+                }
+                dirs[ndirs++] = entry;
+            } else if (!(entry.size & SFS2_INLINE)) {    // no blocks to move
+                file_add(path, &entry, unit_off + i * IMAGE_ENTRY_SIZE);
+                file_measure(&files[nfiles - 1]);
+            }
+        }
+
+        if (first_block == SFS2_BLOCKIDX_EMPTY) break;
+
+        // the next unit follows the last block of this one
+        sfs2_blockidx_t last = first_block + unit_blocks - 1;
+        first_block = last <= img.nblocks ? img.table[last - 1] : SFS2_BLOCKIDX_EMPTY;
+        if (first_block == SFS2_BLOCKIDX_EMPTY) {
+            fprintf(stderr, "Error: %s: broken directory, run fsck first\n", path);
+            exit(1);
+        }
+    }
+
+    for (size_t i = 0; i < ndirs; i++) {
+        char *dir_path;
+        if (asprintf(&dir_path, "%s/%s", path, dirs[i].filename) < 0) {
+            perror("Could not allocate directories");
+            exit(1);
+        }
+        walk(dir_path, dirs[i].first_block);
+        free(dir_path);
+    }
+    free(dirs);
+}
+
+/*
+ * Search for `count` consecutive free blocks, from where the last search of
+ * the pass left off (next fit), so the files moved in a pass end up one after
+ * the other in the order of the walk. Returns the first of them, or
+ * SFS2_BLOCKIDX_EMPTY when there is no such run.
+ */
+sfs2_blockidx_t find_free_run(unsigned count) {
+    // no blocks are freed during a pass, a run that was not there still is not
+    if (too_big != 0 && count >= too_big) return SFS2_BLOCKIDX_EMPTY;
+
+    // past the start again, for a run around the cursor
+    uint32_t run = 0;
+    for (uint64_t n = 0; n < (uint64_t) img.nblocks + count; n++) {
+        uint32_t i = (cursor + n) % img.nblocks;
+        if (i == 0) run = 0;        // runs do not wrap around
+
+        run = img.table[i] == SFS2_BLOCKIDX_EMPTY ? run + 1 : 0;
+        if (run == count) {
+            cursor = (i + 1) % img.nblocks;
+            return i + 2 - count;
+        }
+    }
+
+    too_big = count;
+    return SFS2_BLOCKIDX_EMPTY;
+}
+
+// copy the data of `file`, whole blocks, to the run starting at `start`
+void copy_file(const struct file *file, sfs2_blockidx_t start) {
+    off_t dst = image_block_offset(&img, start);
+    sfs2_blockidx_t block = file->entry.first_block;
+
+    while (block != SFS2_BLOCKIDX_END) {
+        // one extent, or as much of it as fits in buf
+        sfs2_blockidx_t first = block;
+        unsigned len = 1;
+        block = img.table[block - 1];
+        while (block == first + len && (len + 1) * (size_t) img.block_size <= IO_CHUNK) {
+            block = img.table[block - 1];
+            len++;
+        }
+
+        size_t size = (size_t) len * img.block_size;
+        image_read(&img, buf, size, image_block_offset(&img, first));
+        image_write(&img, buf, size, dst);
+        dst += size;
+    }
+}
+
+void sync_image(void) {
+    if (fsync(img.fd) != 0) {
+        perror("Could not sync disk image");
+        exit(1);
+    }
+}
+
+/*
+ * Move every fragmented file for which there is room, see the description at
+ * the top. Returns the number of files moved.
+ */
+size_t defrag_pass(void) {
+    size_t moved = 0;
+
+    cursor = 0;
+    too_big = 0;
+
+    for (size_t i = 0; i < nfiles; i++) {
+        struct file *file = &files[i];
+        if (file->done) continue;
+
+        sfs2_blockidx_t start = find_free_run(file->nblocks);
+        if (start == SFS2_BLOCKIDX_EMPTY) continue;
+
+        if (!options.dry_run) copy_file(file, start);
+        for (unsigned k = 0; k < file->nblocks; k++) {
+            img.table[start + k - 1] = k + 1 < file->nblocks ? start + k + 1 : SFS2_BLOCKIDX_END;
+        }
+
+        file->old_first = file->entry.first_block;
+        file->entry.first_block = start;
+        file->done = true;
+        moved++;
+    }
+    if (moved == 0) return 0;
+
+    if (!options.dry_run) {
+        image_write_table(&img);
+        sync_image();
+
+        for (size_t i = 0; i < nfiles; i++) {
+            if (files[i].old_first == 0) continue;
+
+            char raw[IMAGE_ENTRY_SIZE];
+            image_entry_encode(&img, &files[i].entry, raw);
+            image_write(&img, raw, IMAGE_ENTRY_SIZE, files[i].entry_off);
+        }
+        sync_image();
+    }
+
+    for (size_t i = 0; i < nfiles; i++) {
+        sfs2_blockidx_t block = files[i].old_first;
+        if (block == 0) continue;
+
+        while (block != SFS2_BLOCKIDX_END) {
+            sfs2_blockidx_t next = img.table[block - 1];
+            img.table[block - 1] = SFS2_BLOCKIDX_EMPTY;
+            block = next;
+        }
+        files[i].old_first = 0;
+    }
+
+    if (!options.dry_run) {
+        image_write_table(&img);
+        sync_image();
+    }
+
+    return moved;
+}
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Read all files sequentially, an extent at a time, from a cold page cache,
+ * and print the speed; `when` is "before" or "after".
+ */
+void time_reads(const char *when) {
+    uint64_t bytes = 0;
+    unsigned long reads = 0;
+
+    sync_image();
+    posix_fadvise(img.fd, 0, 0, POSIX_FADV_DONTNEED);
+    double start = now();
+
+    for (size_t i = 0; i < nfiles; i++) {
+        sfs2_blockidx_t block = files[i].entry.first_block;
+
+        while (block != SFS2_BLOCKIDX_END) {
+            sfs2_blockidx_t first = block;
+            unsigned len = 1;
+            block = img.table[block - 1];
+            while (block == first + len && (len + 1) * (size_t) img.block_size <= IO_CHUNK) {
+                block = img.table[block - 1];
+                len++;
+            }
+
+            size_t size = (size_t) len * img.block_size;
+            if (pread(img.fd, buf, size, image_block_offset(&img, first)) < 0) {
+                perror("Error reading from disk");
+                exit(1);
+            }
+            bytes += size;
+            reads++;
+        }
+    }
+
+    double secs = now() - start;
+    printf("Read %.1f MB %s in %lu reads, %.3f s, %.1f MB/s\n", bytes / 1e6, when, reads,
+           secs, secs > 0 ? bytes / 1e6 / secs : 0);
+}
+
+static void show_help(const char *progname) {
+    printf("Usage: %s [OPTION]... FILE\n\n", progname);
+    printf("SFS defragmenter, for version 1 and 2 images.\n\n"
+           "Moves every file that is spread over more than one run of\n"
+           "consecutive blocks into a single run, where there is room for it,\n"
+           "and lists each such file with its number of runs (extents) before\n"
+           "and after. Directories are not moved. The image must not be\n"
+           "mounted, and should pass fsck.\n\n");
+    printf("Options:\n"
+           " -n, --dry-run          only report what would be moved.\n"
+           " -t, --time             measure the sequential read speed of all\n"
+           "                          files before and after.\n"
+           " -v, --verbose          also list the files that are in a single\n"
+           "                          extent already.\n"
+           " -h, --help             show this help.\n");
+}
+
+int main(int argc, char **argv) {
+    static const struct option long_options[] = {
+        { "dry-run", no_argument, NULL, 'n' },
+        { "time", no_argument, NULL, 't' },
+        { "verbose", no_argument, NULL, 'v' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "ntvh", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'n': options.dry_run = 1; break;
+        case 't': options.time = 1; break;
+        case 'v': options.verbose = 1; break;
+        case 'h': show_help(argv[0]); return 0;
+        default: show_help(argv[0]); return 1;
+        }
+    }
+
+    if (optind + 1 != argc) {
+        show_help(argv[0]);
+        return 1;
+    }
+
+    if (image_open(&img, argv[optind], options.dry_run) != 0) return 1;
+
+    buf = malloc(IO_CHUNK);
+    if (buf == NULL) {
+        perror("Could not allocate buffer");
+        return 1;
+    }
+
+    walk("", SFS2_BLOCKIDX_EMPTY);
+
+    unsigned long extents_before = 0;
+    unsigned fragmented = 0;
+    for (size_t i = 0; i < nfiles; i++) {
+        extents_before += files[i].extents;
+        // clones share blocks (see sfs.h), moving them would take them apart
+        files[i].done = files[i].extents <= 1 || (files[i].entry.size & SFS2_SHARED);
+        fragmented += files[i].extents > 1;
+    }
+
+    if (options.time) time_reads("before");
+
+    size_t moved = 0, pass_moved;
+    while (moved < fragmented && (pass_moved = defrag_pass()) > 0) {
+        moved += pass_moved;
+    }
+
+    unsigned long extents_after = 0;
+    for (size_t i = 0; i < nfiles; i++) {
+        const struct file *file = &files[i];
+        bool shared = file->entry.size & SFS2_SHARED;
+        unsigned after = file->done && !shared ? (file->extents > 0) : file->extents;
+        extents_after += after;
+
+        if (file->extents > 1 && shared) {
+            printf("%s: %u extents, not moved: shared with clones\n", file->path,
+                   file->extents);
+        } else if (file->extents > 1 && file->done) {
+            printf("%s: %u -> %u extents\n", file->path, file->extents, after);
+        } else if (file->extents > 1) {
+            printf("%s: %u extents, not moved: no free run of %u blocks\n", file->path,
+                   file->extents, file->nblocks);
+        } else {
+            debug("%s: %u extents\n", file->path, file->extents);
+        }
+    }
+    printf("%zu files, %u fragmented, %zu defragmented, %lu extents before, %lu after\n",
+           nfiles, fragmented, moved, extents_before, extents_after);
+
+    if (options.time && !options.dry_run) time_reads("after");
+
+    return 0;
+}
@@ -4,15 +4,29 @@
 #include <fcntl.h>
 #include <string.h>
 #include <assert.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #include "diskio.h"
 #include "sfs.h"
 
 
-const size_t disk_size = SFS_DATA_OFF + SFS_BLOCKTBL_NENTRIES * SFS_BLOCK_SIZE;
+/* Size of the disk the image describes, set by disk_verify_magic(). */
+size_t disk_size;
+
+__thread struct disk_stats *disk_stats;
 
 static int img_fd = -1;
 
+/* Mapping of the whole image when the mmap backend is selected, NULL when
+ * accesses go through pread/pwrite. */
+static char *img_map = NULL;
+
+/* Size of the image file as far as we know (it only grows through us), see
+ * disk_fd(). */
+static off_t img_size;
+
 
 void disk_open_image(const char *filename)
 {
@@ -27,20 +41,76 @@ void disk_open_image(const char *filename)
         exit(1);
     }
 
+    struct stat st;
+    if (fstat(img_fd, &st) == -1) {
+        perror("Could not stat disk image");
+        exit(1);
+    }
+    img_size = st.st_size;
+
     disk_verify_magic();
 }
 
 
+void disk_map_image(void)
+{
+    struct stat st;
+
+    if (fstat(img_fd, &st) == -1) {
+        perror("Could not stat disk image");
+        exit(1);
+    }
+
+    /* Images may be cut short after the last used block, but touching a page
+     * past the end of the file would raise SIGBUS. Extend it (sparsely). */
+    if ((size_t)st.st_size < disk_size && ftruncate(img_fd, disk_size) == -1) {
+        perror("Could not extend disk image");
+        exit(1);
+    }
+
+    img_map = mmap(NULL, disk_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   img_fd, 0);
+    if (img_map == MAP_FAILED) {
+        perror("Could not map disk image");
+        exit(1);
+    }
+    img_size = disk_size;
+}
+
+
 void disk_read(void *buf, size_t size, off_t offset)
 {
     ssize_t ret;
 
+    if (disk_stats) {
+        STATS_ADD(disk_stats->reads, 1);
+        STATS_ADD(disk_stats->bytes_read, size);
+    }
+
+    if (img_map) {
+        if ((size_t)offset > disk_size || size > disk_size - offset) {
+            fprintf(stderr, "Could not read %zu bytes from disk at offset "
+                    "%#lx, beyond end of disk\n", size, offset);
+            exit(1);
+        }
+        memcpy(buf, img_map + offset, size);
+        return;
+    }
+
     ret = pread(img_fd, buf, size, offset);
     if (ret == -1) {
         perror("Error reading from disk");
         exit(1);
     }
 
+    /* Images may be cut short after the last used block, the rest of the disk
+     * reads as zeroes. */
+    if ((size_t)ret < size && (size_t)offset <= disk_size &&
+        size <= disk_size - offset) {
+        memset((char *)buf + ret, 0, size - ret);
+        ret = size;
+    }
+
     if ((size_t)ret != size) {
         fprintf(stderr, "Could not read %zu bytes from disk, only got %zd\n",
                 size, ret);
@@ -53,6 +123,11 @@ void disk_write(const void *buf, size_t size, off_t offset)
 {
     ssize_t ret;
 
+    if (disk_stats) {
+        STATS_ADD(disk_stats->writes, 1);
+        STATS_ADD(disk_stats->bytes_written, size);
+    }
+
     assert(offset >= 0);
     if ((size_t)offset >= disk_size) {
         fprintf(stderr, "Error: write to disk outside of range of addressable "
@@ -60,6 +135,16 @@ void disk_write(const void *buf, size_t size, off_t offset)
         assert((size_t)offset < disk_size);
     }
 
+    if (img_map) {
+        if (size > disk_size - offset) {
+            fprintf(stderr, "Could not write %zu bytes to disk, only %zu "
+                    "bytes left\n", size, disk_size - offset);
+            exit(1);
+        }
+        memcpy(img_map + offset, buf, size);
+        return;
+    }
+
     ret = pwrite(img_fd, buf, size, offset);
     if (ret == -1) {
         perror("Error writing to disk");
@@ -71,15 +156,131 @@ void disk_write(const void *buf, size_t size, off_t offset)
                 size, ret);
         exit(1);
     }
+
+    if (offset + (off_t)size > img_size)
+        img_size = offset + size;
 }
 
-void disk_verify_magic(void)
+void disk_writev(const struct iovec *iov, int iovcnt, off_t offset)
+{
+    size_t size = 0;
+    ssize_t ret;
+
+    for (int i = 0; i < iovcnt; i++)
+        size += iov[i].iov_len;
+
+    if (disk_stats) {
+        STATS_ADD(disk_stats->writes, 1);
+        STATS_ADD(disk_stats->bytes_written, size);
+    }
+
+    assert(offset >= 0);
+    if ((size_t)offset >= disk_size || size > disk_size - offset) {
+        fprintf(stderr, "Error: write to disk outside of range of addressable "
+                "blocks: offset=%#lx size=%zu\n", offset, size);
+        assert((size_t)offset < disk_size && size <= disk_size - offset);
+    }
+
+    if (img_map) {
+        for (int i = 0; i < iovcnt; i++) {
+            memcpy(img_map + offset, iov[i].iov_base, iov[i].iov_len);
+            offset += iov[i].iov_len;
+        }
+        return;
+    }
+
+    ret = pwritev(img_fd, iov, iovcnt, offset);
+    if (ret == -1) {
+        perror("Error writing to disk");
+        exit(1);
+    }
+
+    if ((size_t)ret != size) {
+        fprintf(stderr, "Could not write %zu bytes to disk, only wrote %zd\n",
+                size, ret);
+        exit(1);
+    }
+
+    if (offset + (off_t)size > img_size)
+        img_size = offset + size;
+}
+
+int disk_fd(off_t offset, size_t size)
+{
+    if (offset + (off_t)size > img_size)
+        return -1;
+
+    return img_fd;
+}
+
+void disk_flush(void)
+{
+    /* pwrite() already handed everything to the page cache. */
+    if (img_map && msync(img_map, disk_size, MS_ASYNC) == -1) {
+        perror("Error flushing disk");
+        exit(1);
+    }
+}
+
+
+void disk_sync(void)
+{
+    int ret;
+
+    if (disk_stats)
+        STATS_ADD(disk_stats->syncs, 1);
+
+    if (img_map)
+        ret = msync(img_map, disk_size, MS_SYNC);
+    else
+        ret = fsync(img_fd);
+
+    if (ret == -1) {
+        perror("Error syncing disk");
+        exit(1);
+    }
+}
+
+int disk_verify_magic(void)
 {
     char buf[SFS_MAGIC_SIZE];
     disk_read(buf, sizeof(buf), 0);
-    if (memcmp(buf, sfs_magic, SFS_MAGIC_SIZE)) {
-        fprintf(stderr, "Invalid signature '%.*s', expected '%.*s'\n",
-                SFS_MAGIC_SIZE, buf, SFS_MAGIC_SIZE, sfs_magic);
-        exit(1);
+
+    if (!memcmp(buf, sfs_magic, SFS_MAGIC_SIZE)) {
+        disk_size = SFS_DATA_OFF + SFS_BLOCKTBL_NENTRIES * SFS_BLOCK_SIZE;
+        return 1;
     }
+
+    if (!memcmp(buf, sfs2_magic, SFS_MAGIC_SIZE)) {
+        struct sfs2_super super;
+        disk_read(&super, sizeof(super), 0);
+        if (!disk_super_valid(&super)) {
+            fprintf(stderr, "Invalid superblock\n");
+            exit(1);
+        }
+        disk_size = super.data_off + (size_t)super.nblocks * super.block_size;
+        return 2;
+    }
+
+    fprintf(stderr, "Invalid signature '%.*s', expected '%.*s' or '%.*s'\n",
+            SFS_MAGIC_SIZE, buf, SFS_MAGIC_SIZE, sfs_magic, SFS_MAGIC_SIZE,
+            sfs2_magic);
+    exit(1);
+}
+
+int disk_super_valid(const struct sfs2_super *super)
+{
+    uint32_t bs = super->block_size;
+
+    if (bs < SFS2_BLOCK_SIZE_MIN || bs > SFS2_BLOCK_SIZE_MAX || (bs & (bs - 1)))
+        return 0;
+    if (super->nblocks == 0 || super->nblocks > SFS2_NBLOCKS_MAX)
+        return 0;
+    if (super->blocktbl_off < SFS2_ROOTDIR_OFF + SFS_ROOTDIR_SIZE)
+        return 0;
+    if (super->data_off < super->blocktbl_off +
+                          (uint64_t)super->nblocks * sizeof(sfs2_blockidx_t))
+        return 0;
+
+    return super->data_off % bs == 0;
 }
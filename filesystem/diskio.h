@@ -1,16 +1,63 @@
 #ifndef DISKIO_H
 #define DISKIO_H
 
+#include <sys/uio.h>
+
+struct sfs2_super;
+
 /* Open a disk image for future disk operations. */
 void disk_open_image(const char *filename);
 
+/* Switch the open image to the mmap backend: the whole image is mapped and
+ * reads and writes become memcpy. Call right after disk_open_image(). */
+void disk_map_image(void);
+
 /* Read `size` bytes from address `offset` of the disk, into `buf`. */
 void disk_read(void *buf, size_t size, off_t offset);
 
 /* Write `size` bytes from `buf` to disk at address `offset`. */
 void disk_write(const void *buf, size_t size, off_t offset);
 
-/* Verify this is an SFS partitiion by checking the magic bytes at the start. */
-void disk_verify_magic(void);
+/* Write the `iovcnt` buffers of `iov` to disk back to back, starting at
+ * address `offset`, with a single pwritev(). */
+void disk_writev(const struct iovec *iov, int iovcnt, off_t offset);
+
+/* File descriptor of the image, for transfers of `size` bytes at `offset` that
+ * bypass diskio (splice by the FUSE library). Returns -1 if the range extends
+ * beyond the end of the image file, where disk_read() would make up zeroes. */
+int disk_fd(off_t offset, size_t size);
+
+/* Start writeback of everything written so far (msync for the mmap backend,
+ * nothing to do for pread/pwrite). */
+void disk_flush(void);
+
+/* Persist everything written so far before returning (msync or fsync). */
+void disk_sync(void);
+
+/* Verify this is an SFS partitiion by checking the magic bytes at the start.
+ * Returns the version of the format (1 or 2) and sets disk_size. */
+int disk_verify_magic(void);
+
+/* Check that the layout a version 2 superblock describes makes sense. */
+int disk_super_valid(const struct sfs2_super *super);
+
+/* Size in bytes of the disk (its last block may lie beyond the end of the
+ * image file). */
+extern size_t disk_size;
+
+/* Counters of the disk accesses above. */
+struct disk_stats {
+    unsigned long reads, writes, syncs;
+    unsigned long long bytes_read, bytes_written;
+};
+
+/* Where the accesses of the calling thread are counted, nowhere when NULL (the
+ * default). Threads point it at counters of their own, so nothing is shared. */
+extern __thread struct disk_stats *disk_stats;
+
+/* Counters are read by other threads while they are counted, so both go
+ * through relaxed atomics. */
+#define STATS_ADD(counter, n)   __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+#define STATS_READ(counter)     __atomic_load_n(&(counter), __ATOMIC_RELAXED)
 
 #endif
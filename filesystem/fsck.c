@@ -0,0 +1,469 @@
+/*
+ * SFS file system checker for both versions of the format. The directory tree
+ * is walked first; the chains of all files are then verified by a pool of
+ * threads, each claiming the blocks it walks in a shared owner map. Blocks in
+ * use that no chain reaches are freed, unless running with -n or other errors
+ * were found.
+ */
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sfs.h"
+#include "sfsimage.h"
+
+#define MAX_THREADS     64
+#define ITEMS_CHUNK     64      // files a thread takes at a time
+
+/* Options passed from commandline arguments */
+struct options {
+    int list;
+    int readonly;
+    unsigned threads;
+    int verbose;
+} options;
+
+/*
+ * An entry of the image, found by walking the directories. Item 0 is the root
+ * directory.
+ */
+struct item {
+    char *path;                 // "" for the root directory
+    struct image_entry entry;
+};
+
+static struct sfs_image img;
+static struct item *items;
+static size_t nitems, items_cap;
+
+static uint32_t *owner;         // index + 1 of the item owning each block, 0 if none
+static size_t next_item;        // next file to check, taken atomically
+static unsigned nerrors;
+static unsigned long norphans;
+static bool repair;             // free the orphans, when nothing else is wrong
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+void report(const char *fmt, ...) {
+    va_list args;
+
+    pthread_mutex_lock(&report_lock);
+    nerrors++;
+    printf("Error: ");
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    printf("\n");
+    pthread_mutex_unlock(&report_lock);
+}
+
+#define debug(...) do { if (options.verbose) printf(__VA_ARGS__); } while (0)
+
+size_t item_add(const char *dir_path, const struct image_entry *entry) {
+    if (nitems == items_cap) {
+        items_cap = items_cap * 2 + 1024;
+        items = realloc(items, items_cap * sizeof(struct item));
+        if (items == NULL) {
+            perror("Could not allocate entries");
+            exit(1);
+        }
+    }
+
+    struct item *item = &items[nitems];
+    item->entry = *entry;
+    if (asprintf(&item->path, "%s/%s", dir_path, entry->filename) < 0) {
+        perror("Could not allocate entries");
+        exit(1);
+    }
+
+    return nitems++;
+}
+
+const char *item_path(size_t index) {
+    return index == 0 ? "/" : items[index].path;
+}
+
+/*
+ * Claim `block` for item `index`. Returns false, after reporting it, if the
+ * block is not a valid blockidx or belongs to a chain already, other than that
+ * of a clone when the item is one too (`what` of the item, "block" or
+ * "directory block").
+ */
+bool claim(size_t index, sfs2_blockidx_t block, const char *what) {
+    if (block == SFS2_BLOCKIDX_EMPTY || block > img.nblocks) {
+        report("%s: invalid %s %x", item_path(index), what, block);
+        return false;
+    }
+
+    uint32_t expected = 0;
+    if (__atomic_compare_exchange_n(&owner[block - 1], &expected, index + 1, false,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return true;
+    }
+
+    // clones share the end of their chains, see sfs.h
+    if (expected != index + 1 && (items[index].entry.size & SFS2_SHARED) &&
+        (items[expected - 1].entry.size & SFS2_SHARED)) {
+        return true;
+    }
+
+    if (expected == index + 1) {
+        report("%s: chain has a cycle at %s %x", item_path(index), what, block);
+    } else {
+        report("%s: %s %x is cross-linked with %s", item_path(index), what, block,
+               item_path(expected - 1));
+    }
+    return false;
+}
+
+int compare_names(const void *a, const void *b) {
+    return strcmp(*(const char *const *) a, *(const char *const *) b);
+}
+
+// print entry `entry` of `path` as the prebuilt fsck does, in its on-disk form
+void list_entry(const char *path, const struct image_entry *entry) {
+    bool is_dir = entry->size & SFS2_DIRECTORY;
+
+    if (img.version == 1) {
+        struct sfs_entry raw;
+        image_entry_encode(&img, entry, &raw);
+        printf("%08x %04x  %s%s\n", raw.size, raw.first_block, path, is_dir ? "/" : "");
+    } else {
+        printf("%016llx %08x  %s%s\n", (unsigned long long) entry->size,
+               entry->first_block, path, is_dir ? "/" : "");
+    }
+}
+
+// check the entries of one unit of directory `index`, read into `raw`
+void check_unit(size_t index, const char *raw, unsigned nentries) {
+    bool inline_next = false;       // the entry before has its data in this slot
+
+    for (unsigned i = 0; i < nentries; i++) {
+        const char *slot = raw + i * IMAGE_ENTRY_SIZE;
+        struct image_entry entry;
+        image_entry_decode(&img, slot, &entry);
+
+        if (inline_next) {
+            inline_next = false;
+            if (slot[0] == SFS_INLINE_MARK) continue;
+            report("%s: inline data of entry %u is missing", item_path(index), i - 1);
+        }
+        if (slot[0] == SFS_INLINE_MARK) {
+            report("%s: entry %u is inline data of no file", item_path(index), i);
+            continue;
+        }
+
+        if (entry.filename[0] == '\0') {
+            for (unsigned k = 0; k < IMAGE_ENTRY_SIZE; k++) {
+                if (slot[k] != 0) {
+                    report("%s: unused entry %u is not cleared", item_path(index), i);
+                    break;
+                }
+            }
+            continue;
+        }
+
+        if (memchr(entry.filename, '\0', img.filename_max) == NULL) {
+            entry.filename[img.filename_max - 1] = '\0';
+            report("%s: name of entry %u is not terminated", item_path(index), i);
+        }
+
+        size_t child = item_add(items[index].path, &entry);
+        uint64_t flags = entry.size & ~SFS2_SIZEMASK;
+        if (flags & ~(SFS2_DIRECTORY | SFS2_SPARSE | SFS2_SHARED | SFS2_INLINE)) {
+            report("%s: unknown flags %llx", item_path(child), (unsigned long long) flags);
+        }
+        if ((entry.size & SFS2_DIRECTORY) && (entry.size & SFS2_SIZEMASK)) {
+            report("%s: directory has a size", item_path(child));
+        }
+        if ((entry.size & SFS2_DIRECTORY) && (entry.size & SFS2_SPARSE)) {
+            report("%s: directory is sparse", item_path(child));
+        }
+        if ((entry.size & SFS2_DIRECTORY) && (entry.size & SFS2_SHARED)) {
+            report("%s: directory is shared", item_path(child));
+        }
+
+        if (!(entry.size & SFS2_INLINE)) continue;
+        if (flags != SFS2_INLINE) {
+            report("%s: inline file has flags %llx", item_path(child),
+                   (unsigned long long) flags);
+        }
+        if ((entry.size & SFS2_SIZEMASK) > SFS_INLINE_MAX) {
+            report("%s: inline file has a size of %llu bytes", item_path(child),
+                   (unsigned long long) (entry.size & SFS2_SIZEMASK));
+        }
+        if (entry.first_block != SFS2_BLOCKIDX_END) {
+            report("%s: inline file has a chain", item_path(child));
+        }
+        if (i + 1 == nentries) {
+            report("%s: inline data is past the end of the directory", item_path(child));
+        }
+        inline_next = true;
+    }
+}
+
+/*
+ * Check directory `index`: its chain of units (claiming their blocks) and its
+ * entries, which are added to the items.
+ */
+void check_dir(size_t index) {
+    static char raw[SFS_ROOTDIR_SIZE];
+    size_t first_child = nitems;
+
+    if (index == 0) {
+        image_read(&img, raw, SFS_ROOTDIR_SIZE, img.rootdir_off);
+        check_unit(index, raw, SFS_ROOTDIR_NENTRIES);
+    } else {
+        unsigned unit_blocks = (img.dir_size + img.block_size - 1) / img.block_size;
+        sfs2_blockidx_t block = items[index].entry.first_block;
+        unsigned nunits = 0;
+
+        if (block == SFS2_BLOCKIDX_END) report("%s: directory has no blocks", item_path(index));
+
+        while (block != SFS2_BLOCKIDX_END) {
+            sfs2_blockidx_t first = block;
+            bool ok = true;
+
+            // each unit is on consecutive blocks, only the last one ends the chain
+            for (unsigned i = 0; i < unit_blocks && ok; i++) {
+                ok = claim(index, block, "directory block");
+                if (!ok) break;
+
+                sfs2_blockidx_t next = img.table[block - 1];
+                if (i + 1 < unit_blocks && next != block + 1) {
+                    report("%s: directory unit at %x is not on consecutive blocks",
+                           item_path(index), first);
+                    ok = false;
+                }
+                block = next;
+            }
+            if (!ok) break;
+
+            image_read(&img, raw, img.dir_size, image_block_offset(&img, first));
+            check_unit(index, raw, img.dir_size / IMAGE_ENTRY_SIZE);
+            nunits++;
+
+            if (block == SFS2_BLOCKIDX_EMPTY) {
+                report("%s: directory chain runs into a free block", item_path(index));
+                break;
+            }
+        }
+
+        if (img.version == 1 && nunits > 1) {
+            report("%s: directory has %u units, version 1 allows one", item_path(index), nunits);
+        }
+    }
+
+    // names are unique within a directory
+    size_t nchildren = nitems - first_child;
+    const char **names = malloc(nchildren * sizeof(char *) + 1);
+    if (names == NULL) {
+        perror("Could not allocate names");
+        exit(1);
+    }
+    for (size_t i = 0; i < nchildren; i++) names[i] = items[first_child + i].entry.filename;
+    qsort(names, nchildren, sizeof(char *), compare_names);
+    for (size_t i = 1; i < nchildren; i++) {
+        if (strcmp(names[i - 1], names[i]) == 0) {
+            report("%s: name '%s' appears more than once", item_path(index), names[i]);
+        }
+    }
+    free(names);
+}
+
+// check directory `index` and everything below it, listing it depth first
+void walk(size_t index) {
+    size_t first_child = nitems;
+    check_dir(index);
+    size_t end = nitems;
+
+    for (size_t i = first_child; i < end; i++) {
+        if (options.list) list_entry(items[i].path, &items[i].entry);
+        if (items[i].entry.size & SFS2_DIRECTORY) walk(i);
+    }
+}
+
+// check the chain of file `index` against its size
+void check_file(size_t index) {
+    const struct image_entry *entry = &items[index].entry;
+    if (entry->size & SFS2_INLINE) return;      // no chain, see check_unit()
+
+    uint64_t size = entry->size & SFS2_SIZEMASK;
+    uint64_t expected = (size + img.block_size - 1) / img.block_size;
+    uint64_t count = 0;
+
+    // a sparse file may have blocks reserved past its end
+    uint64_t max = entry->size & SFS2_SPARSE ? img.nblocks : expected;
+    for (sfs2_blockidx_t block = entry->first_block; block != SFS2_BLOCKIDX_END; count++) {
+        if (count == max && !(entry->size & SFS2_SPARSE)) {
+            report("%s: chain is longer than its size of %llu bytes", item_path(index),
+                   (unsigned long long) size);
+            return;
+        }
+        if (count == max) {
+            report("%s: chain is longer than the disk", item_path(index));
+            return;
+        }
+        if (!claim(index, block, "block")) return;
+
+        block = img.table[block - 1];
+        if (block == SFS2_BLOCKIDX_EMPTY) {
+            report("%s: chain runs into a free block", item_path(index));
+            return;
+        }
+    }
+
+    // a sparse file's chain ends where its hole begins
+    if (count < expected && !(entry->size & SFS2_SPARSE)) {
+        report("%s: chain of %llu blocks is too short for its size of %llu bytes",
+               item_path(index), (unsigned long long) count, (unsigned long long) size);
+    }
+}
+
+void *check_files(void *arg) {
+    (void) arg;
+
+    for (;;) {
+        size_t start = __atomic_fetch_add(&next_item, ITEMS_CHUNK, __ATOMIC_RELAXED);
+        if (start >= nitems) return NULL;
+
+        size_t end = start + ITEMS_CHUNK < nitems ? start + ITEMS_CHUNK : nitems;
+        for (size_t i = start; i < end; i++) {
+            if (!(items[i].entry.size & SFS2_DIRECTORY)) check_file(i);
+        }
+    }
+}
+
+/*
+ * Blocks in use that no chain reaches, in the part of the table of thread
+ * `arg`. They are freed in the table when repairing.
+ */
+void *check_orphans(void *arg) {
+    unsigned thread = (uintptr_t) arg;
+    uint32_t per_thread = (img.nblocks + options.threads - 1) / options.threads;
+    uint32_t start = thread * per_thread;
+    if (start >= img.nblocks) return NULL;      // more threads than blocks
+
+    uint32_t end = img.nblocks - start < per_thread ? img.nblocks : start + per_thread;
+    unsigned long found = 0;
+
+    for (uint32_t i = start; i < end; i++) {
+        if (img.table[i] == SFS2_BLOCKIDX_EMPTY || owner[i] != 0) continue;
+
+        debug("Block %x is in use but not part of any chain\n", i + 1);
+        if (repair) img.table[i] = SFS2_BLOCKIDX_EMPTY;
+        found++;
+    }
+
+    __atomic_fetch_add(&norphans, found, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+// run `fn` on `options.threads` threads, passing each its number
+void run_threads(void *(*fn)(void *)) {
+    pthread_t threads[MAX_THREADS];
+
+    for (unsigned i = 0; i < options.threads; i++) {
+        if (pthread_create(&threads[i], NULL, fn, (void *) (uintptr_t) i) != 0) {
+            perror("Could not create thread");
+            exit(1);
+        }
+    }
+    for (unsigned i = 0; i < options.threads; i++) pthread_join(threads[i], NULL);
+}
+
+static void show_help(const char *progname) {
+    printf("Usage: %s [OPTION]... FILE\n\n", progname);
+    printf("SFS file system integrity checker, for version 1 and 2 images.\n\n"
+           "Blocks in use that are not part of any file or directory are freed\n"
+           "if the image has no other errors, all other errors are only\n"
+           "reported. Note that block indices are printed in hexadecimal\n"
+           "format.\n\n");
+    printf("Options:\n"
+           " -l, --list             print the files and directories in the\n"
+           "                          image, along with their attributes.\n"
+           " -n, --read-only        open the image read-only and do not repair\n"
+           "                          anything.\n"
+           " -j, --threads COUNT    number of threads checking the chains\n"
+           "                          (default: one per CPU, at most %u).\n"
+           " -v, --verbose          report each orphan block and print\n"
+           "                          statistics.\n"
+           " -h, --help             show this help.\n", MAX_THREADS);
+}
+
+int main(int argc, char **argv) {
+    static const struct option long_options[] = {
+        { "list", no_argument, NULL, 'l' },
+        { "read-only", no_argument, NULL, 'n' },
+        { "threads", required_argument, NULL, 'j' },
+        { "verbose", no_argument, NULL, 'v' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    options.threads = ncpus > 0 ? ncpus : 1;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "lnj:vh", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'l': options.list = 1; break;
+        case 'n': options.readonly = 1; break;
+        case 'j': options.threads = strtoul(optarg, NULL, 0); break;
+        case 'v': options.verbose = 1; break;
+        case 'h': show_help(argv[0]); return 0;
+        default: show_help(argv[0]); return 1;
+        }
+    }
+
+    if (optind + 1 != argc) {
+        show_help(argv[0]);
+        return 1;
+    }
+    if (options.threads < 1) options.threads = 1;
+    if (options.threads > MAX_THREADS) options.threads = MAX_THREADS;
+
+    if (image_open(&img, argv[optind], options.readonly) != 0) return 1;
+    if (options.threads > img.nblocks) options.threads = img.nblocks;
+
+    owner = calloc(img.nblocks, sizeof(uint32_t));
+    if (owner == NULL) {
+        perror("Could not allocate owner map");
+        return 1;
+    }
+
+    struct image_entry root;
+    memset(&root, 0, sizeof(root));
+    root.size = SFS2_DIRECTORY;
+    item_add("", &root);
+    items[0].path[0] = '\0';
+    walk(0);
+
+    run_threads(check_files);
+
+    // the tail of a broken chain shows up as orphans, leave it for inspection
+    repair = !options.readonly && nerrors == 0;
+    run_threads(check_orphans);
+
+    if (norphans > 0) {
+        report("%lu blocks are in use but not part of any chain", norphans);
+        if (repair) {
+            image_write_table(&img);
+            if (fsync(img.fd) != 0) perror("Could not sync disk image");
+            printf("Freed %lu blocks\n", norphans);
+        }
+    }
+
+    debug("Version %d, %zu entries, %u blocks of %u bytes, %u threads, %u errors\n",
+          img.version, nitems - 1, img.nblocks, img.block_size, options.threads, nerrors);
+
+    return nerrors > 0;
+}
@@ -0,0 +1,622 @@
+/*
+ * SFS file system creator, a drop-in for the prebuilt mkfs.sfs that can also
+ * create version 2 images.
+ *
+ * The metadata of the image (block table and all directories) is built in
+ * memory and written at the end, each area with a single write. File contents
+ * go straight from the host file to the image, a run of consecutive blocks at
+ * a time, so a fresh image is written sequentially.
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "sfs.h"
+#include "sfsimage.h"
+
+#define DEFAULT_NBLOCKS     65536       // 256 MB at the default block size
+#define IO_CHUNK            (1 << 20)   // largest single write of file data
+
+#define DIR_ROOT            SFS2_BLOCKIDX_EMPTY
+
+/* Options passed from commandline arguments */
+struct options {
+    int append;
+    int randomize;
+    unsigned seed;
+    int quiet;
+    int verbose;
+    int version;
+    uint32_t block_size;
+    uint32_t nblocks;
+    int preallocate;
+} options;
+
+#define info(...) do { if (!options.quiet) printf(__VA_ARGS__); } while (0)
+#define debug(...) do { if (options.verbose) printf(__VA_ARGS__); } while (0)
+
+/*
+ * A directory of the image. All of them are loaded (or created) in memory and
+ * stored when the image is complete.
+ */
+struct dir {
+    struct dir *next;
+    char *path;                     // "" for the root directory
+    unsigned nunits;
+    sfs2_blockidx_t *units;         // first block of each unit, none for the root
+    unsigned nentries;              // in all units
+    struct image_entry *entries;
+};
+
+static struct sfs_image img;
+static struct dir *dirs, **dirs_tail = &dirs;
+static uint32_t nfree;              // free blocks
+static uint32_t cursor;             // table index where the search for free blocks starts
+static off_t used_end;              // end of the last block in use
+
+
+// number of blocks of a directory unit
+unsigned unit_blocks(void) {
+    return (img.dir_size + img.block_size - 1) / img.block_size;
+}
+
+// number of entries in each unit of `dir`
+unsigned unit_nentries(const struct dir *dir) {
+    return dir->path[0] == '\0' ? SFS_ROOTDIR_NENTRIES : img.dir_size / IMAGE_ENTRY_SIZE;
+}
+
+void use_block(sfs2_blockidx_t block) {
+    off_t end = image_block_offset(&img, block) + img.block_size;
+
+    if (end > used_end) used_end = end;
+}
+
+struct dir *dir_new(const char *path) {
+    struct dir *dir = calloc(1, sizeof(struct dir));
+    if (dir == NULL || (dir->path = strdup(path)) == NULL) {
+        perror("Could not allocate directory");
+        exit(1);
+    }
+
+    *dirs_tail = dir;
+    dirs_tail = &dir->next;
+    return dir;
+}
+
+struct dir *dir_find(const char *path) {
+    for (struct dir *dir = dirs; dir != NULL; dir = dir->next) {
+        if (strcmp(dir->path, path) == 0) return dir;
+    }
+
+    return NULL;
+}
+
+// append a unit starting at `block` (DIR_ROOT for the root) with empty entries
+void dir_add_unit(struct dir *dir, sfs2_blockidx_t block) {
+    unsigned n = unit_nentries(dir);
+
+    dir->units = realloc(dir->units, (dir->nunits + 1) * sizeof(sfs2_blockidx_t));
+    dir->entries = realloc(dir->entries, (dir->nentries + n) * sizeof(struct image_entry));
+    if (dir->units == NULL || dir->entries == NULL) {
+        perror("Could not allocate directory");
+        exit(1);
+    }
+
+    dir->units[dir->nunits++] = block;
+    memset(&dir->entries[dir->nentries], 0, n * sizeof(struct image_entry));
+    dir->nentries += n;
+}
+
+// disk offset of unit `unit` of `dir`
+off_t dir_unit_offset(const struct dir *dir, unsigned unit) {
+    if (dir->path[0] == '\0') return img.rootdir_off;
+
+    return image_block_offset(&img, dir->units[unit]);
+}
+
+/*
+ * Read the units of `dir`, the subdirectory starting at `first_block` or the
+ * root directory, from an existing image, and queue its subdirectories.
+ */
+void dir_load(struct dir *dir, sfs2_blockidx_t first_block) {
+    unsigned n = unit_nentries(dir);
+    char raw[SFS_ROOTDIR_SIZE];
+
+    sfs2_blockidx_t block = first_block;
+    for (unsigned unit = 0; block != SFS2_BLOCKIDX_END; unit++) {
+        dir_add_unit(dir, block);
+        image_read(&img, raw, n * IMAGE_ENTRY_SIZE, dir_unit_offset(dir, unit));
+        for (unsigned i = 0; i < n; i++) {
+            image_entry_decode(&img, raw + i * IMAGE_ENTRY_SIZE,
+                               &dir->entries[unit * n + i]);
+        }
+
+        if (block == DIR_ROOT) break;
+
+        // skip to the next unit, on images that are in shape
+        for (unsigned i = 0; i < unit_blocks() && block != SFS2_BLOCKIDX_END; i++) {
+            if (block == SFS2_BLOCKIDX_EMPTY || block > img.nblocks ||
+                unit > img.nblocks) {
+                fprintf(stderr, "Error: broken directory '%s', run fsck first\n", dir->path);
+                exit(1);
+            }
+            use_block(block);
+            block = img.table[block - 1];
+        }
+    }
+
+    for (unsigned i = 0; i < dir->nentries; i++) {
+        const struct image_entry *entry = &dir->entries[i];
+        if (entry->filename[0] == '\0' || entry->filename[0] == SFS_INLINE_MARK ||
+            !(entry->size & SFS2_DIRECTORY)) {
+            continue;
+        }
+
+        char path[strlen(dir->path) + 1 + SFS_FILENAME_MAX];
+        snprintf(path, sizeof(path), "%s/%.*s", dir->path, SFS_FILENAME_MAX - 1,
+                 entry->filename);
+        dir_load(dir_new(path), entry->first_block);
+    }
+}
+
+// blockidx of the first free block at table index `from` or after, wrapping around
+sfs2_blockidx_t next_free(uint32_t from) {
+    for (uint32_t i = from; ; i = i + 1 < img.nblocks ? i + 1 : 0) {
+        if (img.table[i] == SFS2_BLOCKIDX_EMPTY) return i + 1;
+    }
+}
+
+// first run of `count` free blocks in table indices [start, end), or EMPTY
+sfs2_blockidx_t find_run_in(uint32_t start, uint32_t end, unsigned count) {
+    unsigned run = 0;
+
+    for (uint32_t i = start; i < end; i++) {
+        run = img.table[i] == SFS2_BLOCKIDX_EMPTY ? run + 1 : 0;
+        if (run == count) return i + 2 - count;
+    }
+
+    return SFS2_BLOCKIDX_EMPTY;
+}
+
+// a run of `count` free blocks, from the cursor (or a random place) on
+sfs2_blockidx_t find_free_run(unsigned count) {
+    uint32_t from = options.randomize ? (uint32_t) rand() % img.nblocks : cursor;
+
+    sfs2_blockidx_t block = find_run_in(from, img.nblocks, count);
+    if (block == SFS2_BLOCKIDX_EMPTY) {
+        uint32_t end = from + count - 1 < img.nblocks ? from + count - 1 : img.nblocks;
+        block = find_run_in(0, end, count);
+    }
+
+    return block;
+}
+
+/*
+ * Allocate a chain of `count` blocks, on consecutive blocks if possible (at
+ * random places with --randomize). Returns its first block, END for no blocks
+ * or EMPTY if there are not enough free blocks.
+ */
+sfs2_blockidx_t alloc_chain(unsigned count) {
+    if (count == 0) return SFS2_BLOCKIDX_END;
+    if (count > nfree) return SFS2_BLOCKIDX_EMPTY;
+
+    sfs2_blockidx_t run = options.randomize ? SFS2_BLOCKIDX_EMPTY : find_free_run(count);
+    sfs2_blockidx_t first = SFS2_BLOCKIDX_END, prev = SFS2_BLOCKIDX_END;
+
+    for (unsigned i = 0; i < count; i++) {
+        sfs2_blockidx_t block;
+        if (run != SFS2_BLOCKIDX_EMPTY) {
+            block = run + i;
+        } else {
+            block = next_free(options.randomize ? (uint32_t) rand() % img.nblocks : cursor);
+        }
+
+        img.table[block - 1] = SFS2_BLOCKIDX_END;
+        if (prev == SFS2_BLOCKIDX_END) {
+            first = block;
+        } else {
+            img.table[prev - 1] = block;
+        }
+        prev = block;
+        cursor = block < img.nblocks ? block : 0;
+        use_block(block);
+    }
+    nfree -= count;
+
+    return first;
+}
+
+// allocate a unit of consecutive blocks for a directory, EMPTY if there is no room
+sfs2_blockidx_t alloc_dir_unit(void) {
+    unsigned count = unit_blocks();
+    if (count > nfree) return SFS2_BLOCKIDX_EMPTY;
+
+    sfs2_blockidx_t block = find_free_run(count);
+    if (block == SFS2_BLOCKIDX_EMPTY) return SFS2_BLOCKIDX_EMPTY;
+
+    for (unsigned i = 0; i < count; i++) {
+        img.table[block + i - 1] = i + 1 < count ? block + i + 1 : SFS2_BLOCKIDX_END;
+        use_block(block + i);
+    }
+    nfree -= count;
+    cursor = block + count - 1 < img.nblocks ? block + count - 1 : 0;
+
+    return block;
+}
+
+// index of entry `name` in `dir`, -1 if there is none
+int dir_lookup(const struct dir *dir, const char *name) {
+    for (unsigned i = 0; i < dir->nentries; i++) {
+        if (strcmp(dir->entries[i].filename, name) == 0) return i;
+    }
+
+    return -1;
+}
+
+/*
+ * Index of a free entry of `dir` (the first one, or a random one with
+ * --randomize), adding a unit to subdirectories of version 2 images when they
+ * are full. Returns -1 if there is none.
+ */
+int dir_free_slot(struct dir *dir) {
+    unsigned nfree_slots = 0;
+    for (unsigned i = 0; i < dir->nentries; i++) {
+        nfree_slots += dir->entries[i].filename[0] == '\0';
+    }
+
+    if (nfree_slots == 0) {
+        if (dir->path[0] == '\0' || img.version == 1) return -1;
+
+        sfs2_blockidx_t block = alloc_dir_unit();
+        if (block == SFS2_BLOCKIDX_EMPTY) return -1;
+
+        sfs2_blockidx_t last = dir->units[dir->nunits - 1] + unit_blocks() - 1;
+        img.table[last - 1] = block;
+        dir_add_unit(dir, block);
+        nfree_slots = unit_nentries(dir);
+    }
+
+    unsigned pick = options.randomize ? (unsigned) rand() % nfree_slots : 0;
+    for (unsigned i = 0; i < dir->nentries; i++) {
+        if (dir->entries[i].filename[0] == '\0' && pick-- == 0) return i;
+    }
+
+    return -1;
+}
+
+// fill in a free entry of `parent`, returns -1 after printing why it failed
+int add_entry(struct dir *parent, const char *name, sfs2_blockidx_t first_block,
+              uint64_t size, const char *what, const char *path) {
+    int slot = dir_free_slot(parent);
+    if (slot < 0) {
+        fprintf(stderr, "Error: Cannot create %s '%s': directory '%s/' is full\n", what,
+                path, parent->path);
+        return -1;
+    }
+
+    struct image_entry *entry = &parent->entries[slot];
+    strcpy(entry->filename, name);
+    entry->first_block = first_block;
+    entry->size = size;
+
+    return 0;
+}
+
+// subdirectory `name` of `parent`, created if need be; NULL on error
+struct dir *make_dir(struct dir *parent, const char *name, const char *path) {
+    char dir_path[strlen(parent->path) + 1 + strlen(name) + 1];
+    snprintf(dir_path, sizeof(dir_path), "%s/%s", parent->path, name);
+
+    int slot = dir_lookup(parent, name);
+    if (slot >= 0) {
+        if (parent->entries[slot].size & SFS2_DIRECTORY) return dir_find(dir_path);
+
+        fprintf(stderr, "Error: Cannot create directory '%s' for path '%s': a file with "
+                "the same name in the parent directory already exists.\n", name, path);
+        return NULL;
+    }
+
+    sfs2_blockidx_t block = alloc_dir_unit();
+    if (block == SFS2_BLOCKIDX_EMPTY) {
+        fprintf(stderr, "Error: Cannot create directory '%s': disk is full\n", dir_path);
+        return NULL;
+    }
+    if (add_entry(parent, name, block, SFS2_DIRECTORY, "directory", dir_path) != 0) {
+        return NULL;
+    }
+
+    info("Creating directory '%s' at blocks %04x-%04x\n", name, block,
+         block + unit_blocks() - 1);
+
+    struct dir *dir = dir_new(dir_path);
+    dir_add_unit(dir, block);
+    return dir;
+}
+
+// copy `size` bytes of `host_fd` to the chain starting at `block`
+int write_file_data(int host_fd, const char *host, sfs2_blockidx_t block, uint64_t size) {
+    static char buf[IO_CHUNK];
+    uint64_t done = 0;
+
+    while (done < size) {
+        // the run of consecutive blocks starting at `block`, up to a chunk
+        sfs2_blockidx_t last = block;
+        while ((uint64_t) (last - block + 2) * img.block_size <= IO_CHUNK &&
+               img.table[last - 1] == last + 1) {
+            last++;
+        }
+
+        size_t len = (size_t) (last - block + 1) * img.block_size;
+        if (len > size - done) len = size - done;
+
+        size_t got = 0;
+        while (got < len) {
+            ssize_t ret = read(host_fd, buf + got, len - got);
+            if (ret < 0 && errno == EINTR) continue;
+            if (ret <= 0) {
+                fprintf(stderr, "Error: Could not read host file '%s'%s%s\n", host,
+                        ret < 0 ? ": " : " (it shrank)", ret < 0 ? strerror(errno) : "");
+                return -1;
+            }
+            got += ret;
+        }
+
+        // reused blocks may hold old data past the end of the file
+        size_t padded = (len + img.block_size - 1) / img.block_size * img.block_size;
+        memset(buf + len, 0, padded - len);
+
+        image_write(&img, buf, padded, image_block_offset(&img, block));
+        done += len;
+        block = img.table[last - 1];
+    }
+
+    return 0;
+}
+
+// file `name` in `parent`, with the contents of `host` unless it is NULL
+int make_file(struct dir *parent, const char *name, const char *path, const char *host) {
+    if (dir_lookup(parent, name) >= 0) {
+        fprintf(stderr, "Error: Cannot create file '%s': already exists\n", path);
+        return -1;
+    }
+
+    if (host == NULL) {
+        info("Creating empty file '%s'\n", path);
+        return add_entry(parent, name, SFS2_BLOCKIDX_END, 0, "file", path);
+    }
+
+    info("Creating file '%s' from host file '%s'\n", path, host);
+
+    int host_fd = open(host, O_RDONLY);
+    struct stat st;
+    if (host_fd < 0 || fstat(host_fd, &st) < 0) {
+        fprintf(stderr, "Error: Could not open host file '%s': %s\n", host, strerror(errno));
+        if (host_fd >= 0) close(host_fd);
+        return -1;
+    }
+
+    uint64_t size = st.st_size;
+    unsigned count = (size + img.block_size - 1) / img.block_size;
+    sfs2_blockidx_t first_block = SFS2_BLOCKIDX_EMPTY;
+    int result = -1;
+
+    if (size > img.size_max) {
+        fprintf(stderr, "Error: Host file '%s' is too large\n", host);
+    } else if ((first_block = alloc_chain(count)) == SFS2_BLOCKIDX_EMPTY) {
+        fprintf(stderr, "Error: Cannot create file '%s': disk is full\n", path);
+    } else {
+        debug(" Host file '%s' is %llu bytes, %u blocks from %04x\n", host,
+              (unsigned long long) size, count, first_block);
+        result = write_file_data(host_fd, host, first_block, size);
+        if (result == 0) result = add_entry(parent, name, first_block, size, "file", path);
+    }
+
+    close(host_fd);
+    return result;
+}
+
+/*
+ * Create the entry described by `arg`: "/foo/" for a directory, "/foo" for an
+ * empty file and "/foo:bar" for a file with the contents of host file bar.
+ * Missing intermediate directories are created along the way.
+ */
+int create(char *arg) {
+    char *host = strchr(arg, ':');
+    if (host != NULL) *host++ = '\0';
+
+    size_t len = strlen(arg);
+    bool is_dir = len > 1 && arg[len - 1] == '/';
+    if (is_dir) arg[--len] = '\0';
+
+    if (arg[0] != '/' || len < 2 || (is_dir && host != NULL)) {
+        fprintf(stderr, "Error: Invalid argument '%s'\n", arg);
+        return -1;
+    }
+
+    char path[len + 1];
+    strcpy(path, arg);
+
+    struct dir *dir = dir_find("");
+    for (char *name = arg + 1; dir != NULL; ) {
+        char *slash = strchr(name, '/');
+        if (slash != NULL) *slash = '\0';
+
+        if (name[0] == '\0' || strlen(name) >= img.filename_max) {
+            fprintf(stderr, "Error: Invalid name '%s' in path '%s'\n", name, path);
+            return -1;
+        }
+
+        if (slash == NULL) {
+            if (is_dir) return make_dir(dir, name, path) != NULL ? 0 : -1;
+            return make_file(dir, name, path, host);
+        }
+
+        dir = make_dir(dir, name, path);
+        name = slash + 1;
+    }
+
+    return -1;
+}
+
+// write the directories, the block table and the header to the image
+void image_store(void) {
+    static char raw[SFS_ROOTDIR_SIZE];
+
+    for (struct dir *dir = dirs; dir != NULL; dir = dir->next) {
+        unsigned n = unit_nentries(dir);
+
+        for (unsigned unit = 0; unit < dir->nunits; unit++) {
+            for (unsigned i = 0; i < n; i++) {
+                image_entry_encode(&img, &dir->entries[unit * n + i],
+                                   raw + i * IMAGE_ENTRY_SIZE);
+            }
+            image_write(&img, raw, n * IMAGE_ENTRY_SIZE, dir_unit_offset(dir, unit));
+        }
+    }
+
+    image_write_table(&img);
+    image_write_header(&img);
+}
+
+static void show_help(const char *progname) {
+    printf("Usage: %s [OPTION]... FILE [CREATE]...\n\n", progname);
+    printf("SFS file system creator.\n\n"
+           "Creates the disk image FILE, with optional contents specified by\n"
+           "the CREATE arguments. Valid options for CREATE arguments are:\n\n"
+           "  /foo/     create directory /foo\n"
+           "  /foo      create empty file /foo\n"
+           "  /foo:bar  create file /foo with contents of (host) file bar\n\n"
+           "Intermediate directories are created as needed for all options\n\n");
+    printf("Options:\n"
+           " -a, --append          append extra files to an existing image,\n"
+           "                         instead of creating a fresh file system\n"
+           " -r, --randomize       randomize directory entry indices and blocks\n"
+           "                         used for files.\n"
+           " -s, --seed SEED       use the specified seed for randomization.\n"
+           "                         implies --randomize\n"
+           " -2, --v2              create a version 2 image\n"
+           " -B, --block-size SIZE block size of a version 2 image, a power of\n"
+           "                         two from %u to %u (default: %u).\n"
+           "                         implies --v2\n"
+           " -N, --blocks COUNT    number of blocks of a version 2 image\n"
+           "                         (default: %u). implies --v2\n"
+           " -p, --preallocate     reserve space for the whole disk in FILE,\n"
+           "                         instead of ending it after the last block\n"
+           "                         in use\n"
+           " -q, --quiet           don't print any output (except errors).\n"
+           " -v, --verbose         print verbose output.\n"
+           " -h, --help            show this help.\n",
+           SFS2_BLOCK_SIZE_MIN, SFS2_BLOCK_SIZE_MAX, SFS2_BLOCK_SIZE_DEFAULT,
+           DEFAULT_NBLOCKS);
+}
+
+int main(int argc, char **argv) {
+    static const struct option long_options[] = {
+        { "append", no_argument, NULL, 'a' },
+        { "randomize", no_argument, NULL, 'r' },
+        { "seed", required_argument, NULL, 's' },
+        { "v2", no_argument, NULL, '2' },
+        { "block-size", required_argument, NULL, 'B' },
+        { "blocks", required_argument, NULL, 'N' },
+        { "preallocate", no_argument, NULL, 'p' },
+        { "quiet", no_argument, NULL, 'q' },
+        { "verbose", no_argument, NULL, 'v' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    options.version = 1;
+    options.block_size = SFS2_BLOCK_SIZE_DEFAULT;
+    options.nblocks = DEFAULT_NBLOCKS;
+    options.seed = time(NULL) ^ getpid();
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "ars:2B:N:pqvh", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'a': options.append = 1; break;
+        case 'r': options.randomize = 1; break;
+        case 's': options.randomize = 1; options.seed = strtoul(optarg, NULL, 0); break;
+        case '2': options.version = 2; break;
+        case 'B': options.version = 2; options.block_size = strtoul(optarg, NULL, 0); break;
+        case 'N': options.version = 2; options.nblocks = strtoul(optarg, NULL, 0); break;
+        case 'p': options.preallocate = 1; break;
+        case 'q': options.quiet = 1; break;
+        case 'v': options.verbose = 1; break;
+        case 'h': show_help(argv[0]); return 0;
+        default: show_help(argv[0]); return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        show_help(argv[0]);
+        return 1;
+    }
+    srand(options.seed);
+    if (options.randomize) debug("Using seed %u\n", options.seed);
+
+    const char *filename = argv[optind++];
+    if (options.append) {
+        info("Appending to existing SFS filesystem\n");
+        if (image_open(&img, filename, false) != 0) return 1;
+    } else {
+        int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            perror("Could not create disk image");
+            return 1;
+        }
+        if (image_init(&img, fd, options.version, options.block_size, options.nblocks) != 0) {
+            fprintf(stderr, "Error: Invalid geometry, %u blocks of %u bytes\n",
+                    options.nblocks, options.block_size);
+            return 1;
+        }
+        info("Creating fresh SFS filesystem\n");
+        if (img.version == 2) {
+            debug(" Version 2, %u blocks of %u bytes\n", img.nblocks, img.block_size);
+        }
+    }
+
+    used_end = img.data_off;
+    for (uint32_t i = 0; i < img.nblocks; i++) {
+        nfree += img.table[i] == SFS2_BLOCKIDX_EMPTY;
+    }
+    struct dir *root = dir_new("");
+    if (options.append) {
+        dir_load(root, DIR_ROOT);
+    } else {
+        dir_add_unit(root, DIR_ROOT);
+    }
+
+    int err = 0;
+    for (int i = optind; i < argc && !err; i++) {
+        err = create(argv[i]) != 0;
+    }
+
+    // the image is written even on errors, with everything created so far
+    image_store();
+
+    int ret = 0;
+    uint64_t disk_size = image_disk_size(&img);
+    if (options.preallocate) {
+        ret = posix_fallocate(img.fd, 0, disk_size);
+        if (ret != 0) fprintf(stderr, "Error: Could not preallocate image: %s\n", strerror(ret));
+    } else if (used_end > img.file_size) {
+        ret = ftruncate(img.fd, used_end);
+        if (ret != 0) perror("Could not extend disk image");
+    }
+
+    if (close(img.fd) != 0) {
+        perror("Could not write disk image");
+        ret = -1;
+    }
+
+    return err || ret != 0 ? 1 : 0;
+}
@@ -0,0 +1,351 @@
+#!/usr/bin/env python3
+#
+# Regression tests for the driver and the tools built by tools.mk, on version 1
+# and version 2 images: every test creates an image with sfs-mkfs, works on it
+# (through the mounted driver, for most tests), and checks it with sfs-fsck and,
+# for version 1 images, fsck.sfs afterwards. Run from this directory after
+# `make` and `make -f tools.mk`. Tests that mount are skipped without FUSE.
+
+import argparse
+import errno
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+import traceback
+from contextlib import contextmanager, suppress
+
+
+FUSE_BIN = './sfs'
+MKFS = './sfs-mkfs'
+FSCK = './sfs-fsck'
+DEFRAG = './sfs-defrag'
+FSCK_V1 = './fsck.sfs'
+
+# Maximum time to wait for a mount or unmount, in seconds.
+TIMEOUT = 30
+
+# Small version 2 image for the tests that fill it up.
+SMALL_IMAGE = ['-2', '-B', '4096', '-N', '256']
+
+
+class TestError(Exception):
+    pass
+
+
+def run_cmd(args, allow_err=False):
+    proc = subprocess.run(args, stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                          universal_newlines=True, timeout=TIMEOUT)
+    if proc.returncode != 0 and not allow_err:
+        raise TestError('%s failed (%d):\n%s' % (' '.join(args), proc.returncode,
+                                                 proc.stdout))
+    return proc.stdout
+
+
+def expect_errno(err, func, *args):
+    try:
+        func(*args)
+    except OSError as e:
+        if e.errno != err:
+            raise TestError('expected %s, got %s' % (errno.errorcode[err],
+                                                      errno.errorcode.get(e.errno)))
+        return
+    raise TestError('expected %s, call succeeded' % errno.errorcode[err])
+
+
+def expect_equal(what, got, expected):
+    if got != expected:
+        raise TestError('%s: expected %r, got %r' % (what, expected, got))
+
+
+def data(size, seed=0):
+    return bytes((i * 31 + seed) & 0xff for i in range(size))
+
+
+class Image:
+    def __init__(self, workdir, version, mkfs_args=(), create=()):
+        self.path = os.path.join(workdir, 'test.img')
+        self.version = version
+        with suppress(FileNotFoundError):
+            os.unlink(self.path)
+        args = [MKFS, '-q']
+        if version == 2 and '-2' not in mkfs_args:
+            args.append('-2')
+        run_cmd(args + list(mkfs_args) + [self.path] + list(create))
+
+    def fsck(self):
+        out = run_cmd([FSCK, '-n', self.path], allow_err=True)
+        if out:
+            raise TestError('sfs-fsck on the image:\n' + out)
+        if self.version == 1:
+            out = run_cmd([FSCK_V1, self.path], allow_err=True)
+            if out:
+                raise TestError('fsck.sfs on the image:\n' + out)
+
+    def listing(self):
+        out = run_cmd([FSCK, '-n', '-l', self.path])
+        return {line.split()[2]: line.split()[1] for line in out.splitlines()}
+
+
+@contextmanager
+def mounted(image, mountpoint, driver_args):
+    proc = subprocess.Popen([FUSE_BIN, '-i', image.path] + driver_args + [mountpoint],
+                            stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+    deadline = time.time() + TIMEOUT
+    while not os.path.ismount(mountpoint):
+        if proc.poll() is not None:
+            raise TestError('driver exited (%d) before mounting:\n%s' %
+                            (proc.returncode, proc.stderr.read().decode()))
+        if time.time() > deadline:
+            proc.kill()
+            raise TestError('mount timed out')
+        time.sleep(0.05)
+    try:
+        yield mountpoint
+    finally:
+        run_cmd(['fusermount', '-u', mountpoint], allow_err=True)
+        try:
+            proc.wait(TIMEOUT)
+        except subprocess.TimeoutExpired:
+            proc.kill()
+            proc.wait()
+            raise TestError('driver did not exit after unmount')
+    if proc.returncode != 0:
+        raise TestError('driver exited with %d:\n%s' %
+                        (proc.returncode, proc.stderr.read().decode()))
+
+
+#
+# Tests of the tools alone: a test gets the work directory and image version.
+#
+
+def test_mkfs_fsck(workdir, version):
+    host = os.path.join(workdir, 'host')
+    with open(host, 'wb') as f:
+        f.write(data(3 * 4096 + 100))
+    image = Image(workdir, version, create=['/dir/', '/dir/sub/', '/dir/file:' + host,
+                                            '/empty'])
+    listing = image.listing()
+    for name in ('/dir/', '/dir/sub/', '/dir/file', '/empty'):
+        if name not in listing:
+            raise TestError('%s is not on the image:\n%s' % (name, listing))
+    image.fsck()
+
+
+def test_defrag_clean(workdir, version):
+    image = Image(workdir, version, create=['/a', '/b/'])
+    out = run_cmd([DEFRAG, '-n', image.path])
+    if 'extents before' not in out:
+        raise TestError('unexpected sfs-defrag output:\n' + out)
+    image.fsck()
+
+
+#
+# Tests through the driver: a test gets the mountpoint and image version.
+#
+
+def test_rename_keeps_inode(mnt, version):
+    a, b = os.path.join(mnt, 'a'), os.path.join(mnt, 'b')
+    os.mkdir(a)
+    os.mkdir(b)
+    with open(os.path.join(a, 'f'), 'wb') as f:
+        f.write(data(5000))
+    ino = os.stat(os.path.join(a, 'f')).st_ino
+    os.rename(os.path.join(a, 'f'), os.path.join(b, 'f'))
+    expect_equal('inode after rename', os.stat(os.path.join(b, 'f')).st_ino, ino)
+
+    ino = os.stat(a).st_ino
+    os.rename(a, os.path.join(b, 'a'))
+    expect_equal('directory inode after rename', os.stat(os.path.join(b, 'a')).st_ino, ino)
+    expect_errno(errno.EINVAL, os.rename, b, os.path.join(b, 'a', 'b'))
+
+    with open(os.path.join(b, 'f'), 'rb') as f:
+        expect_equal('data after rename', f.read(), data(5000))
+
+
+def test_unlink_open(mnt, version):
+    path = os.path.join(mnt, 'f')
+    fd = os.open(path, os.O_RDWR | os.O_CREAT, 0o644)
+    try:
+        os.write(fd, data(10000))
+        os.unlink(path)
+        if os.path.exists(path):
+            raise TestError('file still exists after unlink')
+        os.pwrite(fd, data(10000, 1), 10000)
+        expect_equal('size of unlinked file', os.fstat(fd).st_size, 20000)
+        expect_equal('data of unlinked file', os.pread(fd, 20000, 0),
+                     data(10000) + data(10000, 1))
+    finally:
+        os.close(fd)
+
+    # a name may be reused while the old file is still open
+    fd = os.open(path, os.O_RDWR | os.O_CREAT, 0o644)
+    os.write(fd, b'x' * 10)
+    os.unlink(path)
+    with open(path, 'wb') as f:
+        f.write(b'new')
+    os.close(fd)
+    with open(path, 'rb') as f:
+        expect_equal('data of reused name', f.read(), b'new')
+
+
+def test_truncate(mnt, version):
+    path = os.path.join(mnt, 'f')
+    with open(path, 'wb') as f:
+        f.write(data(3 * 4096))
+    os.truncate(path, 100)
+    os.truncate(path, 2 * 4096 + 1)
+    with open(path, 'rb') as f:
+        expect_equal('data after truncate', f.read(),
+                     data(100) + bytes(2 * 4096 + 1 - 100))
+
+
+def test_stats_and_control(mnt, version):
+    with open(os.path.join(mnt, '.sfs_stats')) as f:
+        if 'disk reads' not in f.read():
+            raise TestError('no disk statistics in .sfs_stats')
+    expect_errno(errno.EACCES, os.open, os.path.join(mnt, '.sfs_stats'), os.O_WRONLY)
+
+    with open(os.path.join(mnt, 'f'), 'wb') as f:
+        f.write(data(5 * 4096))
+    fd = os.open(os.path.join(mnt, '.sfs_control'), os.O_RDWR)
+    try:
+        os.write(fd, b'defrag\n')
+        out = os.pread(fd, 4096, 0).decode()
+    finally:
+        os.close(fd)
+    if 'extents before' not in out:
+        raise TestError('unexpected defrag output:\n' + out)
+
+
+def test_clone_disk_full(mnt, version):
+    src, clone = os.path.join(mnt, 'src'), os.path.join(mnt, 'clone')
+    with open(src, 'wb') as f:
+        f.write(data(32 * 4096))
+    with open(os.path.join(mnt, '.sfs_control'), 'w') as f:
+        f.write('clone /src /clone\n')
+
+    # fill up the image, the clone can then copy none of its blocks
+    fd = os.open(os.path.join(mnt, 'fill'), os.O_WRONLY | os.O_CREAT, 0o644)
+    try:
+        while True:
+            os.write(fd, bytes(4096))
+    except OSError as e:
+        if e.errno != errno.ENOSPC:
+            raise
+    finally:
+        os.close(fd)
+
+    fd = os.open(clone, os.O_RDWR)
+    try:
+        expect_errno(errno.ENOSPC, os.posix_fallocate, fd, 0, 40 * 4096)
+        expect_errno(errno.ENOSPC, os.ftruncate, fd, 16 * 4096)
+        expect_equal('size of clone', os.fstat(fd).st_size, 32 * 4096)
+    finally:
+        os.close(fd)
+    for path in (src, clone):
+        with open(path, 'rb') as f:
+            expect_equal('data of ' + os.path.basename(path), f.read(), data(32 * 4096))
+
+    os.unlink(os.path.join(mnt, 'fill'))
+    with open(clone, 'r+b') as f:
+        f.write(b'changed')
+    with open(src, 'rb') as f:
+        expect_equal('data of src', f.read(), data(32 * 4096))
+
+
+TOOL_TESTS = [
+    ('mkfs and fsck', test_mkfs_fsck, (1, 2)),
+    ('defrag of a clean image', test_defrag_clean, (1, 2)),
+]
+
+# (name, function, versions, extra sfs-mkfs arguments)
+MOUNT_TESTS = [
+    ('rename keeps inode', test_rename_keeps_inode, (1, 2), []),
+    ('unlink while open', test_unlink_open, (1, 2), []),
+    ('truncate', test_truncate, (1, 2), []),
+    ('stats and control', test_stats_and_control, (1, 2), []),
+    ('clone on a full disk', test_clone_disk_full, (2,), SMALL_IMAGE),
+]
+
+# driver arguments: path and low-level frontend, without and with write cache
+DRIVER_CONFIGS = [[], ['-l'], ['-c', '256'], ['-l', '-c', '256']]
+
+
+def can_mount():
+    return (os.path.exists(FUSE_BIN) and os.path.exists('/dev/fuse') and
+            shutil.which('fusermount') is not None)
+
+
+def run_test(name, func, verbose):
+    try:
+        func()
+    except Exception as e:
+        print('FAIL  %s: %s' % (name, e))
+        if verbose and not isinstance(e, TestError):
+            traceback.print_exc()
+        return False
+    if verbose:
+        print('ok    %s' % name)
+    return True
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Regression tests for the SFS '
+                                     'driver and tools.')
+    parser.add_argument('-v', '--verbose', action='store_true',
+                        help='list passing tests as well')
+    parser.add_argument('-k', '--filter', default='',
+                        help='only run tests whose name contains this')
+    opts = parser.parse_args()
+
+    for tool in (MKFS, FSCK, DEFRAG):
+        if not os.path.exists(tool):
+            print('%s not found, run `make -f tools.mk` first' % tool)
+            return 1
+
+    workdir = tempfile.mkdtemp(prefix='sfs-regress-')
+    mountpoint = os.path.join(workdir, 'mnt')
+    os.mkdir(mountpoint)
+    total = failed = 0
+    try:
+        for name, func, versions in TOOL_TESTS:
+            for version in versions:
+                full = '%s (v%d)' % (name, version)
+                if opts.filter not in full:
+                    continue
+                total += 1
+                if not run_test(full, lambda: func(workdir, version), opts.verbose):
+                    failed += 1
+
+        if not can_mount():
+            print('FUSE is not available, skipping the tests that mount')
+        else:
+            for name, func, versions, mkfs_args in MOUNT_TESTS:
+                for version in versions:
+                    for driver_args in DRIVER_CONFIGS:
+                        full = '%s (v%d%s)' % (name, version,
+                                               ''.join(' ' + a for a in driver_args))
+                        if opts.filter not in full:
+                            continue
+
+                        def test():
+                            image = Image(workdir, version, mkfs_args)
+                            with mounted(image, mountpoint, driver_args) as mnt:
+                                func(mnt, version)
+                            image.fsck()
+
+                        total += 1
+                        if not run_test(full, test, opts.verbose):
+                            failed += 1
+    finally:
+        shutil.rmtree(workdir, ignore_errors=True)
+
+    print('%d of %d tests passed' % (total - failed, total))
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -1,25 +1,39 @@
 #define FUSE_USE_VERSION 26
 
 #include <errno.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdlib.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <limits.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "sfs.h"
 #include "diskio.h"
 
 
 static const char default_img[] = "test.img";
+#define DEFAULT_CACHE_KB    0
+#define DEFAULT_MAX_IO_KB   128
+#define DEFAULT_TIMEOUT     1.0
 
 /* Options passed from commandline arguments */
 struct options {
     const char *img;
     int background;
+    int mmap;
+    int lowlevel;
+    unsigned cache_size;
+    unsigned max_io;
+    double timeout;
     int verbose;
     int show_help;
     int show_fuse_help;
@@ -36,612 +50,4857 @@ struct options {
 /* libfuse2 leaks, so let's shush LeakSanitizer if we are using Asan. */
 const char *__asan_default_options() { return "detect_leaks=0"; }
 
-int get_entry(const char *path, struct sfs_entry *result) {
-    struct sfs_entry buffer = {};
 
-    char *path_copy = strdup(path);
-    char *token = strtok(path_copy, "/");
-    if (strlen(token) >= SFS_FILENAME_MAX) {
-        printf("Error: endpoint name too long: %s", token);
-        return -ENAMETOOLONG;
+/*
+ * Requests come in on several threads. Lookups, readdir and reads take fs_lock
+ * shared; anything that changes the block table, a directory or file data takes
+ * it exclusively. The caches below have their own mutex, cache_lock, taken only
+ * inside fs_lock or without it, and never held across disk I/O.
+ */
+static pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ * Runtime statistics, read from /.sfs_stats (see stats_report()). Every thread
+ * counts in a struct sfs_stats of its own; reading adds them up under
+ * stats_lock, which only guards the list. Exiting threads add theirs to
+ * stats_retired.
+ */
+#define STATS_OPS(X)                                                    \
+    X(lookup) X(getattr) X(setattr) X(opendir) X(readdir) X(open)       \
+    X(read) X(release) X(mkdir) X(rmdir) X(unlink) X(create)            \
+    X(truncate) X(write) X(write_buf) X(rename) X(flush) X(fsync)         \
+    X(fallocate)
+
+#define STATS_OP_ENUM(op)   STATS_OP_##op,
+#define STATS_OP_NAME(op)   #op,
+
+enum stats_op { STATS_OPS(STATS_OP_ENUM) STATS_NOPS };
+static const char *const stats_op_names[STATS_NOPS] = { STATS_OPS(STATS_OP_NAME) };
+
+struct op_stats {
+    unsigned long count;
+    uint64_t total_ns, max_ns;      // from before taking fs_lock to the reply
+};
+
+struct sfs_stats {
+    struct sfs_stats *next;
+    struct op_stats ops[STATS_NOPS];
+    struct disk_stats disk;
+    unsigned long long bytes_mapped;    // moved by the FUSE library, see chain_map()
+    unsigned long dcache_hits, dcache_misses;
+    unsigned long diridx_hits, diridx_misses;
+    unsigned long chain_hits, chain_misses;
+    unsigned long wb_hits, wb_misses;   // writes to blocks that are cached or not
+    unsigned long wb_runs;              // written back, one pwritev() each
+};
+
+static struct sfs_stats *stats_threads, stats_retired;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static __thread struct sfs_stats *thread_stats;
+
+// add the counts of `stats` to `sum`
+void stats_add(struct sfs_stats *sum, const struct sfs_stats *stats) {
+    for (unsigned i = 0; i < STATS_NOPS; i++) {
+        sum->ops[i].count += STATS_READ(stats->ops[i].count);
+        sum->ops[i].total_ns += STATS_READ(stats->ops[i].total_ns);
+        uint64_t max_ns = STATS_READ(stats->ops[i].max_ns);
+        if (max_ns > sum->ops[i].max_ns) sum->ops[i].max_ns = max_ns;
+    }
+
+    sum->disk.reads += STATS_READ(stats->disk.reads);
+    sum->disk.writes += STATS_READ(stats->disk.writes);
+    sum->disk.syncs += STATS_READ(stats->disk.syncs);
+    sum->disk.bytes_read += STATS_READ(stats->disk.bytes_read);
+    sum->disk.bytes_written += STATS_READ(stats->disk.bytes_written);
+    sum->bytes_mapped += STATS_READ(stats->bytes_mapped);
+    sum->dcache_hits += STATS_READ(stats->dcache_hits);
+    sum->dcache_misses += STATS_READ(stats->dcache_misses);
+    sum->diridx_hits += STATS_READ(stats->diridx_hits);
+    sum->diridx_misses += STATS_READ(stats->diridx_misses);
+    sum->chain_hits += STATS_READ(stats->chain_hits);
+    sum->chain_misses += STATS_READ(stats->chain_misses);
+    sum->wb_hits += STATS_READ(stats->wb_hits);
+    sum->wb_misses += STATS_READ(stats->wb_misses);
+    sum->wb_runs += STATS_READ(stats->wb_runs);
+}
+
+// destructor of stats_key, for a thread that exits
+void stats_retire(void *arg) {
+    struct sfs_stats *stats = arg;
+
+    pthread_mutex_lock(&stats_lock);
+    struct sfs_stats **link = &stats_threads;
+    while (*link != stats) {
+        link = &(*link)->next;
     }
+    *link = stats->next;
+    stats_add(&stats_retired, stats);
+    pthread_mutex_unlock(&stats_lock);
 
-    // root searching
-    struct sfs_entry root_entries[SFS_ROOTDIR_NENTRIES];
-    disk_read(root_entries, SFS_ROOTDIR_SIZE, SFS_ROOTDIR_OFF);
+    free(stats);
+}
 
-    bool hit = false;
-    for (unsigned i = 0; i < SFS_ROOTDIR_NENTRIES; i++) {
-        if (strcmp(root_entries[i].filename, token) == 0) {
-            hit = true;
+void stats_setup(void) {
+    pthread_key_create(&stats_key, stats_retire);
+}
 
-            token = strtok(NULL, "/");
-            if (token == NULL) {
-                // done
-                *result = root_entries[i];
-                return 0;
-            } else {
-                // more searching
-                buffer = root_entries[i];
-                break;
+// counters of the calling thread, set up on first use
+struct sfs_stats *stats_get(void) {
+    // counts of threads that did not get counters of their own are lost
+    static struct sfs_stats stats_lost;
+
+    if (thread_stats != NULL) return thread_stats;
+
+    pthread_once(&stats_once, stats_setup);
+    struct sfs_stats *stats = calloc(1, sizeof(struct sfs_stats));
+    if (stats == NULL) return &stats_lost;
+
+    pthread_mutex_lock(&stats_lock);
+    stats->next = stats_threads;
+    stats_threads = stats;
+    pthread_mutex_unlock(&stats_lock);
+
+    pthread_setspecific(stats_key, stats);
+    thread_stats = stats;
+    disk_stats = &stats->disk;
+
+    return stats;
+}
+
+// the sum of the counts of all threads, past and present
+void stats_sum(struct sfs_stats *sum) {
+    pthread_mutex_lock(&stats_lock);
+    *sum = stats_retired;
+    for (struct sfs_stats *stats = stats_threads; stats != NULL; stats = stats->next) {
+        stats_add(sum, stats);
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+// monotonic time in nanoseconds, to time operations with stats_op_done()
+uint64_t stats_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// count operation `op`, which started at `start` (see stats_now())
+void stats_op_done(enum stats_op op, uint64_t start) {
+    struct op_stats *stats = &stats_get()->ops[op];
+    uint64_t ns = stats_now() - start;
+
+    STATS_ADD(stats->count, 1);
+    STATS_ADD(stats->total_ns, ns);
+    if (ns > STATS_READ(stats->max_ns)) __atomic_store_n(&stats->max_ns, ns, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Layout of the mounted image: the fixed one of version 1, or whatever the
+ * superblock of a version 2 image says (see sfs.h). Everything in memory uses
+ * the wider version 2 fields, blockidx values and entries of version 1 images
+ * are converted when they are read from and written to disk.
+ */
+static struct {
+    int version;
+    unsigned block_size;
+    unsigned nblocks;           // in the data area, so entries of the block table
+    off_t rootdir_off;
+    off_t blocktbl_off;
+    off_t data_off;
+    size_t dir_size;            // of subdirectories
+    size_t filename_max;
+    uint64_t size_max;          // of files
+} geo;
+
+void geometry_load(void) {
+    geo.version = disk_verify_magic();
+
+    if (geo.version == 1) {
+        geo.block_size = SFS_BLOCK_SIZE;
+        geo.nblocks = SFS_BLOCKTBL_NENTRIES;
+        geo.rootdir_off = SFS_ROOTDIR_OFF;
+        geo.blocktbl_off = SFS_BLOCKTBL_OFF;
+        geo.data_off = SFS_DATA_OFF;
+        geo.dir_size = SFS_DIR_SIZE;
+        geo.filename_max = SFS_FILENAME_MAX;
+        geo.size_max = SFS_SIZEMASK;
+        return;
+    }
+
+    struct sfs2_super super;
+    disk_read(&super, sizeof(super), 0);
+
+    geo.block_size = super.block_size;
+    geo.nblocks = super.nblocks;
+    geo.rootdir_off = SFS2_ROOTDIR_OFF;
+    geo.blocktbl_off = super.blocktbl_off;
+    geo.data_off = super.data_off;
+    geo.dir_size = SFS2_DIR_SIZE;
+    geo.filename_max = SFS2_FILENAME_MAX;
+    geo.size_max = SFS2_SIZEMASK;
+}
+
+/*
+ * Directory entries in memory, the same for both versions. The name has room
+ * for the longer version 1 names, the size field holds the SFS2_* flags.
+ */
+#define ENTRY_SIZE  sizeof(struct sfs_entry)    // on disk, in both versions
+
+struct entry {
+    char filename[SFS_FILENAME_MAX];
+    sfs2_blockidx_t first_block;
+    uint64_t size;
+};
+
+void entry_decode(const char *raw, struct entry *entry) {
+    memset(entry, 0, sizeof(struct entry));
+
+    if (geo.version == 1) {
+        const struct sfs_entry *v1 = (const struct sfs_entry *) raw;
+
+        memcpy(entry->filename, v1->filename, SFS_FILENAME_MAX);
+        entry->first_block = v1->first_block == SFS_BLOCKIDX_END ? SFS2_BLOCKIDX_END
+                                                                   : v1->first_block;
+        // flags move from the top of 32 to the top of 64 bits
+        entry->size = (v1->size & SFS_SIZEMASK) | (uint64_t) (v1->size & ~SFS_SIZEMASK) << 32;
+    } else {
+        const struct sfs2_entry *v2 = (const struct sfs2_entry *) raw;
+
+        memcpy(entry->filename, v2->filename, SFS2_FILENAME_MAX);
+        entry->first_block = v2->first_block;
+        entry->size = v2->size;
+    }
+
+    entry->filename[SFS_FILENAME_MAX - 1] = '\0';
+}
+
+void entry_encode(const struct entry *entry, char *raw) {
+    memset(raw, 0, ENTRY_SIZE);
+
+    if (geo.version == 1) {
+        struct sfs_entry *v1 = (struct sfs_entry *) raw;
+
+        memcpy(v1->filename, entry->filename, SFS_FILENAME_MAX);
+        v1->first_block = entry->first_block == SFS2_BLOCKIDX_END ? SFS_BLOCKIDX_END
+                                                                : entry->first_block;
+        v1->size = (entry->size & SFS2_SIZEMASK) | (uint32_t) ((entry->size & ~SFS2_SIZEMASK) >> 32);
+    } else {
+        struct sfs2_entry *v2 = (struct sfs2_entry *) raw;
+
+        memcpy(v2->filename, entry->filename, SFS2_FILENAME_MAX);
+        v2->first_block = entry->first_block;
+        v2->size = entry->size;
+    }
+}
+
+// read the entry at `entry_off`
+void entry_load(struct entry *entry, off_t entry_off) {
+    char raw[ENTRY_SIZE];
+
+    disk_read(raw, ENTRY_SIZE, entry_off);
+    entry_decode(raw, entry);
+}
+
+// write `entry` to its slot at `entry_off`, see write_entry() to also keep caches
+void entry_store(const struct entry *entry, off_t entry_off) {
+    char raw[ENTRY_SIZE];
+
+    entry_encode(entry, raw);
+    disk_write(raw, ENTRY_SIZE, entry_off);
+}
+
+// read the directory of `dir_size` bytes at `dir_offset`, returns the number of entries
+unsigned dir_load(struct entry *entries, size_t dir_size, off_t dir_offset) {
+    char raw[SFS_ROOTDIR_SIZE];
+    unsigned int entries_num = dir_size / ENTRY_SIZE;
+
+    disk_read(raw, dir_size, dir_offset);
+    for (unsigned i = 0; i < entries_num; i++) {
+        entry_decode(raw + i * ENTRY_SIZE, &entries[i]);
+    }
+
+    return entries_num;
+}
+
+// whether the slot holds the data of the inline file before it (see sfs.h)
+bool is_inline_data(const struct entry *entry) {
+    return entry->filename[0] == SFS_INLINE_MARK;
+}
+
+/*
+ * In-memory copy of the block table, loaded once at mount. Entry i describes
+ * blockidx i + 1. Changes are tracked per 512-byte region of the on-disk
+ * table and only those regions are written back by block_table_flush().
+ */
+#define BLOCKTBL_REGION_SIZE    512u
+
+static sfs2_blockidx_t *block_table;
+static bool *block_table_dirty;
+static unsigned block_table_nregions;
+static unsigned block_table_ndirty;     // dirty regions, under cache_lock, see wb_pending()
+
+// bytes per entry of the on-disk block table, and entries per region
+size_t blocktbl_entry_size(void) {
+    return geo.version == 1 ? sizeof(uint16_t) : sizeof(sfs2_blockidx_t);
+}
+
+unsigned blocktbl_region_nentries(void) {
+    return BLOCKTBL_REGION_SIZE / blocktbl_entry_size();
+}
+
+/*
+ * Free-space index derived from the block table: one bit per block (set when
+ * free) plus a summary bit per 64-block word of the bitmap that still has a
+ * free block in it, so searches skip full areas 4096 blocks at a time.
+ * Indices are block table indices (blockidx - 1).
+ */
+static uint64_t *free_map;
+static uint64_t *free_summary;
+static unsigned free_map_words;
+static unsigned free_count;
+
+void free_map_set(unsigned index, bool free) {
+    unsigned word = index / 64;
+
+    if (free) {
+        free_map[word] |= 1ull << (index % 64);
+        free_count++;
+    } else {
+        free_map[word] &= ~(1ull << (index % 64));
+        free_count--;
+    }
+
+    if (free_map[word] != 0) {
+        free_summary[word / 64] |= 1ull << (word % 64);
+    } else {
+        free_summary[word / 64] &= ~(1ull << (word % 64));
+    }
+}
+
+// index of the first free block at or after `index`, or -1 when there is none
+long free_map_next(unsigned index) {
+    if (index >= geo.nblocks) return -1;
+
+    unsigned word = index / 64;
+    uint64_t bits = free_map[word] & (~0ull << (index % 64));
+    if (bits != 0) return (long) word * 64 + __builtin_ctzll(bits);
+
+    // continue at the next bitmap word with anything free, using the summary
+    for (word = word + 1; word < free_map_words; word = (word | 63) + 1) {
+        uint64_t summary = free_summary[word / 64] & (~0ull << (word % 64));
+        if (summary != 0) {
+            word = (word & ~63u) + __builtin_ctzll(summary);
+            return (long) word * 64 + __builtin_ctzll(free_map[word]);
+        }
+    }
+
+    return -1;
+}
+
+// number of consecutive free blocks starting at free block `index`
+unsigned free_map_run(unsigned index) {
+    unsigned len = 0;
+
+    while (index < geo.nblocks) {
+        uint64_t used = ~(free_map[index / 64] >> (index % 64));
+        unsigned avail = 64 - index % 64;
+        unsigned ones = used == 0 ? avail : (unsigned) __builtin_ctzll(used);
+
+        if (ones > avail) ones = avail;
+        len += ones;
+        index += ones;
+        if (ones < avail) break;
+    }
+
+    return len;
+}
+
+/*
+ * Load the block table and build the free map, after geometry_load(). Exits
+ * when out of memory, there is no way to mount.
+ */
+void block_table_load(void) {
+    block_table_nregions = (geo.nblocks * blocktbl_entry_size() + BLOCKTBL_REGION_SIZE - 1) /
+                           BLOCKTBL_REGION_SIZE;
+    free_map_words = (geo.nblocks + 63) / 64;
+
+    block_table = malloc(geo.nblocks * sizeof(sfs2_blockidx_t));
+    block_table_dirty = calloc(block_table_nregions, sizeof(bool));
+    free_map = calloc(free_map_words, sizeof(uint64_t));
+    free_summary = calloc((free_map_words + 63) / 64, sizeof(uint64_t));
+    if (block_table == NULL || block_table_dirty == NULL || free_map == NULL ||
+        free_summary == NULL) {
+        fprintf(stderr, "Out of memory for the block table\n");
+        exit(1);
+    }
+
+    if (geo.version == 1) {
+        uint16_t table[SFS_BLOCKTBL_NENTRIES];
+        disk_read(table, SFS_BLOCKTBL_SIZE, geo.blocktbl_off);
+        for (unsigned i = 0; i < geo.nblocks; i++) {
+            block_table[i] = table[i] == SFS_BLOCKIDX_END ? SFS2_BLOCKIDX_END : table[i];
+        }
+    } else {
+        disk_read(block_table, geo.nblocks * sizeof(sfs2_blockidx_t), geo.blocktbl_off);
+    }
+
+    free_count = 0;
+    for (unsigned i = 0; i < geo.nblocks; i++) {
+        if (block_table[i] == SFS2_BLOCKIDX_EMPTY) free_map_set(i, true);
+    }
+}
+
+// set the successor of `block` (a blockidx, so 1-based) and mark its region dirty
+void block_table_set(sfs2_blockidx_t block, sfs2_blockidx_t next) {
+    unsigned index = block - 1;
+    bool was_free = block_table[index] == SFS2_BLOCKIDX_EMPTY;
+
+    block_table[index] = next;
+    unsigned region = index / blocktbl_region_nentries();
+    if (!block_table_dirty[region]) {
+        block_table_dirty[region] = true;
+        pthread_mutex_lock(&cache_lock);
+        block_table_ndirty++;
+        pthread_mutex_unlock(&cache_lock);
+    }
+
+    if (was_free != (next == SFS2_BLOCKIDX_EMPTY)) free_map_set(index, !was_free);
+}
+
+// write back dirty regions, adjacent dirty regions go out as a single write
+void block_table_flush(void) {
+    pthread_mutex_lock(&cache_lock);
+    bool dirty = block_table_ndirty > 0;
+    block_table_ndirty = 0;
+    pthread_mutex_unlock(&cache_lock);
+    if (!dirty) return;
+
+    unsigned region = 0;
+
+    while (region < block_table_nregions) {
+        if (!block_table_dirty[region]) {
+            region++;
+            continue;
+        }
+
+        unsigned end = region;
+        while (end < block_table_nregions && block_table_dirty[end]) {
+            block_table_dirty[end] = false;
+            end++;
+        }
+
+        unsigned first = region * blocktbl_region_nentries();
+        unsigned last = end * blocktbl_region_nentries();
+        if (last > geo.nblocks) last = geo.nblocks;
+        off_t offset = geo.blocktbl_off + (off_t) first * blocktbl_entry_size();
+
+        if (geo.version == 1) {
+            uint16_t table[SFS_BLOCKTBL_NENTRIES];
+            for (unsigned i = first; i < last; i++) {
+                table[i - first] = block_table[i] == SFS2_BLOCKIDX_END ? SFS_BLOCKIDX_END
+                                                                      : block_table[i];
             }
+            disk_write(table, (last - first) * sizeof(uint16_t), offset);
+        } else {
+            disk_write(&block_table[first], (last - first) * sizeof(sfs2_blockidx_t), offset);
         }
+        region = end;
     }
-    if (!hit) {
-        return -ENOENT;
+}
+
+/*
+ * Path lookup cache. Maps a full path to its directory entry and the offset of
+ * that entry on disk, or records that the path does not exist (negative
+ * entry). Operations that add or remove entries update it in place, so it
+ * never has to be revalidated against the disk.
+ */
+#define DCACHE_NBUCKETS     1024
+#define DCACHE_MAX_ENTRIES  8192    // beyond that, see dcache_evict()
+
+struct dcache_entry {
+    struct dcache_entry *next;
+    bool negative;
+    bool referenced;            // found since the clock hand last passed
+    struct entry entry;
+    off_t entry_off;
+    char path[];
+};
+
+static struct dcache_entry *dcache[DCACHE_NBUCKETS];
+static unsigned dcache_count;
+static unsigned dcache_hand;        // bucket, see dcache_evict()
+
+// FNV-1a
+uint32_t name_hash(const char *name) {
+    uint32_t hash = 2166136261u;
+
+    for (; *name != '\0'; name++) {
+        hash ^= (unsigned char) *name;
+        hash *= 16777619u;
     }
 
-    // sub dir searching
-    while (token != NULL) {
-        if (strlen(token) > SFS_FILENAME_MAX) {
-            // name issue
-            printf("Error: endpoint name too long: %s", token);
-            return -ENAMETOOLONG;
-        }
-
-        struct sfs_entry sub_entries[SFS_DIR_NENTRIES];
-        disk_read(sub_entries, SFS_DIR_SIZE, SFS_DATA_OFF + SFS_BLOCK_SIZE * (buffer.first_block - 1));
-
-        hit = false;
-        for (unsigned int i = 0; i < SFS_DIR_NENTRIES; ++i) {
-            if (strcmp(sub_entries[i].filename, token) == 0) {
-                hit = true;
-
-                token = strtok(NULL, "/");
-                if (token == NULL) {
-                    // done
-                    *result = sub_entries[i];
-                    return 0;   // index of target entry in parent table
-                } else {
-                    //
-                    hit = true;
-                    buffer = sub_entries[i];
-                    break;
-                }
+    return hash;
+}
+
+unsigned dcache_hash(const char *path) {
+    return name_hash(path) % DCACHE_NBUCKETS;
+}
+
+// cache_lock must be held
+struct dcache_entry *dcache_find(const char *path) {
+    struct dcache_entry *curr = dcache[dcache_hash(path)];
+
+    while (curr != NULL && strcmp(curr->path, path) != 0) {
+        curr = curr->next;
+    }
+
+    if (curr != NULL) curr->referenced = true;
+    return curr;
+}
+
+// cache_lock must be held
+void dcache_clear(void) {
+    for (unsigned i = 0; i < DCACHE_NBUCKETS; i++) {
+        while (dcache[i] != NULL) {
+            struct dcache_entry *next = dcache[i]->next;
+            free(dcache[i]);
+            dcache[i] = next;
+        }
+    }
+    dcache_count = 0;
+}
+
+/*
+ * Drop one entry of a full cache, with cache_lock held: the clock hand goes
+ * round the buckets and takes the first entry not found since it last passed,
+ * clearing the marks of those that were.
+ */
+void dcache_evict(void) {
+    for (;;) {
+        struct dcache_entry **link = &dcache[dcache_hand];
+
+        while (*link != NULL) {
+            struct dcache_entry *curr = *link;
+
+            if (!curr->referenced) {
+                *link = curr->next;
+                free(curr);
+                dcache_count--;
+                return;
             }
+            curr->referenced = false;
+            link = &curr->next;
+        }
+        dcache_hand = (dcache_hand + 1) % DCACHE_NBUCKETS;
+    }
+}
+
+// remember `path` at `entry_off`, or as nonexistent when `entry` is NULL
+void dcache_insert(const char *path, const struct entry *entry, off_t entry_off) {
+    pthread_mutex_lock(&cache_lock);
+    struct dcache_entry *cached = dcache_find(path);
+
+    if (cached == NULL) {
+        if (dcache_count >= DCACHE_MAX_ENTRIES) dcache_evict();
+
+        cached = malloc(sizeof(struct dcache_entry) + strlen(path) + 1);
+        if (cached == NULL) {           // just don't cache
+            pthread_mutex_unlock(&cache_lock);
+            return;
         }
+        strcpy(cached->path, path);
+        cached->referenced = false;
+
+        unsigned bucket = dcache_hash(path);
+        cached->next = dcache[bucket];
+        dcache[bucket] = cached;
+        dcache_count++;
+    }
+
+    cached->negative = entry == NULL;
+    if (entry != NULL) {
+        cached->entry = *entry;
+        cached->entry_off = entry_off;
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// forget `path` and everything below it
+void dcache_invalidate(const char *path) {
+    size_t len = strlen(path);
+
+    pthread_mutex_lock(&cache_lock);
 
-        if (!hit) {
-            //printf("No such file or directory: %s\n", token);
-            return -ENOENT;
+    for (unsigned i = 0; i < DCACHE_NBUCKETS; i++) {
+        struct dcache_entry **link = &dcache[i];
+
+        while (*link != NULL) {
+            struct dcache_entry *curr = *link;
+
+            if (strncmp(curr->path, path, len) == 0 &&
+                (curr->path[len] == '\0' || curr->path[len] == '/')) {
+                *link = curr->next;
+                free(curr);
+                dcache_count--;
+            } else {
+                link = &curr->next;
+            }
         }
     }
+    pthread_mutex_unlock(&cache_lock);
+}
 
-    log("entry found on %p", result);   // honestly do nothing, just to kill the warning
-    return -ENOENT;
+const char *get_path_name(const char *path);
+
+/*
+ * Directories are passed around as their first block, or DIR_ROOT for the root
+ * directory. A subdirectory is made of units of geo.dir_size bytes on
+ * consecutive blocks, chained like a file; on version 2 images a full one grows
+ * by another unit (see dir_grow()).
+ */
+#define DIR_ROOT    SFS2_BLOCKIDX_EMPTY
+
+int get_parent_info(const char *path, sfs2_blockidx_t *parent);
+
+off_t get_block_offset(sfs2_blockidx_t block);
+
+unsigned get_block_count(size_t size);
+
+struct sfs_chain;
+sfs2_blockidx_t chain_seek(sfs2_blockidx_t first_block, unsigned index, struct sfs_chain **slot);
+
+// size in bytes of each unit of directory `dir`
+size_t dir_unit_size(sfs2_blockidx_t dir) {
+    return dir == DIR_ROOT ? SFS_ROOTDIR_SIZE : geo.dir_size;
+}
+
+// disk offset of unit `unit` of directory `dir`, -1 past its last unit
+off_t dir_unit_offset(sfs2_blockidx_t dir, unsigned unit) {
+    if (dir == DIR_ROOT) return unit == 0 ? geo.rootdir_off : -1;
+
+    sfs2_blockidx_t block = chain_seek(dir, unit * get_block_count(geo.dir_size), NULL);
+    if (block == SFS2_BLOCKIDX_END || block == SFS2_BLOCKIDX_EMPTY) return -1;
+
+    return get_block_offset(block);
+}
+
+/*
+ * In-memory name index of subdirectories of DIRIDX_MIN_UNITS or more units: an
+ * open addressing table from name hash to entry offset, plus a stack of free
+ * slots. Built on the first lookup, for DIRIDX_SLOTS directories at a time, and
+ * kept up to date by add_entry(), remove_entry() and dir_grow(). Protected by
+ * cache_lock, and dropped when memory runs out.
+ */
+#define DIRIDX_SLOTS            16
+#define DIRIDX_MIN_UNITS        2
+#define DIRIDX_MAX_CANDIDATES   8       // names with the same hash checked on disk
+
+struct diridx_name {
+    uint32_t hash;
+    off_t off;                  // -1 for an unused bucket
+};
+
+struct dir_index {
+    sfs2_blockidx_t dir;
+    unsigned mask;              // number of buckets - 1
+    unsigned nnames;
+    struct diridx_name *names;
+    unsigned nfree, free_cap;
+    off_t *free_slots;          // the last one is used first
+};
+
+static struct dir_index *diridx_cache[DIRIDX_SLOTS];
+
+void diridx_free(struct dir_index *idx) {
+    if (idx == NULL) return;
+
+    free(idx->names);
+    free(idx->free_slots);
+    free(idx);
+}
+
+// index of `dir`, NULL if it has none; cache_lock must be held
+struct dir_index *diridx_find(sfs2_blockidx_t dir) {
+    struct dir_index *idx = diridx_cache[dir % DIRIDX_SLOTS];
+
+    return idx != NULL && idx->dir == dir ? idx : NULL;
+}
+
+// forget the index of `dir`; cache_lock must be held
+void diridx_drop_locked(sfs2_blockidx_t dir) {
+    struct dir_index **slot = &diridx_cache[dir % DIRIDX_SLOTS];
+
+    if (*slot != NULL && (*slot)->dir == dir) {
+        diridx_free(*slot);
+        *slot = NULL;
+    }
+}
+
+void diridx_drop(sfs2_blockidx_t dir) {
+    pthread_mutex_lock(&cache_lock);
+    diridx_drop_locked(dir);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void diridx_put(struct dir_index *idx, uint32_t hash, off_t off) {
+    unsigned i = hash & idx->mask;
+    while (idx->names[i].off >= 0) i = (i + 1) & idx->mask;
+
+    idx->names[i].hash = hash;
+    idx->names[i].off = off;
+}
+
+// add the name with `hash` at `off`, keeping the table at most half full
+bool diridx_insert(struct dir_index *idx, uint32_t hash, off_t off) {
+    if ((idx->nnames + 1) * 2 > idx->mask + 1) {
+        unsigned nbuckets = (idx->mask + 1) * 2;
+        struct diridx_name *names = malloc(nbuckets * sizeof(struct diridx_name));
+        if (names == NULL) return false;
+
+        struct diridx_name *old_names = idx->names;
+        unsigned old_nbuckets = idx->mask + 1;
+        for (unsigned i = 0; i < nbuckets; i++) names[i].off = -1;
+
+        idx->names = names;
+        idx->mask = nbuckets - 1;
+        for (unsigned i = 0; i < old_nbuckets; i++) {
+            if (old_names[i].off >= 0) diridx_put(idx, old_names[i].hash, old_names[i].off);
+        }
+        free(old_names);
+    }
+
+    diridx_put(idx, hash, off);
+    idx->nnames++;
+    return true;
+}
+
+// remove the name with `hash` at `off`, shifting back the names probed past it
+void diridx_delete(struct dir_index *idx, uint32_t hash, off_t off) {
+    unsigned i = hash & idx->mask;
+    while (idx->names[i].off != off) {
+        if (idx->names[i].off < 0) return;
+        i = (i + 1) & idx->mask;
+    }
+
+    for (unsigned j = (i + 1) & idx->mask; idx->names[j].off >= 0; j = (j + 1) & idx->mask) {
+        // a name can move back to `i` unless its home bucket lies in (i, j]
+        unsigned home = idx->names[j].hash & idx->mask;
+        if (((j - home) & idx->mask) >= ((j - i) & idx->mask)) {
+            idx->names[i] = idx->names[j];
+            i = j;
+        }
+    }
+    idx->names[i].off = -1;
+    idx->nnames--;
+}
+
+bool diridx_push_free(struct dir_index *idx, off_t off) {
+    if (idx->nfree == idx->free_cap) {
+        unsigned cap = idx->free_cap * 2 + 64;
+        off_t *free_slots = realloc(idx->free_slots, cap * sizeof(off_t));
+        if (free_slots == NULL) return false;
+
+        idx->free_slots = free_slots;
+        idx->free_cap = cap;
+    }
+
+    idx->free_slots[idx->nfree++] = off;
+    return true;
+}
+
+// take the free slot at `off` off the stack of `idx`
+void diridx_take_free(struct dir_index *idx, off_t off) {
+    // usually the slot on top of the stack
+    unsigned i = idx->nfree;
+    while (i > 0 && idx->free_slots[i - 1] != off) i--;
+    if (i > 0) memmove(&idx->free_slots[i - 1], &idx->free_slots[i],
+                       (idx->nfree - i) * sizeof(off_t));
+    if (i > 0) idx->nfree--;
+}
+
+/*
+ * Index of the directory that has `entry` at `entry_off`, found among all
+ * cached indexes by the name, or NULL; cache_lock must be held.
+ */
+struct dir_index *diridx_find_entry(const struct entry *entry, off_t entry_off) {
+    uint32_t hash = name_hash(entry->filename);
+
+    for (unsigned slot = 0; slot < DIRIDX_SLOTS; slot++) {
+        struct dir_index *idx = diridx_cache[slot];
+        if (idx == NULL) continue;
+
+        for (unsigned i = hash & idx->mask; idx->names[i].off >= 0; i = (i + 1) & idx->mask) {
+            if (idx->names[i].off == entry_off) return idx;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Build the index of subdirectory `dir` and put it in the cache. Returns false
+ * if `dir` is too small to be indexed or memory runs out.
+ */
+bool diridx_build(sfs2_blockidx_t dir) {
+    if (dir_unit_offset(dir, DIRIDX_MIN_UNITS - 1) < 0) return false;
+
+    struct dir_index *idx = calloc(1, sizeof(struct dir_index));
+    if (idx == NULL) return false;
+
+    idx->dir = dir;
+    idx->mask = 63;
+    idx->names = malloc((idx->mask + 1) * sizeof(struct diridx_name));
+    if (idx->names == NULL) {
+        diridx_free(idx);
+        return false;
+    }
+    for (unsigned i = 0; i <= idx->mask; i++) idx->names[i].off = -1;
+
+    struct entry entries[SFS_ROOTDIR_NENTRIES];
+    off_t unit_off;
+    for (unsigned unit = 0; (unit_off = dir_unit_offset(dir, unit)) >= 0; unit++) {
+        unsigned int entries_num = dir_load(entries, geo.dir_size, unit_off);
+
+        for (unsigned i = 0; i < entries_num; i++) {
+            off_t off = unit_off + i * ENTRY_SIZE;
+            if (is_inline_data(&entries[i])) continue;
+
+            bool ok = entries[i].filename[0] == '\0'
+                      ? diridx_push_free(idx, off)
+                      : diridx_insert(idx, name_hash(entries[i].filename), off);
+            if (!ok) {
+                diridx_free(idx);
+                return false;
+            }
+        }
+    }
+
+    // new entries go to the first free slot, as with a scan
+    for (unsigned i = 0, j = idx->nfree; i + 1 < j; i++, j--) {
+        off_t off = idx->free_slots[i];
+        idx->free_slots[i] = idx->free_slots[j - 1];
+        idx->free_slots[j - 1] = off;
+    }
+
+    // another reader may have indexed it meanwhile, the result is the same
+    pthread_mutex_lock(&cache_lock);
+    struct dir_index **slot = &diridx_cache[dir % DIRIDX_SLOTS];
+    diridx_free(*slot);
+    *slot = idx;
+    pthread_mutex_unlock(&cache_lock);
+
+    return true;
+}
+
+/*
+ * dir_lookup() through the index of `dir`. Returns 1 if `dir` is not indexed,
+ * in which case the caller scans it.
+ */
+int diridx_lookup(sfs2_blockidx_t dir, const char *name, struct entry *result,
+                  off_t *entry_off) {
+    if (dir == DIR_ROOT) return 1;
+
+    uint32_t hash = name_hash(name);
+    off_t candidates[DIRIDX_MAX_CANDIDATES];
+    unsigned ncandidates = 0;
+
+    pthread_mutex_lock(&cache_lock);
+    struct dir_index *idx = diridx_find(dir);
+    if (idx != NULL) {
+        STATS_ADD(stats_get()->diridx_hits, 1);
+    } else {
+        pthread_mutex_unlock(&cache_lock);
+        if (!diridx_build(dir)) return 1;
+        STATS_ADD(stats_get()->diridx_misses, 1);     // small directories have no index
+
+        pthread_mutex_lock(&cache_lock);
+        idx = diridx_find(dir);
+        if (idx == NULL) {
+            pthread_mutex_unlock(&cache_lock);
+            return 1;
+        }
+    }
+
+    // copy the candidates out, the entries are read without the lock
+    for (unsigned i = hash & idx->mask; idx->names[i].off >= 0; i = (i + 1) & idx->mask) {
+        if (idx->names[i].hash != hash) continue;
+        if (ncandidates == DIRIDX_MAX_CANDIDATES) {
+            pthread_mutex_unlock(&cache_lock);
+            return 1;
+        }
+        candidates[ncandidates++] = idx->names[i].off;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    for (unsigned i = 0; i < ncandidates; i++) {
+        entry_load(result, candidates[i]);
+        if (strcmp(result->filename, name) == 0) {
+            *entry_off = candidates[i];
+            return 0;
+        }
+    }
+
+    return -ENOENT;
+}
+
+// record the new entry `name` at `off` of `dir` (see add_entry())
+void diridx_add(sfs2_blockidx_t dir, const char *name, off_t off) {
+    if (dir == DIR_ROOT) return;
+
+    pthread_mutex_lock(&cache_lock);
+    struct dir_index *idx = diridx_find(dir);
+    if (idx != NULL) {
+        diridx_take_free(idx, off);
+        if (!diridx_insert(idx, name_hash(name), off)) diridx_drop_locked(dir);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// forget the entry `name` at `off` of `dir` (see remove_entry())
+void diridx_remove(sfs2_blockidx_t dir, const char *name, off_t off) {
+    if (dir == DIR_ROOT) return;
+
+    pthread_mutex_lock(&cache_lock);
+    struct dir_index *idx = diridx_find(dir);
+    if (idx != NULL) {
+        diridx_delete(idx, name_hash(name), off);
+        if (!diridx_push_free(idx, off)) diridx_drop_locked(dir);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// 0 if `name` can be a directory entry, < 0 otherwise
+int check_name(const char *name) {
+    if (name[0] == '\0') return -ENOENT;
+    if (strlen(name) >= geo.filename_max) {
+        log("Error: endpoint name too long: %s\n", name);
+        return -ENAMETOOLONG;
+    }
+
+    return 0;
+}
+
+/*
+ * Look up `name` in directory `dir`. Returns 0 with its entry in `result` and
+ * the entry's disk offset in `entry_off`, or -ENOENT.
+ */
+int dir_lookup(sfs2_blockidx_t dir, const char *name, struct entry *result, off_t *entry_off) {
+    int ret = diridx_lookup(dir, name, result, entry_off);
+    if (ret <= 0) return ret;
+
+    struct entry entries[SFS_ROOTDIR_NENTRIES];
+    off_t unit_off;
+    for (unsigned unit = 0; (unit_off = dir_unit_offset(dir, unit)) >= 0; unit++) {
+        unsigned int entries_num = dir_load(entries, dir_unit_size(dir), unit_off);
+
+        for (unsigned i = 0; i < entries_num; i++) {
+            if (strcmp(entries[i].filename, name) == 0) {
+                *result = entries[i];
+                *entry_off = unit_off + i * ENTRY_SIZE;
+                return 0;
+            }
+        }
+    }
+
+    return -ENOENT;
+}
+
+// `path` must not be the root directory; `entry_off` may be NULL
+int get_entry(const char *path, struct entry *result, off_t *entry_off) {
+    // copy out under the lock, another thread may evict the cached entry
+    pthread_mutex_lock(&cache_lock);
+    struct dcache_entry *cached = dcache_find(path);
+    if (cached != NULL) {
+        STATS_ADD(stats_get()->dcache_hits, 1);
+        int ret = 0;
+        if (cached->negative) {
+            ret = -ENOENT;
+        } else {
+            *result = cached->entry;
+            if (entry_off != NULL) *entry_off = cached->entry_off;
+        }
+        pthread_mutex_unlock(&cache_lock);
+        return ret;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    STATS_ADD(stats_get()->dcache_misses, 1);
+
+    const char *name = get_path_name(path);
+    int ret = check_name(name);
+    if (ret != 0) return ret;
+
+    // search the parent, which is resolved (and cached) the same way
+    sfs2_blockidx_t parent;
+    ret = get_parent_info(path, &parent);
+    if (ret != 0) return ret;
+
+    struct entry entry;
+    off_t offset;
+    ret = dir_lookup(parent, name, &entry, &offset);
+    if (ret != 0) {
+        dcache_insert(path, NULL, 0);
+        return ret;
+    }
+
+    dcache_insert(path, &entry, offset);
+    *result = entry;
+    if (entry_off != NULL) *entry_off = offset;
+    return 0;
+}
+
+// last component of `path`, points into `path`
+const char *get_path_name(const char *path) {
+    return strrchr(path, '/') + 1;
+}
+
+// directory `path` (see DIR_ROOT)
+int get_dir_info(const char *path, sfs2_blockidx_t *dir) {
+    if (strcmp(path, "/") == 0) {
+        *dir = DIR_ROOT;
+        return 0;
+    }
+
+    struct entry dir_entry;
+    int result = get_entry(path, &dir_entry, NULL);
+    if (result != 0) return result;
+    if (!(dir_entry.size & SFS2_DIRECTORY)) return -ENOTDIR;
+
+    *dir = dir_entry.first_block;
+
+    return 0;
+}
+
+int get_parent_info(const char *path, sfs2_blockidx_t *parent) {
+    const char *name = strrchr(path, '/');
+
+    // parent is root
+    if (name == path) return get_dir_info("/", parent);
+
+    // parent is a subdir
+    char parent_path[name - path + 1];
+    memcpy(parent_path, path, name - path);
+    parent_path[name - path] = '\0';
+
+    return get_dir_info(parent_path, parent);
+}
+
+// byte offset on disk of data block `block` (a blockidx, so 1-based)
+off_t get_block_offset(sfs2_blockidx_t block) {
+    return geo.data_off + (off_t) (block - 1) * geo.block_size;
+}
+
+// number of data blocks a file of `size` bytes occupies
+unsigned get_block_count(size_t size) {
+    return (size + geo.block_size - 1) / geo.block_size;
+}
+
+/*
+ * Write-back cache of dirty file data blocks, overlaid on reads by chain_io().
+ * Blocks are written back, merged with dirty neighbours, when the cache is
+ * full, after WB_EXPIRE seconds, and on flush, fsync and unmount. Directories
+ * bypass the cache, and freed blocks are dropped from it.
+ */
+#define WB_EXPIRE       2       // seconds
+#define WB_MAX_RUN      256     // blocks per pwritev()
+
+struct wb_block {
+    struct wb_block *newer, *older;     // LRU list
+    sfs2_blockidx_t block;
+    time_t dirtied;
+    char data[];                        // geo.block_size bytes
+};
+
+static struct wb_block **wb_index;      // by blockidx - 1
+static struct wb_block *wb_newest, *wb_oldest;
+static unsigned wb_count;
+static unsigned wb_max;         // 0 disables the cache
+static time_t wb_oldest_dirtied;        // of wb_oldest, 0 if none; under cache_lock
+
+// blocks allocated to a file and not written since, no need to read them in
+static uint64_t *wb_unwritten;
+
+// size the per-block state of the cache, after geometry_load()
+void wb_setup(void) {
+    wb_index = calloc(geo.nblocks, sizeof(struct wb_block *));
+    wb_unwritten = calloc((geo.nblocks + 63) / 64, sizeof(uint64_t));
+    if (wb_index == NULL || wb_unwritten == NULL) {
+        fprintf(stderr, "Out of memory for the write-back cache\n");
+        exit(1);
+    }
+}
+
+static pthread_t wb_thread;
+static pthread_mutex_t wb_thread_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wb_thread_cond = PTHREAD_COND_INITIALIZER;
+static bool wb_thread_running, wb_thread_stop;
+
+void wb_set_oldest(struct wb_block *wb) {
+    wb_oldest = wb;
+    pthread_mutex_lock(&cache_lock);
+    wb_oldest_dirtied = wb != NULL ? wb->dirtied : 0;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void wb_lru_remove(struct wb_block *wb) {
+    if (wb->newer != NULL) wb->newer->older = wb->older;
+    else wb_newest = wb->older;
+    if (wb->older != NULL) wb->older->newer = wb->newer;
+    else wb_set_oldest(wb->newer);
+}
+
+void wb_lru_add(struct wb_block *wb) {
+    wb->newer = NULL;
+    wb->older = wb_newest;
+    if (wb_newest != NULL) wb_newest->newer = wb;
+    else wb_set_oldest(wb);
+    wb_newest = wb;
+}
+
+/*
+ * Whether there are dirty blocks to write back, in the cache or the block
+ * table; only those that expired when `expired` is set. Takes no fs_lock, so
+ * callers skip it when there is nothing to do.
+ */
+bool wb_pending(bool expired) {
+    time_t limit = expired ? time(NULL) - WB_EXPIRE : time(NULL);
+
+    pthread_mutex_lock(&cache_lock);
+    bool pending = block_table_ndirty > 0 ||
+                   (wb_oldest_dirtied != 0 && wb_oldest_dirtied <= limit);
+    pthread_mutex_unlock(&cache_lock);
+
+    return pending;
+}
+
+// forget the cached copy of `block` without writing it back
+void wb_drop(sfs2_blockidx_t block) {
+    struct wb_block *wb = wb_index[block - 1];
+    if (wb == NULL) return;
+
+    wb_lru_remove(wb);
+    wb_index[block - 1] = NULL;
+    wb_count--;
+    free(wb);
+}
+
+// write back the run of dirty blocks on disk around `block`, which is cached
+void wb_writeback(sfs2_blockidx_t block) {
+    sfs2_blockidx_t first = block, last = block;
+
+    while (first > 1 && wb_index[first - 2] != NULL && last - first + 1 < WB_MAX_RUN) {
+        first--;
+    }
+    while (last < geo.nblocks && wb_index[last] != NULL && last - first + 1 < WB_MAX_RUN) {
+        last++;
+    }
+
+    struct iovec iov[WB_MAX_RUN];
+    for (sfs2_blockidx_t b = first; b <= last; b++) {
+        iov[b - first].iov_base = wb_index[b - 1]->data;
+        iov[b - first].iov_len = geo.block_size;
+    }
+    disk_writev(iov, last - first + 1, get_block_offset(first));
+    STATS_ADD(stats_get()->wb_runs, 1);
+
+    for (sfs2_blockidx_t b = first; b <= last; b++) {
+        wb_drop(b);
+    }
+}
+
+// write back every dirty block of the chain starting at `block`
+void wb_writeback_chain(sfs2_blockidx_t block) {
+    while (wb_count > 0 && block != SFS2_BLOCKIDX_END && block != SFS2_BLOCKIDX_EMPTY) {
+        if (wb_index[block - 1] != NULL) wb_writeback(block);
+        block = block_table[block - 1];
+    }
+}
+
+void wb_writeback_all(void) {
+    for (unsigned i = 0; wb_count > 0 && i < geo.nblocks; i++) {
+        if (wb_index[i] != NULL) wb_writeback(i + 1);
+    }
+}
+
+// write back the blocks that have been dirty for WB_EXPIRE seconds or longer
+void wb_writeback_expired(void) {
+    time_t limit = time(NULL) - WB_EXPIRE;
+
+    while (wb_oldest != NULL && wb_oldest->dirtied <= limit) {
+        wb_writeback(wb_oldest->block);
+    }
+}
+
+/*
+ * Write `size` bytes from `buf` at `offset` of the run of consecutive blocks
+ * starting at `block` into the cache. Blocks that are only partly written are
+ * read in first, unless they are still unwritten.
+ */
+void wb_write(sfs2_blockidx_t block, const char *buf, size_t size, size_t offset) {
+    while (size > 0) {
+        size_t len = geo.block_size - offset;
+        if (len > size) len = size;
+
+        uint64_t bit = 1ull << ((block - 1) % 64);
+        bool unwritten = wb_unwritten[(block - 1) / 64] & bit;
+        wb_unwritten[(block - 1) / 64] &= ~bit;
+
+        struct wb_block *wb = wb_index[block - 1];
+        if (wb != NULL) {
+            STATS_ADD(stats_get()->wb_hits, 1);
+            wb_lru_remove(wb);
+        } else {
+            STATS_ADD(stats_get()->wb_misses, 1);
+            if (wb_count >= wb_max) wb_writeback(wb_oldest->block);
+
+            wb = malloc(sizeof(struct wb_block) + geo.block_size);
+            if (wb == NULL) {       // write through instead
+                disk_write(buf, len, get_block_offset(block) + offset);
+                goto next;
+            }
+            if (unwritten) {
+                memset(wb->data, 0, geo.block_size);
+            } else if (len < geo.block_size) {
+                disk_read(wb->data, geo.block_size, get_block_offset(block));
+            }
+
+            wb->block = block;
+            wb_index[block - 1] = wb;
+            wb_count++;
+        }
+
+        memcpy(wb->data + offset, buf, len);
+        wb->dirtied = time(NULL);
+        wb_lru_add(wb);
+
+    next:
+        block++;
+        buf += len;
+        size -= len;
+        offset = 0;
+    }
+}
+
+// copy cached blocks of a run read by chain_io() over `buf`, see wb_write()
+void wb_overlay(sfs2_blockidx_t block, char *buf, size_t size, size_t offset) {
+    while (size > 0) {
+        size_t len = geo.block_size - offset;
+        if (len > size) len = size;
+
+        struct wb_block *wb = wb_index[block - 1];
+        if (wb != NULL) memcpy(buf, wb->data + offset, len);
+
+        block++;
+        buf += len;
+        size -= len;
+        offset = 0;
+    }
+}
+
+// background writeback of expired blocks, and of the block table with them
+void *wb_thread_main(void *arg) {
+    (void) arg;
+
+    pthread_mutex_lock(&wb_thread_lock);
+    while (!wb_thread_stop) {
+        struct timespec wake;
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_sec += 1;
+        pthread_cond_timedwait(&wb_thread_cond, &wb_thread_lock, &wake);
+        if (wb_thread_stop) break;
+        pthread_mutex_unlock(&wb_thread_lock);
+
+        if (wb_pending(true)) {
+            pthread_rwlock_wrlock(&fs_lock);
+            wb_writeback_expired();
+            block_table_flush();
+            pthread_rwlock_unlock(&fs_lock);
+        }
+
+        pthread_mutex_lock(&wb_thread_lock);
+    }
+    pthread_mutex_unlock(&wb_thread_lock);
+
+    return NULL;
+}
+
+void wb_thread_start(void) {
+    if (wb_max == 0) return;
+
+    if (pthread_create(&wb_thread, NULL, wb_thread_main, NULL) != 0) {
+        log("Error: could not start writeback thread\n");
+        return;
+    }
+    wb_thread_running = true;
+}
+
+void wb_thread_stop_join(void) {
+    if (!wb_thread_running) return;
+
+    pthread_mutex_lock(&wb_thread_lock);
+    wb_thread_stop = true;
+    pthread_cond_signal(&wb_thread_cond);
+    pthread_mutex_unlock(&wb_thread_lock);
+
+    pthread_join(wb_thread, NULL);
+    wb_thread_running = false;
+}
+
+/*
+ * Find a run of free blocks for `want` blocks. Returns the length of the first
+ * run that is long enough, or of the longest run if none is, with its first
+ * block in `start`. Returns 0 when the disk is full.
+ */
+unsigned find_free_run(unsigned want, sfs2_blockidx_t *start) {
+    unsigned best_len = 0;
+    long index = free_map_next(0);
+
+    while (index >= 0) {
+        unsigned len = free_map_run(index);
+        if (len > best_len) {
+            best_len = len;
+            *start = index + 1;
+            if (len >= want) break;
+        }
+
+        index = free_map_next(index + len);
+    }
+
+    return best_len;
+}
+
+/*
+ * Blocks shared by clones (files with the SHARED flag): block_refs[blockidx - 1]
+ * counts the chains through a block besides the first, 0 if it is not shared.
+ * Clones share the end of their chains. Rebuilt from the chains when mounting
+ * (block_refs_load()); NULL until there is a clone.
+ */
+#define BLOCK_REFS_MAX  (UINT16_MAX - 1)      // room for the count of block_refs_load()
+
+static uint16_t *block_refs;
+
+bool block_refs_alloc(void) {
+    if (block_refs == NULL) block_refs = calloc(geo.nblocks, sizeof(uint16_t));
+    return block_refs != NULL;
+}
+
+bool block_shared(sfs2_blockidx_t block) {
+    return block_refs != NULL && block_refs[block - 1] > 0;
+}
+
+// count one more chain through every block from `block` on
+int chain_ref(sfs2_blockidx_t block) {
+    if (!block_refs_alloc()) return -ENOMEM;
+
+    // checked first, so a full count leaves nothing half done; bounded by the
+    // table size in case the chain is corrupt (cyclic)
+    sfs2_blockidx_t b = block;
+    for (unsigned n = 0; b != SFS2_BLOCKIDX_END && b != SFS2_BLOCKIDX_EMPTY && n < geo.nblocks;
+         n++) {
+        if (block_refs[b - 1] == BLOCK_REFS_MAX) return -EMLINK;
+        b = block_table[b - 1];
+    }
+
+    for (unsigned n = 0; block != SFS2_BLOCKIDX_END && block != SFS2_BLOCKIDX_EMPTY &&
+                         n < geo.nblocks; n++) {
+        block_refs[block - 1]++;
+        block = block_table[block - 1];
+    }
+
+    return 0;
+}
+
+// count one chain less through every block from the shared `block` on
+void chain_unref(sfs2_blockidx_t block) {
+    while (block != SFS2_BLOCKIDX_END && block != SFS2_BLOCKIDX_EMPTY && block_shared(block)) {
+        block_refs[block - 1]--;
+        block = block_table[block - 1];
+    }
+}
+
+/*
+ * Count the chains of the clones in directory `dir` and below, see
+ * block_refs_load(). Returns false when out of memory.
+ */
+bool block_refs_load_dir(sfs2_blockidx_t dir) {
+    // not on the stack, this recurses as deep as the tree goes
+    struct entry *entries = malloc(SFS_ROOTDIR_NENTRIES * sizeof(struct entry));
+    off_t unit_off;
+
+    if (entries == NULL) return false;
+
+    for (unsigned unit = 0; (unit_off = dir_unit_offset(dir, unit)) >= 0; unit++) {
+        unsigned int entries_num = dir_load(entries, dir_unit_size(dir), unit_off);
+
+        for (unsigned i = 0; i < entries_num; i++) {
+            struct entry *entry = &entries[i];
+            if (entry->filename[0] == '\0' || is_inline_data(entry)) continue;
+
+            if (entry->size & SFS2_DIRECTORY) {
+                if (!block_refs_load_dir(entry->first_block)) {
+                    free(entries);
+                    return false;
+                }
+            } else if (entry->size & SFS2_SHARED) {
+                if (!block_refs_alloc()) {
+                    free(entries);
+                    return false;
+                }
+
+                sfs2_blockidx_t block = entry->first_block;
+                for (unsigned n = 0; block != SFS2_BLOCKIDX_END &&
+                                     block != SFS2_BLOCKIDX_EMPTY && n < geo.nblocks; n++) {
+                    if (block_refs[block - 1] < UINT16_MAX) block_refs[block - 1]++;
+                    block = block_table[block - 1];
+                }
+            }
+        }
+    }
+
+    free(entries);
+    return true;
+}
+
+/*
+ * Rebuild block_refs from the chains of all clones on the image. Every chain
+ * counts once for each of its blocks, so the count is one too many for the
+ * blocks of clones in the end.
+ */
+void block_refs_load(void) {
+    if (!block_refs_load_dir(DIR_ROOT)) {
+        fprintf(stderr, "Could not allocate block reference counts\n");
+        exit(1);
+    }
+    if (block_refs == NULL) return;
+
+    for (unsigned i = 0; i < geo.nblocks; i++) {
+        if (block_refs[i] > 0) block_refs[i]--;
+    }
+}
+
+/*
+ * Mark every block of the chain starting at `block` as free, up to the first
+ * block it shares with clones: those stay with the other chains.
+ */
+void free_chain(sfs2_blockidx_t block) {
+    while (block != SFS2_BLOCKIDX_END && block != SFS2_BLOCKIDX_EMPTY) {
+        if (block_shared(block)) {
+            chain_unref(block);
+            return;
+        }
+
+        sfs2_blockidx_t next = block_table[block - 1];
+        block_table_set(block, SFS2_BLOCKIDX_EMPTY);
+        wb_drop(block);
+        block = next;
+    }
+}
+
+/*
+ * Append `count` new blocks after `last` (SFS2_BLOCKIDX_END to start a new
+ * chain) and store the first new block in `first_new`. Blocks are taken right
+ * behind `last` when free, otherwise from the first free run big enough.
+ * Returns 0 on success, -ENOSPC (leaving the chain untouched) when full.
+ */
+int alloc_chain(sfs2_blockidx_t last, unsigned count, sfs2_blockidx_t *first_new) {
+    sfs2_blockidx_t prev = last;
+    unsigned done = 0;
+
+    *first_new = SFS2_BLOCKIDX_END;
+    if (count > free_count) return -ENOSPC;
+
+    while (done < count) {
+        sfs2_blockidx_t start;
+        unsigned len = 0;
+
+        if (prev != SFS2_BLOCKIDX_END && prev < geo.nblocks) {
+            start = prev + 1;
+            if (block_table[start - 1] == SFS2_BLOCKIDX_EMPTY) len = free_map_run(start - 1);
+        }
+        if (len == 0) len = find_free_run(count - done, &start);
+        if (len > count - done) len = count - done;
+
+        for (unsigned i = 0; i < len; i++) {
+            block_table_set(start + i, i + 1 < len ? start + i + 1 : SFS2_BLOCKIDX_END);
+            wb_unwritten[(start + i - 1) / 64] |= 1ull << ((start + i - 1) % 64);
+        }
+        if (prev != SFS2_BLOCKIDX_END) block_table_set(prev, start);
+        if (*first_new == SFS2_BLOCKIDX_END) *first_new = start;
+
+        prev = start + len - 1;
+        done += len;
+    }
+
+    return 0;
+}
+
+/*
+ * Allocate and clear a directory unit, appended to the chain after block
+ * `last` unless that is SFS2_BLOCKIDX_END. Returns its first block, or
+ * SFS2_BLOCKIDX_EMPTY if there is no room for it.
+ */
+sfs2_blockidx_t alloc_dir_unit(sfs2_blockidx_t last) {
+    sfs2_blockidx_t index;
+    unsigned count = get_block_count(geo.dir_size);
+
+    // directory units need consecutive blocks
+    if (find_free_run(count, &index) < count) return SFS2_BLOCKIDX_EMPTY;
+
+    // update block_table
+    for (unsigned i = 0; i < count; i++) {
+        block_table_set(index + i, i + 1 < count ? index + i + 1 : SFS2_BLOCKIDX_END);
+    }
+    if (last != SFS2_BLOCKIDX_END) block_table_set(last, index);
+
+    // write empty entry in data
+    char empty_entries[SFS2_DIR_SIZE];
+    memset(empty_entries, 0, geo.dir_size);
+    disk_write(empty_entries, geo.dir_size, get_block_offset(index));
+
+    return index;
+}
+
+/*
+ * Block chain index cache: the list of all blocks of recently accessed files,
+ * keyed (direct-mapped) by their first block. Seeking to an offset becomes an
+ * array lookup instead of a walk over the block table. Anything that changes
+ * the shape of a chain drops its cached copy; it is rebuilt on next use.
+ */
+#define CHAIN_CACHE_SLOTS       64
+#define CHAIN_CACHE_MIN_BLOCKS  8       // shorter chains are cheap to walk
+
+struct sfs_chain {
+    sfs2_blockidx_t first_block;
+    unsigned nblocks;
+    sfs2_blockidx_t blocks[];
+};
+
+static struct sfs_chain *chain_cache[CHAIN_CACHE_SLOTS];
+
+/*
+ * Open files. All handles of one file share a single sfs_file, found through
+ * the offset of its entry, which fi->fh points to. An open file that is
+ * unlinked becomes an orphan: it keeps its blocks, under an offset below -1,
+ * until the last handle is closed (see orphans_free()).
+ */
+struct sfs_file {
+    struct sfs_file *next;
+    unsigned refcount;
+    off_t entry_off;            // < -1 once the file has been unlinked
+    struct entry entry;
+    struct sfs_chain *chain;    // built on first seek, NULL when stale
+};
+
+static struct sfs_file *open_files;
+static struct sfs_file *released_orphans;       // to be freed, under cache_lock
+static off_t orphan_last = -1;
+
+struct sfs_file *file_find(off_t entry_off) {
+    struct sfs_file *file = open_files;
+
+    while (file != NULL && file->entry_off != entry_off) {
+        file = file->next;
+    }
+
+    return file;
+}
+
+// open file of handle `fi`, NULL when called without one
+struct sfs_file *file_get(struct fuse_file_info *fi) {
+    return fi != NULL ? (struct sfs_file *) (uintptr_t) fi->fh : NULL;
+}
+
+int file_open(const struct entry *entry, off_t entry_off, struct fuse_file_info *fi) {
+    pthread_mutex_lock(&cache_lock);
+    struct sfs_file *file = file_find(entry_off);
+
+    if (file == NULL) {
+        file = calloc(1, sizeof(struct sfs_file));
+        if (file == NULL) {
+            pthread_mutex_unlock(&cache_lock);
+            return -ENOMEM;
+        }
+
+        file->entry_off = entry_off;
+        file->entry = *entry;
+        file->next = open_files;
+        open_files = file;
+    }
+
+    file->refcount++;
+    fi->fh = (uintptr_t) file;
+    pthread_mutex_unlock(&cache_lock);
+
+    return 0;
+}
+
+void file_release(struct sfs_file *file) {
+    pthread_mutex_lock(&cache_lock);
+    if (--file->refcount > 0) {
+        pthread_mutex_unlock(&cache_lock);
+        return;
+    }
+
+    struct sfs_file **link = &open_files;
+    while (*link != file) {
+        link = &(*link)->next;
+    }
+    *link = file->next;
+
+    // the blocks of an orphan need the exclusive fs_lock, see orphans_free()
+    if (file->entry_off < -1) {
+        file->next = released_orphans;
+        released_orphans = file;
+        pthread_mutex_unlock(&cache_lock);
+        return;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    free(file->chain);
+    free(file);
+}
+
+/*
+ * Free the blocks of orphans whose last handle was closed, see file_release().
+ * Called without fs_lock, which is only taken when there are any.
+ */
+void orphans_free(void) {
+    pthread_mutex_lock(&cache_lock);
+    bool pending = released_orphans != NULL;
+    pthread_mutex_unlock(&cache_lock);
+    if (!pending) return;
+
+    pthread_rwlock_wrlock(&fs_lock);
+    pthread_mutex_lock(&cache_lock);
+    struct sfs_file *file = released_orphans;
+    released_orphans = NULL;
+    pthread_mutex_unlock(&cache_lock);
+
+    while (file != NULL) {
+        struct sfs_file *next = file->next;
+        if (file->entry.first_block != SFS2_BLOCKIDX_END) chain_cache_drop(file->entry.first_block);
+        free_chain(file->entry.first_block);
+        free(file->chain);
+        free(file);
+        file = next;
+    }
+    pthread_rwlock_unlock(&fs_lock);
+}
+
+struct sfs_chain *chain_build(sfs2_blockidx_t first_block) {
+    unsigned nblocks = 0;
+    sfs2_blockidx_t block = first_block;
+
+    // bounded by the table size in case the chain is corrupt (cyclic)
+    while (block != SFS2_BLOCKIDX_END && block != SFS2_BLOCKIDX_EMPTY && nblocks < geo.nblocks) {
+        block = block_table[block - 1];
+        nblocks++;
+    }
+
+    struct sfs_chain *chain = malloc(sizeof(struct sfs_chain) + nblocks * sizeof(sfs2_blockidx_t));
+    if (chain == NULL) return NULL;
+
+    chain->first_block = first_block;
+    chain->nblocks = nblocks;
+    block = first_block;
+    for (unsigned i = 0; i < nblocks; i++) {
+        chain->blocks[i] = block;
+        block = block_table[block - 1];
+    }
+
+    return chain;
+}
+
+void chain_cache_drop(sfs2_blockidx_t first_block) {
+    struct sfs_chain **slot = &chain_cache[first_block % CHAIN_CACHE_SLOTS];
+
+    pthread_mutex_lock(&cache_lock);
+
+    if (*slot != NULL && (*slot)->first_block == first_block) {
+        free(*slot);
+        *slot = NULL;
+    }
+
+    for (struct sfs_file *file = open_files; file != NULL; file = file->next) {
+        if (file->chain != NULL && file->chain->first_block == first_block) {
+            free(file->chain);
+            file->chain = NULL;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Make sure `slot` holds the index of the chain starting at `first_block`, with
+ * cache_lock held. The chain itself cannot change under a shared fs_lock, but
+ * the slot may be rebuilt by another reader. Returns false when out of memory.
+ */
+bool chain_slot_load(sfs2_blockidx_t first_block, struct sfs_chain **slot) {
+    if (*slot != NULL && (*slot)->first_block == first_block) {
+        STATS_ADD(stats_get()->chain_hits, 1);
+        return true;
+    }
+
+    STATS_ADD(stats_get()->chain_misses, 1);
+    struct sfs_chain *chain = chain_build(first_block);
+    if (chain == NULL) return false;
+
+    free(*slot);
+    *slot = chain;
+    return true;
+}
+
+/*
+ * Block number `index` (0-based) of the chain starting at `first_block`. The
+ * chain index is kept in `slot` (an open file's), or in the shared cache when
+ * `slot` is NULL.
+ */
+sfs2_blockidx_t chain_seek(sfs2_blockidx_t first_block, unsigned index, struct sfs_chain **slot) {
+    if (index < CHAIN_CACHE_MIN_BLOCKS || first_block == SFS2_BLOCKIDX_END) {
+        sfs2_blockidx_t block = first_block;
+        for (; index > 0 && block != SFS2_BLOCKIDX_END && block != SFS2_BLOCKIDX_EMPTY; index--) {
+            block = block_table[block - 1];
+        }
+        return block;
+    }
+
+    if (slot == NULL) slot = &chain_cache[first_block % CHAIN_CACHE_SLOTS];
+
+    pthread_mutex_lock(&cache_lock);
+    if (!chain_slot_load(first_block, slot)) {
+        pthread_mutex_unlock(&cache_lock);
+        return SFS2_BLOCKIDX_END;
+    }
+
+    sfs2_blockidx_t block = index < (*slot)->nblocks ? (*slot)->blocks[index] : SFS2_BLOCKIDX_END;
+    pthread_mutex_unlock(&cache_lock);
+
+    return block;
+}
+
+// number of blocks in the chain starting at `first_block`, see chain_seek()
+unsigned chain_length(sfs2_blockidx_t first_block, struct sfs_chain **slot) {
+    if (first_block == SFS2_BLOCKIDX_END) return 0;
+    if (slot == NULL) slot = &chain_cache[first_block % CHAIN_CACHE_SLOTS];
+
+    pthread_mutex_lock(&cache_lock);
+    bool indexed = chain_slot_load(first_block, slot);
+    unsigned nblocks = indexed ? (*slot)->nblocks : 0;
+    pthread_mutex_unlock(&cache_lock);
+    if (indexed) return nblocks;
+
+    // no memory for the index, walk the chain (bounded as in chain_build())
+    sfs2_blockidx_t block = first_block;
+    while (block != SFS2_BLOCKIDX_END && block != SFS2_BLOCKIDX_EMPTY && nblocks < geo.nblocks) {
+        block = block_table[block - 1];
+        nblocks++;
+    }
+
+    return nblocks;
+}
+
+/*
+ * Length of the run of consecutive blocks on disk starting `block_offset` bytes
+ * into `block`, capped at `max` bytes. The block in the chain after the run is
+ * returned in `next`.
+ */
+size_t chain_run(sfs2_blockidx_t block, size_t block_offset, size_t max, sfs2_blockidx_t *next) {
+    size_t run_size = geo.block_size - block_offset;
+
+    // grow the run while the chain continues on the next block on disk
+    while (run_size < max && block_table[block - 1] == block + 1) {
+        block++;
+        run_size += geo.block_size;
+    }
+    *next = block_table[block - 1];
+
+    return run_size < max ? run_size : max;
+}
+
+/*
+ * Read (or write, when `write` is set) `size` bytes at `offset` of the chain
+ * starting at `block`, seeking through the chain index in `slot`. Runs of
+ * consecutive blocks take a single disk access. Returns the number of bytes
+ * transferred, which is only short for a broken chain.
+ */
+size_t chain_io(sfs2_blockidx_t block, char *buf, size_t size, off_t offset, bool write,
+                struct sfs_chain **slot) {
+    // skip whole blocks before offset
+    block = chain_seek(block, offset / geo.block_size, slot);
+
+    size_t position = 0;
+    size_t block_offset = offset % geo.block_size;
+
+    while (position < size) {
+        if (block == SFS2_BLOCKIDX_END || block == SFS2_BLOCKIDX_EMPTY) {
+            log("Error: block chain shorter than file size\n");
+            break;
+        }
+
+        sfs2_blockidx_t next;
+        size_t run_size = chain_run(block, block_offset, size - position, &next);
+
+        if (write && wb_max > 0) {
+            wb_write(block, buf + position, run_size, block_offset);
+        } else if (write) {
+            disk_write(buf + position, run_size, get_block_offset(block) + block_offset);
+        } else {
+            disk_read(buf + position, run_size, get_block_offset(block) + block_offset);
+            if (wb_count > 0) wb_overlay(block, buf + position, run_size, block_offset);
+        }
+
+        position += run_size;
+        block_offset = 0;
+        block = next;
+    }
+
+    return position;
+}
+
+#define CHAIN_MAP_MAX_RUNS  32    // buffers callers of chain_map() make room for
+
+/*
+ * Describe `size` bytes at `offset` of the chain starting at `block` as buffers
+ * referring to the image file, one per run of consecutive blocks. Returns the
+ * number of buffers, or 0 when that takes more than `max` or the data has to go
+ * through memory (write-back cache, or past the end of the image file).
+ */
+unsigned chain_map(sfs2_blockidx_t block, size_t size, off_t offset, bool write,
+                   struct sfs_chain **slot, struct fuse_buf *bufs, unsigned max) {
+    if (write && wb_max > 0) return 0;
+
+    block = chain_seek(block, offset / geo.block_size, slot);
+
+    size_t position = 0;
+    size_t block_offset = offset % geo.block_size;
+    unsigned count = 0;
+
+    while (position < size) {
+        if (block == SFS2_BLOCKIDX_END || block == SFS2_BLOCKIDX_EMPTY || count == max) return 0;
+
+        sfs2_blockidx_t next;
+        size_t run_size = chain_run(block, block_offset, size - position, &next);
+        off_t run_offset = get_block_offset(block) + block_offset;
+
+        for (unsigned i = 0; wb_count > 0 && i < get_block_count(block_offset + run_size); i++) {
+            if (wb_index[block + i - 1] != NULL) return 0;
+        }
+
+        int fd = write ? disk_fd(0, 0) : disk_fd(run_offset, run_size);
+        if (fd == -1) return 0;
+
+        bufs[count].size = run_size;
+        bufs[count].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        bufs[count].mem = NULL;
+        bufs[count].fd = fd;
+        bufs[count].pos = run_offset;
+        count++;
+
+        position += run_size;
+        block_offset = 0;
+        block = next;
+    }
+
+    STATS_ADD(stats_get()->bytes_mapped, size);
+    return count;
+}
+
+// fill `size` bytes at `offset` of the chain starting at `block` with zeroes
+void chain_zero(sfs2_blockidx_t block, size_t size, off_t offset) {
+    static char zeroes[8 * SFS2_BLOCK_SIZE_DEFAULT];
+
+    while (size > 0) {
+        size_t len = size < sizeof(zeroes) ? size : sizeof(zeroes);
+        chain_io(block, zeroes, len, offset, true, NULL);
+        size -= len;
+        offset += len;
+    }
+}
+
+/*
+ * Number of blocks in the chain of file `entry`, see chain_seek() for `slot`.
+ * Only a sparse file's chain is shorter or longer than its size needs.
+ */
+unsigned file_blocks(const struct entry *entry, struct sfs_chain **slot) {
+    if (entry->size & SFS2_INLINE) return 0;
+    if (!(entry->size & SFS2_SPARSE)) return get_block_count(entry->size & SFS2_SIZEMASK);
+
+    return chain_length(entry->first_block, slot);
+}
+
+// bytes at the start of file `entry` that are in its chain, the rest is a hole
+size_t file_data_size(const struct entry *entry, struct sfs_chain **slot) {
+    if (entry->size & SFS2_INLINE) return 0;
+
+    size_t size = entry->size & SFS2_SIZEMASK;
+    if (!(entry->size & SFS2_SPARSE)) return size;
+
+    size_t data_size = (size_t) chain_length(entry->first_block, slot) * geo.block_size;
+    return data_size < size ? data_size : size;
+}
+
+// whether a file can be `size` bytes long, which also keeps block counts in range
+int check_file_size(size_t size) {
+    if (size > geo.size_max) return -EFBIG;
+    if (size > (uint64_t) geo.nblocks * geo.block_size) return -ENOSPC;
+
+    return 0;
+}
+
+/*
+ * Copy the blocks file `entry` shares with clones among its first `nblocks`, so
+ * it can change them; the copies link to the rest of the shared chain. The
+ * caller writes the entry back.
+ * Returns 0 on success, < 0 on error (leaving the file as it was).
+ */
+#define UNSHARE_CHUNK   (1024 * 1024)   // bytes copied at a time
+
+int file_unshare(struct entry *entry, unsigned nblocks) {
+    if (!(entry->size & SFS2_SHARED) || block_refs == NULL) return 0;
+
+    // shared blocks follow the private ones
+    sfs2_blockidx_t prev = SFS2_BLOCKIDX_END, block = entry->first_block;
+    unsigned index = 0;
+    while (index < nblocks && block != SFS2_BLOCKIDX_END && !block_shared(block)) {
+        prev = block;
+        block = block_table[block - 1];
+        index++;
+    }
+    if (index == nblocks) return 0;
+    if (block == SFS2_BLOCKIDX_END) {
+        // none left, the file is not a clone anymore
+        entry->size &= ~SFS2_SHARED;
+        return 0;
+    }
+
+    unsigned remaining = chain_length(block, NULL);
+    unsigned count = nblocks - index < remaining ? nblocks - index : remaining;
+    char *buf = malloc(UNSHARE_CHUNK);
+    if (buf == NULL) return -ENOMEM;
+
+    sfs2_blockidx_t first_new;
+    int result = alloc_chain(SFS2_BLOCKIDX_END, count, &first_new);
+    if (result != 0) {
+        free(buf);
+        return result;
+    }
+
+    // own chain indexes: the shared one from `block` on is not a file's
+    struct sfs_chain *src_slot = NULL, *dst_slot = NULL;
+    size_t size = (size_t) count * geo.block_size;
+    for (size_t pos = 0; pos < size; pos += UNSHARE_CHUNK) {
+        size_t len = size - pos < UNSHARE_CHUNK ? size - pos : UNSHARE_CHUNK;
+        chain_io(block, buf, len, pos, false, &src_slot);
+        chain_io(first_new, buf, len, pos, true, &dst_slot);
+    }
+    free(src_slot);
+    free(dst_slot);
+    free(buf);
+
+    // the copies take the place of the shared blocks in this chain
+    sfs2_blockidx_t last_new = first_new;
+    for (unsigned i = 0; i < count; i++) {
+        if (i > 0) last_new = block_table[last_new - 1];
+        block_refs[block - 1]--;
+        block = block_table[block - 1];
+    }
+    block_table_set(last_new, block);
+    if (block == SFS2_BLOCKIDX_END) entry->size &= ~SFS2_SHARED;
+
+    sfs2_blockidx_t old_first_block = entry->first_block;
+    if (prev == SFS2_BLOCKIDX_END) {
+        entry->first_block = first_new;
+    } else {
+        block_table_set(prev, first_new);
+    }
+    chain_cache_drop(old_first_block);
+
+    return 0;
+}
+
+/*
+ * Set the size field of file `entry` to `new_size` and grow or shrink its chain
+ * from `old_blocks` to `new_blocks` (more or fewer for a sparse file). Added
+ * blocks are not initialised. Returns 0 on success, < 0 on error.
+ */
+int resize_file(struct entry *entry, unsigned old_blocks, size_t new_size, unsigned new_blocks) {
+    // the new last block of the chain gets a new next one
+    if (new_blocks != old_blocks) {
+        int result = file_unshare(entry, new_blocks < old_blocks ? new_blocks : old_blocks);
+        if (result != 0) return result;
+    }
+
+    sfs2_blockidx_t old_first_block = entry->first_block;
+
+    if (new_blocks > old_blocks) {
+        sfs2_blockidx_t last = SFS2_BLOCKIDX_END;
+        if (old_blocks > 0) last = chain_seek(entry->first_block, old_blocks - 1, NULL);
+
+        sfs2_blockidx_t first_new;
+        int result = alloc_chain(last, new_blocks - old_blocks, &first_new);
+        if (result != 0) return result;
+        if (old_blocks == 0) entry->first_block = first_new;
+    } else if (new_blocks < old_blocks) {
+        if (new_blocks == 0) {
+            free_chain(entry->first_block);
+            entry->first_block = SFS2_BLOCKIDX_END;
+        } else {
+            sfs2_blockidx_t last = chain_seek(entry->first_block, new_blocks - 1, NULL);
+
+            free_chain(block_table[last - 1]);
+            block_table_set(last, SFS2_BLOCKIDX_END);
+        }
+    }
+
+    // chain changed shape, the cached copy (built while walking it) is stale
+    if (new_blocks != old_blocks && old_blocks > 0) chain_cache_drop(old_first_block);
+
+    entry->size = (entry->size & ~(SFS2_SIZEMASK | SFS2_SPARSE)) | new_size;
+    if (new_blocks != get_block_count(new_size)) entry->size |= SFS2_SPARSE;
+    if (new_blocks == 0) entry->size &= ~SFS2_SHARED;
+
+    return 0;
+}
+
+/*
+ * Write `entry` to its slot at `entry_off`, keeping the lookup cache (for
+ * `path`, NULL when the caller does not know it) and open files in sync. An
+ * orphan (see struct sfs_file) has no slot, only its open file is updated.
+ */
+void write_entry(const char *path, const struct entry *entry, off_t entry_off) {
+    if (entry_off >= 0) {
+        entry_store(entry, entry_off);
+        if (path != NULL) dcache_insert(path, entry, entry_off);
+    }
+
+    struct sfs_file *file = file_find(entry_off);
+    if (file != NULL) file->entry = *entry;
+}
+
+/*
+ * Inline data (see sfs.h): on version 2 images a file of up to SFS_INLINE_MAX
+ * bytes keeps them in the free directory slot after its entry, zero padded. It
+ * moves to a chain once it grows past SFS_INLINE_MAX.
+ */
+#define INLINE_OFF(entry_off)   ((entry_off) + (off_t) ENTRY_SIZE)
+
+// whether the slot after the entry at `entry_off` is free and in the same unit
+bool inline_slot_free(off_t entry_off) {
+    if (entry_off < geo.data_off) {
+        if (INLINE_OFF(entry_off) >= geo.rootdir_off + (off_t) SFS_ROOTDIR_SIZE) return false;
+    } else {
+        // units are whole blocks, or the start of a big one; the last slot in a
+        // block is left out, as the next block may be another unit's
+        off_t end = (entry_off - geo.data_off) % geo.block_size + 2 * ENTRY_SIZE;
+        if (end > (off_t) geo.block_size || end > (off_t) geo.dir_size) return false;
+    }
+
+    struct entry next;
+    entry_load(&next, INLINE_OFF(entry_off));
+    return next.filename[0] == '\0';
+}
+
+/*
+ * Take the slot after file `entry` at `entry_off` for its data, or give it
+ * back when `take` is false, in the index of the directory if it has one.
+ */
+void inline_slot_take(const struct entry *entry, off_t entry_off, bool take) {
+    pthread_mutex_lock(&cache_lock);
+    struct dir_index *idx = diridx_find_entry(entry, entry_off);
+    if (idx != NULL && take) {
+        diridx_take_free(idx, INLINE_OFF(entry_off));
+    } else if (idx != NULL && !diridx_push_free(idx, INLINE_OFF(entry_off))) {
+        diridx_drop_locked(idx->dir);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// clear the data slot of inline file `entry` at `entry_off`, which is free then
+void inline_release(const struct entry *entry, off_t entry_off) {
+    char empty[ENTRY_SIZE];
+
+    memset(empty, 0, sizeof(empty));
+    disk_write(empty, ENTRY_SIZE, INLINE_OFF(entry_off));
+    inline_slot_take(entry, entry_off, false);
+}
+
+/*
+ * Move the data of inline file `entry` at `entry_off` (see write_entry() for
+ * `path`) to a chain of one block, and write the entry back.
+ * Returns 0 on success, < 0 on error.
+ */
+int inline_to_chain(const char *path, struct entry *entry, off_t entry_off) {
+    size_t size = entry->size & SFS2_SIZEMASK;
+    struct entry old_entry = *entry;
+    sfs2_blockidx_t block = SFS2_BLOCKIDX_END;
+
+    if (size > 0) {
+        char data[SFS_INLINE_MAX];
+        int result = alloc_chain(SFS2_BLOCKIDX_END, 1, &block);
+        if (result != 0) return result;
+
+        disk_read(data, size, INLINE_OFF(entry_off) + 1);
+        chain_io(block, data, size, 0, true, NULL);
+    }
+
+    // the entry first, a crash must not leave it without its data
+    entry->first_block = block;
+    entry->size = size;
+    write_entry(path, entry, entry_off);
+    inline_release(&old_entry, entry_off);
+
+    return 0;
+}
+
+/*
+ * write_file() for a file that is inline, or empty and could become so:
+ * writes inline if the file stays small enough, otherwise moves an inline file
+ * to a chain. Returns the number of bytes written, 0 if the write is for the
+ * chain, or < 0 on error.
+ */
+int write_inline(const char *path, struct entry *entry, off_t entry_off,
+                 const char *buf, size_t size, off_t offset) {
+    size_t old_size = entry->size & SFS2_SIZEMASK;
+    size_t end = offset + size;
+
+    if (!(entry->size & SFS2_INLINE)) {
+        if (geo.version == 1 || entry->size != 0 || end > SFS_INLINE_MAX) return 0;
+        if (entry_off < 0 || !inline_slot_free(entry_off)) return 0;
+
+        char raw[ENTRY_SIZE];
+        memset(raw, 0, sizeof(raw));
+        raw[0] = SFS_INLINE_MARK;
+        memcpy(raw + 1 + offset, buf, size);
+        disk_write(raw, ENTRY_SIZE, INLINE_OFF(entry_off));
+        inline_slot_take(entry, entry_off, true);
+    } else if (end > SFS_INLINE_MAX) {
+        int result = inline_to_chain(path, entry, entry_off);
+        return result < 0 ? result : 0;
+    } else {
+        disk_write(buf, size, INLINE_OFF(entry_off) + 1 + offset);
+    }
+
+    entry->size = SFS2_INLINE | (end > old_size ? end : old_size);
+    write_entry(path, entry, entry_off);
+
+    return size;
+}
+
+/*
+ * Read `size` bytes at `offset` of file `entry` at `entry_off`, which the
+ * caller has clamped to the file size, see chain_seek() for `slot`. The hole
+ * at the end of a sparse file is not on disk, it is filled in with zeroes.
+ * Returns the number of bytes read, which is only short for a broken chain.
+ */
+size_t read_file(const struct entry *entry, off_t entry_off, char *buf, size_t size,
+                 off_t offset, struct sfs_chain **slot) {
+    if (entry->size & SFS2_INLINE) {
+        disk_read(buf, size, INLINE_OFF(entry_off) + 1 + offset);
+        return size;
+    }
+
+    size_t data_size = file_data_size(entry, slot);
+    size_t done = 0;
+
+    if ((size_t) offset < data_size) {
+        size_t len = size < data_size - offset ? size : data_size - offset;
+        done = chain_io(entry->first_block, buf, len, offset, false, slot);
+        if (done < len) return done;
+    }
+    memset(buf + done, 0, size - done);
+
+    return size;
+}
+
+/*
+ * Grow the full directory `dir` by a unit, on version 2 images. Returns 0 and
+ * the first slot of the new unit in `entry_off`, or -ENOSPC.
+ */
+int dir_grow(sfs2_blockidx_t dir, off_t *entry_off) {
+    if (dir == DIR_ROOT || geo.version == 1) return -ENOSPC;
+
+    sfs2_blockidx_t last = dir;
+    while (block_table[last - 1] != SFS2_BLOCKIDX_END) last = block_table[last - 1];
+
+    sfs2_blockidx_t unit = alloc_dir_unit(last);
+    if (unit == SFS2_BLOCKIDX_EMPTY) return -ENOSPC;
+    chain_cache_drop(dir);
+
+    off_t unit_off = get_block_offset(unit);
+    *entry_off = unit_off;
+
+    pthread_mutex_lock(&cache_lock);
+    struct dir_index *idx = diridx_find(dir);
+    for (unsigned i = geo.dir_size / ENTRY_SIZE; idx != NULL && i-- > 0;) {
+        if (!diridx_push_free(idx, unit_off + i * ENTRY_SIZE)) {
+            diridx_drop_locked(dir);
+            idx = NULL;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    return 0;
+}
+
+/*
+ * Make room in the full directory `dir` by moving the data of one of its
+ * inline files to a block. Returns 0 and the slot it frees in `entry_off`, or
+ * < 0 on error (-ENOSPC if there is no inline file).
+ */
+int dir_reclaim_inline(sfs2_blockidx_t dir, off_t *entry_off) {
+    struct entry entries[SFS_ROOTDIR_NENTRIES];
+    off_t unit_off;
+
+    for (unsigned unit = 0; (unit_off = dir_unit_offset(dir, unit)) >= 0; unit++) {
+        unsigned int entries_num = dir_load(entries, dir_unit_size(dir), unit_off);
+
+        for (unsigned i = 1; i < entries_num; i++) {
+            if (!is_inline_data(&entries[i])) continue;
+
+            off_t owner_off = unit_off + (i - 1) * ENTRY_SIZE;
+            int result = inline_to_chain(NULL, &entries[i - 1], owner_off);
+            if (result != 0) return result;
+
+            // the path of the file is not known here
+            pthread_mutex_lock(&cache_lock);
+            dcache_clear();
+            pthread_mutex_unlock(&cache_lock);
+
+            *entry_off = INLINE_OFF(owner_off);
+            return 0;
+        }
+    }
+
+    return -ENOSPC;
+}
+
+// dir_grow(), or dir_reclaim_inline() when that is not possible
+int dir_make_room(sfs2_blockidx_t dir, off_t *entry_off) {
+    int result = dir_grow(dir, entry_off);
+
+    return result == -ENOSPC ? dir_reclaim_inline(dir, entry_off) : result;
+}
+
+/*
+ * Find a free slot for a new entry `name` in directory `dir`, growing it (or
+ * taking the slot of inline data) when it is full. Returns 0 and the slot's
+ * disk offset in `entry_off`, -EEXIST when `name` is taken, or -ENOSPC when
+ * the directory is full.
+ */
+int dir_find_slot(sfs2_blockidx_t dir, const char *name, off_t *entry_off) {
+    struct entry entry;
+    int result = diridx_lookup(dir, name, &entry, entry_off);
+    if (result == 0) return -EEXIST;
+
+    // an indexed directory has its free slots at hand
+    if (result < 0) {
+        pthread_mutex_lock(&cache_lock);
+        struct dir_index *idx = diridx_find(dir);
+        result = idx == NULL ? 1 : idx->nfree == 0 ? -ENOSPC : 0;
+        if (result == 0) *entry_off = idx->free_slots[idx->nfree - 1];
+        pthread_mutex_unlock(&cache_lock);
+
+        if (result == 0) return 0;
+        if (result < 0) return dir_make_room(dir, entry_off);
+    }
+
+    struct entry entries[SFS_ROOTDIR_NENTRIES];
+    off_t unit_off;
+    result = -ENOSPC;    // unless there is a free one
+    for (unsigned unit = 0; (unit_off = dir_unit_offset(dir, unit)) >= 0; unit++) {
+        unsigned int entries_num = dir_load(entries, dir_unit_size(dir), unit_off);
+
+        for (unsigned i = 0; i < entries_num; i++) {
+            if (strcmp(entries[i].filename, name) == 0) return -EEXIST;
+            if (result != 0 && entries[i].filename[0] == '\0') {
+                *entry_off = unit_off + i * ENTRY_SIZE;
+                result = 0;
+            }
+        }
+    }
+
+    return result == -ENOSPC ? dir_make_room(dir, entry_off) : result;
+}
+
+/*
+ * Inode numbers. An entry gets the inode of the slot it is created in
+ * (slot_ino()) and keeps it while mounted, also when it moves. Moved entries
+ * and inodes the kernel holds (ino_hold()) have a record; a slot whose inode
+ * went elsewhere hands out a new generation. Protected by cache_lock.
+ */
+#define INO_FIRST       (FUSE_ROOT_ID + 1)
+#define INO_GEN_SHIFT   44      // above the inode of any slot, see SFS2_NBLOCKS_MAX
+#define INO_NBUCKETS    1024
+
+struct ino_record {
+    struct ino_record *next_ino;        // in ino_by_ino
+    struct ino_record *next_slot;       // in ino_by_slot, unless removed
+    fuse_ino_t ino;
+    off_t entry_off;                    // < 0 once the entry is removed, see ino_entry_removed()
+    uint64_t nlookup;
+};
+
+static struct ino_record *ino_by_ino[INO_NBUCKETS];
+static struct ino_record *ino_by_slot[INO_NBUCKETS];
+
+fuse_ino_t slot_ino(off_t entry_off) {
+    return INO_FIRST + (entry_off - geo.rootdir_off) / ENTRY_SIZE;
+}
+
+// cache_lock must be held; the link to the record of `ino`, *link is NULL if none
+struct ino_record **ino_find(fuse_ino_t ino) {
+    struct ino_record **link = &ino_by_ino[ino % INO_NBUCKETS];
+
+    while (*link != NULL && (*link)->ino != ino) link = &(*link)->next_ino;
+    return link;
+}
+
+// like ino_find(), for the record of the entry at `entry_off`
+struct ino_record **ino_find_slot(off_t entry_off) {
+    struct ino_record **link = &ino_by_slot[slot_ino(entry_off) % INO_NBUCKETS];
+
+    while (*link != NULL && (*link)->entry_off != entry_off) link = &(*link)->next_slot;
+    return link;
+}
+
+/*
+ * Record of the entry at `entry_off`, created when there is none and `create`
+ * is set, or the inode of the slot is taken. cache_lock must be held.
+ * Returns the inode in `ino`, and 0, or -ENOMEM.
+ */
+int ino_get(off_t entry_off, bool create, fuse_ino_t *ino, struct ino_record **rec) {
+    *rec = *ino_find_slot(entry_off);
+    if (*rec != NULL) {
+        *ino = (*rec)->ino;
+        return 0;
+    }
+
+    fuse_ino_t gen = 0;
+    while (*ino_find(slot_ino(entry_off) | gen << INO_GEN_SHIFT) != NULL) gen++;
+    *ino = slot_ino(entry_off) | gen << INO_GEN_SHIFT;
+    if (gen == 0 && !create) return 0;
+
+    *rec = calloc(1, sizeof(struct ino_record));
+    if (*rec == NULL) return -ENOMEM;
+    (*rec)->ino = *ino;
+    (*rec)->entry_off = entry_off;
+    (*rec)->next_ino = ino_by_ino[*ino % INO_NBUCKETS];
+    ino_by_ino[*ino % INO_NBUCKETS] = *rec;
+    (*rec)->next_slot = ino_by_slot[slot_ino(entry_off) % INO_NBUCKETS];
+    ino_by_slot[slot_ino(entry_off) % INO_NBUCKETS] = *rec;
+
+    return 0;
+}
+
+// cache_lock must be held; drop `rec` unless it is still needed
+void ino_put(struct ino_record *rec) {
+    if (rec->nlookup > 0) return;
+    if (rec->entry_off >= 0 && rec->ino != slot_ino(rec->entry_off)) return;
+
+    if (rec->entry_off >= 0) *ino_find_slot(rec->entry_off) = rec->next_slot;
+    *ino_find(rec->ino) = rec->next_ino;
+    free(rec);
+}
+
+// inode of the entry at `entry_off`, 0 when out of memory
+fuse_ino_t entry_ino(off_t entry_off) {
+    fuse_ino_t ino;
+    struct ino_record *rec;
+
+    pthread_mutex_lock(&cache_lock);
+    int result = ino_get(entry_off, false, &ino, &rec);
+    pthread_mutex_unlock(&cache_lock);
+
+    return result == 0 ? ino : 0;
+}
+
+/*
+ * Count a lookup of the entry at `entry_off` that is about to be answered, and
+ * return its inode. Called with fs_lock held, so the entry is still there.
+ * Returns 0 when out of memory.
+ */
+fuse_ino_t ino_hold(off_t entry_off) {
+    fuse_ino_t ino;
+    struct ino_record *rec;
+
+    pthread_mutex_lock(&cache_lock);
+    int result = ino_get(entry_off, true, &ino, &rec);
+    if (result == 0) rec->nlookup++;
+    pthread_mutex_unlock(&cache_lock);
+
+    return result == 0 ? ino : 0;
+}
+
+// the kernel forgets `nlookup` lookups of inode `ino`
+void ino_forget(fuse_ino_t ino, uint64_t nlookup) {
+    pthread_mutex_lock(&cache_lock);
+    struct ino_record *rec = *ino_find(ino);
+    if (rec != NULL) {
+        rec->nlookup -= nlookup < rec->nlookup ? nlookup : rec->nlookup;
+        ino_put(rec);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Slot of the entry of inode `ino`, which is one of an entry, < 0 if it was
+ * removed (see ino_entry_removed()). The slot may be free, or out of the image
+ * for a made up inode.
+ */
+off_t ino_entry_off(fuse_ino_t ino) {
+    pthread_mutex_lock(&cache_lock);
+    off_t entry_off = -1;
+    struct ino_record *rec = *ino_find(ino);
+    if (rec != NULL) {
+        entry_off = rec->entry_off;
+    } else if (ino >> INO_GEN_SHIFT == 0) {
+        entry_off = geo.rootdir_off + (off_t) (ino - INO_FIRST) * ENTRY_SIZE;
+        if (*ino_find_slot(entry_off) != NULL) entry_off = -1;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    return entry_off;
+}
+
+/*
+ * The entry at `entry_off` was removed, the kernel may still hold its inode.
+ * It lives on as an orphan at `orphan_off` if open (see struct sfs_file).
+ */
+void ino_entry_removed(off_t entry_off, off_t orphan_off) {
+    pthread_mutex_lock(&cache_lock);
+    struct ino_record **link = ino_find_slot(entry_off);
+    struct ino_record *rec = *link;
+    if (rec != NULL) {
+        *link = rec->next_slot;
+        rec->entry_off = orphan_off;
+        ino_put(rec);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// make sure the entry at `entry_off` has a record, before it moves to another slot
+int ino_entry_pin(off_t entry_off) {
+    fuse_ino_t ino;
+    struct ino_record *rec;
+
+    pthread_mutex_lock(&cache_lock);
+    int result = ino_get(entry_off, true, &ino, &rec);
+    pthread_mutex_unlock(&cache_lock);
+
+    return result;
+}
+
+// the entry at `entry_off` moved to the free slot at `new_off`, see ino_entry_pin()
+void ino_entry_moved(off_t entry_off, off_t new_off) {
+    pthread_mutex_lock(&cache_lock);
+    struct ino_record **link = ino_find_slot(entry_off);
+    struct ino_record *rec = *link;
+    if (rec != NULL) {
+        *link = rec->next_slot;
+        rec->entry_off = new_off;
+        rec->next_slot = ino_by_slot[slot_ino(new_off) % INO_NBUCKETS];
+        ino_by_slot[slot_ino(new_off) % INO_NBUCKETS] = rec;
+        ino_put(rec);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Find a free slot for a new entry `path` in its parent directory.
+ * Returns 0, the parent in `parent` and the slot's disk offset in `entry_off`,
+ * or < 0 on error.
+ */
+int find_free_slot(const char *path, sfs2_blockidx_t *parent, off_t *entry_off) {
+    struct entry target;
+    int result = get_entry(path, &target, NULL);
+
+    // check existence
+    if (result == 0) return -EEXIST;
+    if (result != -ENOENT) return result;
+
+    // get parent and find free entry slot
+    result = get_parent_info(path, parent);
+    if (result != 0) return result;
+
+    return dir_find_slot(*parent, get_path_name(path), entry_off);
+}
+
+/*
+ * Fill in a new entry `name` of directory `dir` at `entry_off` (see
+ * find_free_slot), an empty file or, when `is_dir` is set, an empty directory,
+ * and return it in `entry`. `path` is passed on to write_entry().
+ * Returns 0 on success, < 0 on error.
+ */
+int add_entry(const char *path, sfs2_blockidx_t dir, off_t entry_off, const char *name,
+              bool is_dir, struct entry *entry) {
+    memset(entry, 0, sizeof(struct entry));
+    strcpy(entry->filename, name);
+
+    if (is_dir) {
+        entry->first_block = alloc_dir_unit(SFS2_BLOCKIDX_END);
+        if (entry->first_block == SFS2_BLOCKIDX_EMPTY) return -ENOSPC;
+        entry->size = SFS2_DIRECTORY;
+    } else {
+        entry->first_block = SFS2_BLOCKIDX_END;
+        entry->size = 0;
+    }
+    write_entry(path, entry, entry_off);
+    diridx_add(dir, name, entry_off);
+
+    return 0;
+}
+
+/*
+ * Remove the file or empty directory `target` from its slot at `target_off`
+ * in directory `dir` and free its blocks. An open file becomes an orphan
+ * instead (see struct sfs_file), its inline data moved to a block first. The
+ * caller updates the lookup cache.
+ * Returns 0 on success, < 0 on error.
+ */
+int remove_entry(sfs2_blockidx_t dir, const struct entry *target, off_t target_off) {
+    if (target->size & SFS2_DIRECTORY) {
+        struct entry target_entries[SFS_ROOTDIR_NENTRIES];
+        off_t unit_off;
+        for (unsigned unit = 0; (unit_off = dir_unit_offset(target->first_block, unit)) >= 0;
+             unit++) {
+            unsigned int entries_num = dir_load(target_entries, geo.dir_size, unit_off);
+            for (unsigned i = 0; i < entries_num; ++i) {
+                if (target_entries[i].first_block != SFS2_BLOCKIDX_EMPTY) {
+                    return -ENOTEMPTY;
+                }
+            }
+        }
+    }
+
+    struct sfs_file *file = file_find(target_off);
+    struct entry entry = *target;
+    if (file != NULL && (entry.size & SFS2_INLINE)) {
+        int result = inline_to_chain(NULL, &entry, target_off);
+        if (result != 0) return result;
+    }
+
+    // unlink from parent, the inline data goes with the entry
+    struct entry empty_entry;
+    memset(&empty_entry, 0, sizeof(struct entry));
+    entry_store(&empty_entry, target_off);
+    if (entry.size & SFS2_INLINE) inline_release(&entry, target_off);
+    diridx_remove(dir, entry.filename, target_off);
+
+    if (file != NULL) {
+        pthread_mutex_lock(&cache_lock);
+        file->entry_off = --orphan_last;
+        pthread_mutex_unlock(&cache_lock);
+        ino_entry_removed(target_off, file->entry_off);
+        return 0;
+    }
+    ino_entry_removed(target_off, -1);
+
+    // unlink from block table
+    if (entry.size & SFS2_DIRECTORY) {
+        diridx_drop(entry.first_block);
+        chain_cache_drop(entry.first_block);
+        free_chain(entry.first_block);
+        return 0;
+    }
+
+    if (entry.first_block != SFS2_BLOCKIDX_END) chain_cache_drop(entry.first_block);
+    free_chain(entry.first_block);
+
+    return 0;
+}
+
+/*
+ * Rename file or directory `entry` at `entry_off` in directory `dir` to
+ * `newname` in directory `newdir`, replacing a file by a file or an empty
+ * directory by a directory. Returns 0 with the new slot in `new_off` and the
+ * replaced one in `target_off` (-1 if none), or < 0 on error.
+ */
+int rename_entry(sfs2_blockidx_t dir, struct entry *entry, off_t entry_off,
+                 sfs2_blockidx_t newdir, const char *newname, off_t *new_off,
+                 off_t *target_off) {
+    struct entry target;
+    int result = dir_lookup(newdir, newname, &target, target_off);
+    if (result == -ENOENT) *target_off = -1;
+    else if (result != 0) return result;
+
+    if (*target_off == entry_off) {
+        *new_off = entry_off;
+        *target_off = -1;
+        return 0;
+    }
+    if (*target_off >= 0) {
+        if ((entry->size & SFS2_DIRECTORY) && !(target.size & SFS2_DIRECTORY)) return -ENOTDIR;
+        if (!(entry->size & SFS2_DIRECTORY) && (target.size & SFS2_DIRECTORY)) return -EISDIR;
+    }
+
+    // the slot it goes to, and room there for its inline data
+    bool inline_room = false;
+    if (dir == newdir) {
+        *new_off = entry_off;
+        inline_room = true;
+    } else if (*target_off >= 0) {
+        *new_off = *target_off;
+        inline_room = (target.size & SFS2_INLINE) || inline_slot_free(*target_off);
+    } else {
+        result = dir_find_slot(newdir, newname, new_off);
+        if (result != 0) return result;
+        inline_room = inline_slot_free(*new_off);
+    }
+
+    if (*new_off != entry_off) {
+        result = ino_entry_pin(entry_off);
+        if (result != 0) return result;
+    }
+    if ((entry->size & SFS2_INLINE) && !inline_room) {
+        result = inline_to_chain(NULL, entry, entry_off);
+        if (result != 0) return result;
+    }
+    if (*target_off >= 0) {
+        result = remove_entry(newdir, &target, *target_off);
+        if (result != 0) return result;
+    }
+
+    struct entry old_entry = *entry;
+    strcpy(entry->filename, newname);
+    if (dir == newdir) {
+        diridx_remove(dir, old_entry.filename, entry_off);
+        write_entry(NULL, entry, entry_off);
+        diridx_add(dir, newname, entry_off);
+        return 0;
+    }
+
+    // the new slot first, a crash leaves the file under both names, not none
+    entry_store(entry, *new_off);
+    diridx_add(newdir, newname, *new_off);
+    if (entry->size & SFS2_INLINE) {
+        char raw[ENTRY_SIZE];
+        disk_read(raw, ENTRY_SIZE, INLINE_OFF(entry_off));
+        disk_write(raw, ENTRY_SIZE, INLINE_OFF(*new_off));
+        inline_slot_take(entry, *new_off, true);
+    }
+
+    struct entry empty_entry;
+    memset(&empty_entry, 0, sizeof(struct entry));
+    entry_store(&empty_entry, entry_off);
+    if (entry->size & SFS2_INLINE) inline_release(&old_entry, entry_off);
+    diridx_remove(dir, old_entry.filename, entry_off);
+    ino_entry_moved(entry_off, *new_off);
+
+    // handles open on it follow the entry
+    struct sfs_file *file = file_find(entry_off);
+    if (file != NULL) {
+        file->entry_off = *new_off;
+        file->entry = *entry;
+    }
+
+    return 0;
+}
+
+/*
+ * Set the size of file `entry` (at `entry_off`, see write_entry() for `path`)
+ * to `size`. Growing takes no blocks on version 2 images: the bytes added are a
+ * hole at the end of the file, which reads as zeroes until it is written to.
+ * Version 1 has no sparse files, so the blocks are taken and zeroed there.
+ * Returns 0 on success, < 0 on error.
+ */
+int truncate_file(const char *path, struct entry *entry, off_t entry_off, off_t size) {
+    if (size < 0) return -EINVAL;
+    int result = check_file_size(size);
+    if (result != 0) return result;
+
+    size_t old_size = entry->size & SFS2_SIZEMASK;
+    if ((entry->size & SFS2_INLINE) && (size_t) size <= SFS_INLINE_MAX) {
+        struct entry old_entry = *entry;
+        entry->size = size > 0 ? SFS2_INLINE | size : 0;
+        write_entry(path, entry, entry_off);
+
+        if (size == 0) {
+            inline_release(&old_entry, entry_off);
+        } else if ((size_t) size < old_size) {
+            // bytes past the end are kept zero, see write_inline()
+            char zeroes[SFS_INLINE_MAX];
+            memset(zeroes, 0, sizeof(zeroes));
+            disk_write(zeroes, old_size - size, INLINE_OFF(entry_off) + 1 + size);
+        }
+        return 0;
+    }
+    if (entry->size & SFS2_INLINE) {
+        result = inline_to_chain(path, entry, entry_off);
+        if (result != 0) return result;
+    }
+
+    // blocks reserved past the end (see fallocate_file()) stay when growing
+    unsigned old_blocks = file_blocks(entry, NULL);
+    unsigned new_blocks = get_block_count(size);
+    if (geo.version == 2 && (new_blocks > old_blocks || (size_t) size > old_size)) {
+        new_blocks = old_blocks;
+    }
+
+    // the last block may hold data from before a shrink past the old size
+    size_t data_size = (size_t) new_blocks * geo.block_size;
+    if ((size_t) size < data_size) data_size = size;
+
+    // blocks shared with clones are copied first, so that resizing cannot fail
+    // halfway, see resize_file()
+    unsigned unshare = new_blocks < old_blocks ? new_blocks : old_blocks;
+    if (data_size > old_size) unshare = new_blocks;
+    else if (new_blocks == old_blocks) unshare = 0;
+    result = file_unshare(entry, unshare);
+    if (result == 0) result = resize_file(entry, old_blocks, size, new_blocks);
+    if (result == 0 && data_size > old_size) {
+        chain_zero(entry->first_block, data_size - old_size, old_size);
+    }
+    write_entry(path, entry, entry_off);
+
+    return result;
+}
+
+/*
+ * Reserve blocks for `length` bytes at `offset` of file `entry` (at
+ * `entry_off`), and grow it to their end unless `keep_size` is set, which
+ * version 1 refuses. Blocks past the end of the file are not initialised.
+ * Returns 0 on success, < 0 on error.
+ */
+int fallocate_file(const char *path, struct entry *entry, off_t entry_off,
+                   off_t offset, off_t length, bool keep_size) {
+    if (offset < 0 || length <= 0) return -EINVAL;
+    if (keep_size && geo.version == 1) return -EOPNOTSUPP;
+
+    size_t end = offset + length;
+    int result = check_file_size(end);
+    if (result != 0) return result;
+
+    if (entry->size & SFS2_INLINE) {
+        result = inline_to_chain(path, entry, entry_off);
+        if (result != 0) return result;
+    }
+
+    size_t old_size = entry->size & SFS2_SIZEMASK;
+    size_t new_size = keep_size || end <= old_size ? old_size : end;
+    unsigned old_blocks = file_blocks(entry, NULL);
+    unsigned new_blocks = get_block_count(end);
+    if (new_blocks <= old_blocks && new_size == old_size) return 0;
+    if (new_blocks < old_blocks) new_blocks = old_blocks;
+
+    size_t data_size = (size_t) old_blocks * geo.block_size;
+    if (old_size < data_size) data_size = old_size;
+
+    // the part of the file that was a hole, or past its end, reads as zeroes
+    size_t new_data_size = (size_t) new_blocks * geo.block_size;
+    if (new_size < new_data_size) new_data_size = new_size;
+
+    // shared blocks first, as in truncate_file()
+    unsigned unshare = new_blocks != old_blocks ? old_blocks : 0;
+    if (new_data_size > data_size) unshare = get_block_count(new_data_size);
+    result = file_unshare(entry, unshare);
+    if (result == 0) result = resize_file(entry, old_blocks, new_size, new_blocks);
+    if (result == 0 && new_data_size > data_size) {
+        chain_zero(entry->first_block, new_data_size - data_size, data_size);
+    }
+    write_entry(path, entry, entry_off);
+
+    return result;
+}
+
+/*
+ * Grow file `entry` for a write of `size` bytes at `offset`, see write_file(),
+ * and copy the blocks it is written to if they are shared with clones. The
+ * chain has no gaps, so blocks taken from the hole of a sparse file for the
+ * write come with those before it, which are zeroed.
+ */
+int write_extend(const char *path, struct entry *entry, off_t entry_off,
+                 size_t size, off_t offset, struct sfs_chain **slot) {
+    size_t old_size = entry->size & SFS2_SIZEMASK;
+    size_t end = offset + size;
+
+    if (entry->size & SFS2_SHARED) {
+        sfs2_blockidx_t first_block = entry->first_block;
+        uint64_t size_field = entry->size;
+        int result = file_unshare(entry, get_block_count(end));
+        if (result != 0) return result;
+        if (entry->first_block != first_block || entry->size != size_field) {
+            write_entry(path, entry, entry_off);
+        }
+    }
+    if (end <= old_size && !(entry->size & SFS2_SPARSE)) return 0;
+
+    int result = check_file_size(end);
+    if (result != 0) return result;
+
+    unsigned old_blocks = file_blocks(entry, slot);
+    unsigned new_blocks = get_block_count(end);
+    if (end <= old_size && new_blocks <= old_blocks) return 0;
+    if (new_blocks < old_blocks) new_blocks = old_blocks;
+
+    size_t data_size = (size_t) old_blocks * geo.block_size;
+    if (old_size < data_size) data_size = old_size;
+    size_t new_size = end > old_size ? end : old_size;
+
+    result = resize_file(entry, old_blocks, new_size, new_blocks);
+    if (result != 0) return result;
+
+    // bytes skipped over by the write read as zero, as do those after it in
+    // the last block taken from the hole
+    if ((size_t) offset > data_size) chain_zero(entry->first_block, offset - data_size, data_size);
+    size_t new_data_size = (size_t) new_blocks * geo.block_size;
+    if (new_size < new_data_size) new_data_size = new_size;
+    if (end < new_data_size) chain_zero(entry->first_block, new_data_size - end, end);
+    write_entry(path, entry, entry_off);
+
+    return 0;
+}
+
+/*
+ * Write `size` bytes of `buf` at `offset` of file `entry` (at `entry_off`, see
+ * write_entry() for `path`), growing it as needed. `slot` is the chain index
+ * to use, see chain_seek().
+ * Returns the number of bytes written, or < 0 on error.
+ */
+int write_file(const char *path, struct entry *entry, off_t entry_off,
+               const char *buf, size_t size, off_t offset, struct sfs_chain **slot) {
+    if (size == 0) return 0;
+
+    int result = 0;
+    if (entry->size == 0 || (entry->size & SFS2_INLINE)) {
+        result = write_inline(path, entry, entry_off, buf, size, offset);
+        if (result != 0) return result;
+    }
+
+    result = write_extend(path, entry, entry_off, size, offset, slot);
+    if (result != 0) return result;
+
+    return chain_io(entry->first_block, (char *) buf, size, offset, true, slot);
+}
+
+/*
+ * write_file() for data in FUSE buffer `src`, which may be a pipe the kernel
+ * spliced the request into. If chain_map() allows, the FUSE library copies it
+ * straight into the image, otherwise it goes through memory.
+ */
+int write_file_buf(const char *path, struct entry *entry, off_t entry_off,
+                   struct fuse_bufvec *src, off_t offset, struct sfs_chain **slot) {
+    size_t size = fuse_buf_size(src);
+    if (size == 0) return 0;
+
+    // small enough for inline data, see write_inline()
+    if (geo.version == 2 && offset + size <= SFS_INLINE_MAX) {
+        char data[SFS_INLINE_MAX];
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+        dst.buf[0].mem = data;
+        ssize_t done = fuse_buf_copy(&dst, src, 0);
+        if (done <= 0) return done;
+
+        return write_file(path, entry, entry_off, data, done, offset, slot);
+    }
+    if (entry->size & SFS2_INLINE) {
+        int result = inline_to_chain(path, entry, entry_off);
+        if (result != 0) return result;
+    }
+
+    int result = write_extend(path, entry, entry_off, size, offset, slot);
+    if (result != 0) return result;
+
+    struct fuse_bufvec *dst = malloc(sizeof(struct fuse_bufvec) +
+                                     CHAIN_MAP_MAX_RUNS * sizeof(struct fuse_buf));
+    if (dst == NULL) return -ENOMEM;
+
+    *dst = FUSE_BUFVEC_INIT(size);
+    unsigned count = chain_map(entry->first_block, size, offset, true, slot,
+                               dst->buf, CHAIN_MAP_MAX_RUNS);
+    if (count > 0) {
+        dst->count = count;
+        ssize_t done = fuse_buf_copy(dst, src, 0);
+        free(dst);
+        return done;
+    }
+
+    // through memory
+    dst->buf[0].mem = malloc(size);
+    if (dst->buf[0].mem == NULL) {
+        free(dst);
+        return -ENOMEM;
+    }
+
+    ssize_t done = fuse_buf_copy(dst, src, 0);
+    if (done > 0) done = chain_io(entry->first_block, dst->buf[0].mem, done, offset, true, slot);
+
+    free(dst->buf[0].mem);
+    free(dst);
+    return done;
+}
+
+/*
+ * Online defragmentation (see the control file): a file with more than one
+ * extent is copied to the first free run that holds all of it. The new chain is
+ * on disk before the entry points to it, so a crash leaves orphans for fsck.
+ */
+#define DEFRAG_CHUNK    (1024 * 1024)   // bytes copied at a time
+
+struct defrag_stats {
+    unsigned files;
+    unsigned fragmented;        // files with more than one extent
+    unsigned moved;             // of those, now in a single one
+    unsigned long extents_before, extents_after;
+};
+
+// number of runs of consecutive blocks in the chain starting at `block`
+unsigned chain_extents(sfs2_blockidx_t block) {
+    unsigned extents = 0;
+
+    // bounded by the table size in case the chain is corrupt (cyclic)
+    for (unsigned n = 0; block != SFS2_BLOCKIDX_END && block != SFS2_BLOCKIDX_EMPTY &&
+                         n < geo.nblocks; n++) {
+        sfs2_blockidx_t next = block_table[block - 1];
+        if (next != block + 1) extents++;
+        block = next;
+    }
+
+    return extents;
+}
+
+/*
+ * Move file `entry` at `entry_off` (see write_entry() for `path`) to a single
+ * run of blocks if it is fragmented, account for it in `stats` and report it
+ * to `out`. Returns 0 on success (also when there was nothing to do), -ENOSPC
+ * when no free run is big enough, < 0 on other errors.
+ */
+int defrag_file(const char *path, struct entry *entry, off_t entry_off,
+                struct defrag_stats *stats, FILE *out) {
+    unsigned nblocks = file_blocks(entry, NULL);
+    unsigned extents = chain_extents(entry->first_block);
+
+    stats->files++;
+    stats->extents_before += extents;
+    stats->extents_after += extents;
+    if (extents <= 1) return 0;
+    stats->fragmented++;
+
+    // the blocks are in the chains of other clones as well
+    if (entry->size & SFS2_SHARED) {
+        fprintf(out, "%s: %u extents, not moved: shared with clones\n", path, extents);
+        return 0;
+    }
+
+    sfs2_blockidx_t start;
+    char *buf = NULL;
+    int result = find_free_run(nblocks, &start) < nblocks ? -ENOSPC : 0;
+    if (result == 0) {
+        buf = malloc(DEFRAG_CHUNK);
+        if (buf == NULL) result = -ENOMEM;
+    }
+    if (result != 0) {
+        fprintf(out, "%s: %u extents, not moved: %s\n", path, extents, strerror(-result));
+        return result;
+    }
+
+    // whole blocks, so the bytes past the end of the file come along
+    wb_writeback_chain(entry->first_block);
+    size_t size = (size_t) nblocks * geo.block_size;
+    for (size_t pos = 0; pos < size; pos += DEFRAG_CHUNK) {
+        size_t len = size - pos < DEFRAG_CHUNK ? size - pos : DEFRAG_CHUNK;
+        if (chain_io(entry->first_block, buf, len, pos, false, NULL) < len) {
+            fprintf(out, "%s: chain is shorter than the file, not moved\n", path);
+            free(buf);
+            return -EIO;
+        }
+        disk_write(buf, len, get_block_offset(start) + pos);
+    }
+    free(buf);
+
+    for (unsigned i = 0; i < nblocks; i++) {
+        block_table_set(start + i, i + 1 < nblocks ? start + i + 1 : SFS2_BLOCKIDX_END);
+        // a stale mark would have wb_write() zero the block instead of reading it
+        wb_unwritten[(start + i - 1) / 64] &= ~(1ull << ((start + i - 1) % 64));
+    }
+    block_table_flush();
+
+    sfs2_blockidx_t old_first_block = entry->first_block;
+    entry->first_block = start;
+    write_entry(path, entry, entry_off);
+
+    chain_cache_drop(old_first_block);
+    chain_cache_drop(start);
+    free_chain(old_first_block);
+
+    stats->moved++;
+    stats->extents_after -= extents - 1;
+    fprintf(out, "%s: %u -> 1 extents\n", path, extents);
+
+    return 0;
+}
+
+/*
+ * defrag_file() for every file in directory `dir` and below. `path` is the
+ * directory's path ("" for the root), in a buffer of PATH_MAX bytes.
+ */
+void defrag_dir(sfs2_blockidx_t dir, char *path, struct defrag_stats *stats, FILE *out) {
+    // not on the stack, this recurses as deep as the tree goes
+    struct entry *entries = malloc(SFS_ROOTDIR_NENTRIES * sizeof(struct entry));
+    size_t path_len = strlen(path);
+    off_t unit_off;
+
+    if (entries == NULL) {
+        fprintf(out, "%s: out of memory, skipped\n", path);
+        return;
+    }
+
+    for (unsigned unit = 0; (unit_off = dir_unit_offset(dir, unit)) >= 0; unit++) {
+        unsigned int entries_num = dir_load(entries, dir_unit_size(dir), unit_off);
+
+        for (unsigned i = 0; i < entries_num; i++) {
+            struct entry *entry = &entries[i];
+            if (entry->filename[0] == '\0' || is_inline_data(entry)) continue;
+
+            if (path_len + 1 + strlen(entry->filename) >= PATH_MAX) {
+                fprintf(out, "%s/%s: path too long, skipped\n", path, entry->filename);
+                continue;
+            }
+            sprintf(path + path_len, "/%s", entry->filename);
+
+            if (entry->size & SFS2_DIRECTORY) {
+                defrag_dir(entry->first_block, path, stats, out);
+            } else {
+                defrag_file(path, entry, unit_off + i * ENTRY_SIZE, stats, out);
+            }
+        }
+    }
+
+    path[path_len] = '\0';
+    free(entries);
+}
+
+/*
+ * Attributes of `entry`, or of the root directory when `entry` is NULL.
+ * st_ino is left to the caller.
+ */
+void fill_stat(const struct entry *entry, struct stat *st) {
+    memset(st, 0, sizeof(struct stat));
+    /* Set owner to user/group who mounted the image */
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    /* Last accessed/modified just now */
+    st->st_atime = time(NULL);
+    st->st_mtime = time(NULL);
+
+    if (entry == NULL || (entry->size & SFS2_DIRECTORY)) {
+        st->st_mode = S_IFDIR | 0755;
+        st->st_nlink = 2;
+    } else {
+        st->st_mode = S_IFREG | 0755;
+        st->st_nlink = 1;
+        st->st_size = entry->size & SFS2_SIZEMASK;
+    }
+}
+
+/*
+ * Control file: a hidden file in the root directory, not stored on disk. Every
+ * write to it is a command, run under the exclusive fs_lock, whose output is
+ * read back through the same handle. Commands:
+ *   defrag [PATH]      see defrag_file()
+ *   clone SRC DST      see ctl_clone()
+ */
+#define CTL_NAME        ".sfs_control"
+#define CTL_PATH        "/" CTL_NAME
+#define CTL_CMD_MAX     (2 * PATH_MAX + 64)
+#define INO_CTL         (~(fuse_ino_t) 0)       // beyond any entry_ino()
+
+// control file handle, in fi->fh
+struct sfs_ctl {
+    char *output;
+    size_t output_len;
+};
+
+bool is_ctl_path(const char *path) {
+    return strcmp(path, CTL_PATH) == 0;
+}
+
+void ctl_stat(struct stat *st) {
+    fill_stat(NULL, st);
+    st->st_mode = S_IFREG | 0600;
+    st->st_nlink = 1;
+    st->st_ino = INO_CTL;
+}
+
+int ctl_open(struct fuse_file_info *fi) {
+    struct sfs_ctl *ctl = calloc(1, sizeof(struct sfs_ctl));
+    if (ctl == NULL) return -ENOMEM;
+
+    fi->fh = (uintptr_t) ctl;
+    // the output is longer than the file's size of 0, keep the page cache out
+    fi->direct_io = 1;
+
+    return 0;
+}
+
+void ctl_release(struct fuse_file_info *fi) {
+    struct sfs_ctl *ctl = (struct sfs_ctl *) (uintptr_t) fi->fh;
+
+    free(ctl->output);
+    free(ctl);
+}
+
+int ctl_read(struct fuse_file_info *fi, char *buf, size_t size, off_t offset) {
+    struct sfs_ctl *ctl = (struct sfs_ctl *) (uintptr_t) fi->fh;
+
+    if ((size_t) offset >= ctl->output_len) return 0;
+    if (size > ctl->output_len - offset) size = ctl->output_len - offset;
+    memcpy(buf, ctl->output + offset, size);
+
+    return size;
+}
+
+// command "defrag [PATH]", `arg` is NULL without a path
+int ctl_defrag(const char *arg, FILE *out) {
+    struct defrag_stats stats;
+    struct entry entry;
+    off_t entry_off;
+    int result = 0;
+
+    memset(&stats, 0, sizeof(stats));
+    if (arg == NULL || strcmp(arg, "/") == 0) {
+        entry.first_block = DIR_ROOT;
+        entry.size = SFS2_DIRECTORY;
+        arg = "";
+    } else {
+        result = get_entry(arg, &entry, &entry_off);
+        if (result != 0) return result;
+    }
+
+    if (entry.size & SFS2_DIRECTORY) {
+        char *path = malloc(PATH_MAX);
+        if (path == NULL) return -ENOMEM;
+
+        strcpy(path, arg);
+        defrag_dir(entry.first_block, path, &stats, out);
+        free(path);
+    } else {
+        result = defrag_file(arg, &entry, entry_off, &stats, out);
+    }
+
+    fprintf(out, "%u files, %u fragmented, %u defragmented, %lu extents before, %lu after\n",
+            stats.files, stats.fragmented, stats.moved, stats.extents_before,
+            stats.extents_after);
+
+    // a file that does not fit is not an error of the command
+    return result == -ENOSPC ? 0 : result;
+}
+
+/*
+ * Command "clone SRC DST": create file DST sharing all blocks of file SRC;
+ * both copy the blocks they write to from then on. Not on version 1 images.
+ */
+int ctl_clone(char *arg, FILE *out) {
+    if (geo.version == 1) return -EOPNOTSUPP;
+
+    char *dst = arg != NULL ? strchr(arg, ' ') : NULL;
+    if (dst == NULL) return -EINVAL;
+    *dst++ = '\0';
+    dst += strspn(dst, " ");
+    if (*dst == '\0') return -EINVAL;
+
+    struct entry src;
+    off_t src_off;
+    int result = get_entry(arg, &src, &src_off);
+    if (result != 0) return result;
+    if (src.size & SFS2_DIRECTORY) return -EISDIR;
+
+    sfs2_blockidx_t parent;
+    off_t entry_off;
+    result = find_free_slot(dst, &parent, &entry_off);
+    if (result != 0) return result;
+
+    // making room may have moved the inline data of SRC to a block
+    result = get_entry(arg, &src, &src_off);
+    if (result != 0) return result;
+
+    unsigned nblocks = 0;
+    uint64_t src_size = src.size;
+    if (src.first_block != SFS2_BLOCKIDX_END) {
+        result = chain_ref(src.first_block);
+        if (result != 0) return result;
+
+        nblocks = chain_length(src.first_block, NULL);
+        src.size |= SFS2_SHARED;
+        write_entry(arg, &src, src_off);
+    }
+
+    struct entry clone;
+    result = add_entry(dst, parent, entry_off, get_path_name(dst), false, &clone);
+    if (result != 0) {
+        if (nblocks > 0) {
+            chain_unref(src.first_block);
+            src.size = src_size;
+            write_entry(arg, &src, src_off);
+        }
+        return result;
+    }
+
+    if (src.size & SFS2_INLINE) {
+        // inline data is not shared, the clone gets a copy
+        char data[SFS_INLINE_MAX];
+        size_t size = src.size & SFS2_SIZEMASK;
+        read_file(&src, src_off, data, size, 0, NULL);
+        result = write_file(dst, &clone, entry_off, data, size, 0, NULL);
+        if (result < 0) return result;
+    } else {
+        clone.first_block = src.first_block;
+        clone.size = src.size;
+        write_entry(dst, &clone, entry_off);
+    }
+
+    // either frontend may have looked up the new name, and cached it as missing
+    pthread_mutex_lock(&cache_lock);
+    dcache_clear();
+    pthread_mutex_unlock(&cache_lock);
+
+    fprintf(out, "%s: cloned to %s, %u blocks shared\n", arg, dst, nblocks);
+    return 0;
+}
+
+// run the command in `buf`, of `size` bytes; returns `size`, or < 0 on error
+int ctl_write(struct fuse_file_info *fi, const char *buf, size_t size) {
+    struct sfs_ctl *ctl = (struct sfs_ctl *) (uintptr_t) fi->fh;
+    char cmd[CTL_CMD_MAX];
+
+    if (size >= sizeof(cmd)) return -EINVAL;
+    memcpy(cmd, buf, size);
+    cmd[size] = '\0';
+    cmd[strcspn(cmd, "\n")] = '\0';
+
+    char *arg = strchr(cmd, ' ');
+    if (arg != NULL) {
+        *arg++ = '\0';
+        arg += strspn(arg, " ");
+        if (*arg == '\0') arg = NULL;
+    }
+
+    free(ctl->output);
+    ctl->output = NULL;
+    ctl->output_len = 0;
+    FILE *out = open_memstream(&ctl->output, &ctl->output_len);
+    if (out == NULL) return -ENOMEM;
+
+    int result;
+    if (strcmp(cmd, "defrag") == 0) {
+        result = ctl_defrag(arg, out);
+    } else if (strcmp(cmd, "clone") == 0) {
+        result = ctl_clone(arg, out);
+    } else {
+        result = -EINVAL;
+    }
+    fclose(out);
+
+    return result < 0 ? result : (int) size;
+}
+
+// ctl_write() for a command in FUSE buffer `src`
+int ctl_write_buf(struct fuse_file_info *fi, struct fuse_bufvec *src) {
+    size_t size = fuse_buf_size(src);
+    char cmd[CTL_CMD_MAX];
+
+    if (size >= sizeof(cmd)) return -EINVAL;
+
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+    dst.buf[0].mem = cmd;
+    ssize_t done = fuse_buf_copy(&dst, src, 0);
+    if (done < 0) return done;
+
+    return ctl_write(fi, cmd, done);
+}
+
+/*
+ * Statistics file: a hidden, read-only file next to the control file. Opening
+ * it takes a snapshot of the statistics (see stats_report()), read back
+ * through the handle like the output of a command. The image is not touched.
+ */
+#define STATS_NAME      ".sfs_stats"
+#define STATS_PATH      "/" STATS_NAME
+#define INO_STATS       (INO_CTL - 1)
+
+bool is_stats_path(const char *path) {
+    return strcmp(path, STATS_PATH) == 0;
+}
+
+void stats_stat(struct stat *st) {
+    fill_stat(NULL, st);
+    st->st_mode = S_IFREG | 0444;
+    st->st_nlink = 1;
+    st->st_ino = INO_STATS;
+}
+
+void stats_print_hits(FILE *out, const char *name, unsigned long hits, unsigned long misses) {
+    unsigned long total = hits + misses;
+
+    fprintf(out, "%-12s %lu hits, %lu misses (%.1f%% hits)\n", name, hits, misses,
+            total > 0 ? 100.0 * hits / total : 0.0);
+}
+
+/*
+ * Write the statistics to `out`: the count and latency of every operation seen
+ * so far, disk accesses, cache hit rates and how the free space is spread over
+ * the disk. Called with fs_lock held.
+ */
+void stats_report(FILE *out) {
+    struct sfs_stats sum;
+    stats_sum(&sum);
+
+    fprintf(out, "%-12s %10s %12s %10s %10s\n", "operation", "count", "total ms", "avg us",
+            "max us");
+    for (unsigned i = 0; i < STATS_NOPS; i++) {
+        const struct op_stats *op = &sum.ops[i];
+        if (op->count == 0) continue;
+
+        fprintf(out, "%-12s %10lu %12.3f %10.1f %10.1f\n", stats_op_names[i], op->count,
+                op->total_ns / 1e6, op->total_ns / 1e3 / op->count, op->max_ns / 1e3);
+    }
+
+    fprintf(out, "\n%-12s %lu, %llu bytes\n", "disk reads", sum.disk.reads, sum.disk.bytes_read);
+    fprintf(out, "%-12s %lu, %llu bytes\n", "disk writes", sum.disk.writes,
+            sum.disk.bytes_written);
+    fprintf(out, "%-12s %lu\n", "disk syncs", sum.disk.syncs);
+    fprintf(out, "%-12s %llu bytes\n", "fd buffers", sum.bytes_mapped);
+
+    stats_print_hits(out, "dcache", sum.dcache_hits, sum.dcache_misses);
+    stats_print_hits(out, "dir index", sum.diridx_hits, sum.diridx_misses);
+    stats_print_hits(out, "chain index", sum.chain_hits, sum.chain_misses);
+    stats_print_hits(out, "write-back", sum.wb_hits, sum.wb_misses);
+    fprintf(out, "%-12s %lu runs written back, %u blocks dirty\n", "", sum.wb_runs, wb_count);
+
+    unsigned runs = 0, largest = 0;
+    for (long index = free_map_next(0); index >= 0; ) {
+        unsigned len = free_map_run(index);
+        runs++;
+        if (len > largest) largest = len;
+        index = free_map_next(index + len);
+    }
+    fprintf(out, "%-12s %u of %u blocks in %u runs, largest %u, average %.1f\n", "free space",
+            free_count, geo.nblocks, runs, largest, runs > 0 ? (double) free_count / runs : 0.0);
+}
+
+// open the statistics file, see above
+int stats_open(struct fuse_file_info *fi) {
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) return -EACCES;
+
+    int result = ctl_open(fi);
+    if (result != 0) return result;
+
+    struct sfs_ctl *ctl = (struct sfs_ctl *) (uintptr_t) fi->fh;
+    FILE *out = open_memstream(&ctl->output, &ctl->output_len);
+    if (out == NULL) {
+        ctl_release(fi);
+        return -ENOMEM;
+    }
+    stats_report(out);
+    fclose(out);
+
+    return 0;
+}
+
+
+/*
+ * Retrieve information about a file or directory.
+ * You should populate fields of `stbuf` with appropriate information if the
+ * file exists and is accessible, or return an error otherwise.
+ *
+ * For directories, you should at least set st_mode (with S_IFDIR) and st_nlink.
+ * For files, you should at least set st_mode (with S_IFREG), st_nlink and
+ * st_size.
+ *
+ * Return 0 on success, < 0 on error.
+ */
+static int sfs_getattr(const char *path,
+                       struct stat *st) {
+    log("getattr %s\n", path);
+
+    if (strcmp(path, "/") == 0) {
+        fill_stat(NULL, st);
+        st->st_ino = FUSE_ROOT_ID;
+        return 0;
+    }
+    if (is_ctl_path(path)) {
+        ctl_stat(st);
+        return 0;
+    }
+    if (is_stats_path(path)) {
+        stats_stat(st);
+        return 0;
+    }
+
+    struct entry entry;
+    off_t entry_off;
+    int result = get_entry(path, &entry, &entry_off);
+
+    if (result == -ENAMETOOLONG) {
+        log("Error: name too long\n");
+        return -ENAMETOOLONG;
+    };
+    if (result == -ENOENT) {
+        log("Error: file or directory not found\n");
+        return -ENOENT;
+    };
+    if (result != 0) return result;
+
+    fill_stat(&entry, st);
+    st->st_ino = entry_ino(entry_off);
+
+    return st->st_ino != 0 ? 0 : -ENOMEM;
+}
+
+
+// directory handle of opendir, in fi->fh
+struct sfs_dirhandle {
+    sfs2_blockidx_t dir;
+};
+
+/*
+ * Open directory `path` for reading, remembering where its entries live.
+ * Returns 0 on success, < 0 on error.
+ */
+static int sfs_opendir(const char *path, struct fuse_file_info *fi) {
+    log("opendir %s\n", path);
+
+    sfs2_blockidx_t dir;
+    int result = get_dir_info(path, &dir);
+    if (result != 0) return result;
+
+    struct sfs_dirhandle *handle = malloc(sizeof(struct sfs_dirhandle));
+    if (handle == NULL) return -ENOMEM;
+
+    handle->dir = dir;
+    fi->fh = (uintptr_t) handle;
+
+    return 0;
+}
+
+
+/*
+ * Close a directory opened by opendir.
+ */
+static int sfs_releasedir(const char *path, struct fuse_file_info *fi) {
+    log("releasedir %s\n", path);
+
+    free((struct sfs_dirhandle *) (uintptr_t) fi->fh);
+
+    return 0;
+}
+
+
+/*
+ * Return directory contents for `path`. This function should simply fill the
+ * filenames - any additional information (e.g., whether something is a file or
+ * directory) is later retrieved through getattr calls.
+ * Use the function `filler` to add an entry to the directory. Use it like:
+ *  filler(buf, <dirname>, NULL, 0);
+ * Return 0 on success, < 0 on error.
+ */
+
+static int sfs_readdir(const char *path,
+                       void *buf,
+                       fuse_fill_dir_t filler,
+                       off_t offset,
+                       struct fuse_file_info *fi) {
+    (void) offset;
+    log("readdir %s\n", path);
+
+    // opendir already located the directory
+    sfs2_blockidx_t dir;
+    if (fi != NULL && fi->fh != 0) {
+        dir = ((struct sfs_dirhandle *) (uintptr_t) fi->fh)->dir;
+    } else {
+        int result = get_dir_info(path, &dir);
+        if (result != 0) return result;
+    }
+
+    filler(buf, ".", NULL, 0);
+    filler(buf, "..", NULL, 0);
+
+    struct entry entries[SFS_ROOTDIR_NENTRIES];
+
+    // paths of the entries, for the lookup cache
+    size_t dir_len = strcmp(path, "/") == 0 ? 0 : strlen(path);
+    char *entry_path = malloc(dir_len + 1 + SFS_FILENAME_MAX);
+    if (entry_path != NULL) {
+        memcpy(entry_path, path, dir_len);
+        entry_path[dir_len] = '/';
+    }
+
+    // the attributes come with the listing, and the getattr calls that usually
+    // follow for every entry are answered from the lookup cache
+    off_t unit_off;
+    for (unsigned unit = 0; (unit_off = dir_unit_offset(dir, unit)) >= 0; unit++) {
+        unsigned int entries_num = dir_load(entries, dir_unit_size(dir), unit_off);
+
+        for (unsigned i = 0; i < entries_num; i++) {
+            if (entries[i].filename[0] == '\0' || is_inline_data(&entries[i])) continue;
+
+            off_t entry_off = unit_off + i * ENTRY_SIZE;
+            struct stat st;
+            fill_stat(&entries[i], &st);
+            st.st_ino = entry_ino(entry_off);
+            if (st.st_ino == 0) {
+                free(entry_path);
+                return -ENOMEM;
+            }
+            filler(buf, entries[i].filename, &st, 0);
+
+            if (entry_path != NULL) {
+                strncpy(entry_path + dir_len + 1, entries[i].filename, SFS_FILENAME_MAX);
+                entry_path[dir_len + SFS_FILENAME_MAX] = '\0';
+                dcache_insert(entry_path, &entries[i], entry_off);
+            }
+        }
+    }
+
+    free(entry_path);
+    return 0;
+}
+
+
+/*
+ * Open file `path`. The resolved entry is attached to the handle, see
+ * struct sfs_file.
+ * Returns 0 on success, < 0 on error.
+ */
+static int sfs_open(const char *path, struct fuse_file_info *fi) {
+    log("open %s\n", path);
+
+    if (is_ctl_path(path)) return ctl_open(fi);
+    if (is_stats_path(path)) return stats_open(fi);
+
+    struct entry entry;
+    off_t entry_off;
+    int result = get_entry(path, &entry, &entry_off);
+    if (result != 0) return result;
+    if (entry.size & SFS2_DIRECTORY) return -EISDIR;
+
+    return file_open(&entry, entry_off, fi);
+}
+
+
+/*
+ * Close a handle of `path`, called once per open/create.
+ */
+static int sfs_release(const char *path, struct fuse_file_info *fi) {
+    log("release %s\n", path);
+
+    if (is_ctl_path(path) || is_stats_path(path)) {
+        ctl_release(fi);
+        return 0;
+    }
+    file_release(file_get(fi));
+
+    return 0;
+}
+
+
+/*
+ * Read contents of `path` into `buf` for  up to `size` bytes.
+ * Note that `size` may be bigger than the file actually is.
+ * Reading should start at offset `offset`; the OS will generally read your file
+ * in chunks of 4K byte.
+ * Returns the number of bytes read (writting into `buf`), or < 0 on error.
+ */
+static int sfs_read(const char *path,
+                    char *buf,
+                    size_t size,
+                    off_t offset,
+                    struct fuse_file_info *fi) {
+    log("read %s size=%zu offset=%ld\n", path, size, offset);
+
+    if (is_ctl_path(path) || is_stats_path(path)) return ctl_read(fi, buf, size, offset);
+
+    // get file entry, from the handle when there is one
+    struct sfs_file *file = file_get(fi);
+    struct entry file_entry;
+    off_t entry_off;
+    if (file != NULL) {
+        file_entry = file->entry;
+        entry_off = file->entry_off;
+    } else {
+        int result = get_entry(path, &file_entry, &entry_off);
+        if (result != 0) return result;
+        if (file_entry.size & SFS2_DIRECTORY) return -EISDIR;
+    }
+
+    size_t file_size = file_entry.size & SFS2_SIZEMASK;
+    if ((size_t) offset >= file_size) return 0;
+    if (size > file_size - offset) size = file_size - offset;
+
+    return read_file(&file_entry, entry_off, buf, size, offset,
+                     file != NULL ? &file->chain : NULL);
+}
+
+
+/*
+ * Create directory at `path`.
+ * The `mode` argument describes the permissions, which you may ignore for this
+ * assignment.
+ * Returns 0 on success, < 0 on error.
+ */
+static int sfs_mkdir(const char *path,
+                     mode_t mode) {
+    log("mkdir %s mode=%o\n", path, mode);
+
+    sfs2_blockidx_t parent;
+    off_t entry_off;
+    int result = find_free_slot(path, &parent, &entry_off);
+    if (result != 0) return result;
+
+    struct entry new_entry;
+    return add_entry(path, parent, entry_off, get_path_name(path), true, &new_entry);
+}
+
+
+/*
+ * Remove directory at `path`.
+ * Directories may only be removed if they are empty, otherwise this function
+ * should return -ENOTEMPTY.
+ * Returns 0 on success, < 0 on error.
+ */
+static int sfs_rmdir(const char *path) {
+    log("rmdir %s\n", path);
+
+    struct entry target;
+    off_t target_off;
+    int result = get_entry(path, &target, &target_off);
+    if (result != 0) {
+        return result;
+    }
+    if (!(target.size & SFS2_DIRECTORY)) return -ENOTDIR;
+
+    sfs2_blockidx_t parent;
+    result = get_parent_info(path, &parent);
+    if (result == 0) result = remove_entry(parent, &target, target_off);
+    if (result != 0) return result;
+
+    dcache_invalidate(path);
+    dcache_insert(path, NULL, 0);
+
+    return 0;
+}
+
+
+/*
+ * Remove file at `path`.
+ * Can not be used to remove directories.
+ * Returns 0 on success, < 0 on error.
+ */
+static int sfs_unlink(const char *path) {
+    log("unlink %s\n", path);
+
+    // find if exists
+    struct entry target;
+    off_t target_off;
+    int result = get_entry(path, &target, &target_off);
+    if (result != 0) {
+        return result;
+    }
+    if (target.size & SFS2_DIRECTORY) return -EISDIR;
+
+    sfs2_blockidx_t parent;
+    result = get_parent_info(path, &parent);
+    if (result == 0) result = remove_entry(parent, &target, target_off);
+    if (result != 0) return result;
+
+    dcache_insert(path, NULL, 0);
+
+    return 0;
+}
+
+
+/*
+ * Create an empty file at `path`.
+ * The `mode` argument describes the permissions, which you may ignore for this
+ * assignment.
+ * Returns 0 on success, < 0 on error.
+ */
+static int sfs_create(const char *path,
+                      mode_t mode,
+                      struct fuse_file_info *fi) {
+    log("create %s mode=%o\n", path, mode);
+
+    sfs2_blockidx_t parent;
+    off_t entry_off;
+    int result = find_free_slot(path, &parent, &entry_off);
+    if (result != 0) return result;
+
+    struct entry new_entry;
+    result = add_entry(path, parent, entry_off, get_path_name(path), false, &new_entry);
+    if (result != 0) return result;
+
+    return fi != NULL ? file_open(&new_entry, entry_off, fi) : 0;
+}
+
+
+/*
+ * Shrink or grow the file at `path` to `size` bytes.
+ * Excess bytes are thrown away, whereas any bytes added in the process should
+ * be nil (\0).
+ * Returns 0 on success, < 0 on error.
+ */
+static int sfs_truncate(const char *path, off_t size) {
+    log("truncate %s size=%ld\n", path, size);
+
+    // `echo cmd > file` opens it with O_TRUNC, there is nothing to truncate
+    if (is_ctl_path(path)) return 0;
+    if (is_stats_path(path)) return -EACCES;
+
+    struct entry entry;
+    off_t entry_off;
+    int result = get_entry(path, &entry, &entry_off);
+    if (result != 0) return result;
+    if (entry.size & SFS2_DIRECTORY) return -EISDIR;
+
+    return truncate_file(path, &entry, entry_off, size);
+}
+
+
+// entry of the file written to through `path` or, when there is one, handle `fi`
+int get_write_target(const char *path, struct fuse_file_info *fi,
+                     struct entry *entry, off_t *entry_off) {
+    struct sfs_file *file = file_get(fi);
+
+    if (file != NULL) {
+        *entry = file->entry;
+        *entry_off = file->entry_off;
+        return 0;
+    }
+
+    int result = get_entry(path, entry, entry_off);
+    if (result != 0) return result;
+    if (entry->size & SFS2_DIRECTORY) return -EISDIR;
+
+    return 0;
+}
+
+
+/*
+ * Write contents of `buf` (of `size` bytes) to the file at `path`.
+ * The file is grown if nessecary, and any bytes already present are overwritten
+ * (whereas any other data is left intact). The `offset` argument specifies how
+ * many bytes should be skipped in the file, after which `size` bytes from
+ * buffer are written.
+ * This means that the new file size will be max(old_size, offset + size).
+ * Returns the number of bytes written, or < 0 on error.
+ */
+static int sfs_write(const char *path,
+                     const char *buf,
+                     size_t size,
+                     off_t offset,
+                     struct fuse_file_info *fi) {
+    log("write %s data='%.*s' size=%zu offset=%ld\n", path, (int) size, buf,
+        size, offset);
+
+    if (is_ctl_path(path)) return ctl_write(fi, buf, size);
+    if (is_stats_path(path)) return -EBADF;
+
+    struct entry entry;
+    off_t entry_off;
+    int result = get_write_target(path, fi, &entry, &entry_off);
+    if (result != 0) return result;
+
+    struct sfs_file *file = file_get(fi);
+    return write_file(path, &entry, entry_off, buf, size, offset,
+                      file != NULL ? &file->chain : NULL);
+}
+
+
+/*
+ * Like write, with the data in `buf`, which may refer to a pipe holding the
+ * request (splice), see write_file_buf().
+ * Returns the number of bytes written, or < 0 on error.
+ */
+static int sfs_write_buf(const char *path,
+                         struct fuse_bufvec *buf,
+                         off_t offset,
+                         struct fuse_file_info *fi) {
+    log("write_buf %s size=%zu offset=%ld\n", path, fuse_buf_size(buf), offset);
+
+    if (is_ctl_path(path)) return ctl_write_buf(fi, buf);
+    if (is_stats_path(path)) return -EBADF;
+
+    struct entry entry;
+    off_t entry_off;
+    int result = get_write_target(path, fi, &entry, &entry_off);
+    if (result != 0) return result;
+
+    struct sfs_file *file = file_get(fi);
+    return write_file_buf(path, &entry, entry_off, buf, offset,
+                          file != NULL ? &file->chain : NULL);
+}
+
+
+/*
+ * Reserve space for `length` bytes at `offset` of the file at `path` (open as
+ * `fi`, may be NULL), see fallocate_file(). Only FALLOC_FL_KEEP_SIZE is
+ * supported in `mode`, and only on version 2 images.
+ * Returns 0 on success, < 0 on error.
+ */
+static int sfs_fallocate(const char *path, int mode, off_t offset, off_t length,
+                         struct fuse_file_info *fi) {
+    log("fallocate %s mode=%#x offset=%ld length=%ld\n", path, mode, offset, length);
+
+    if (mode & ~FALLOC_FL_KEEP_SIZE) return -EOPNOTSUPP;
+    if (is_ctl_path(path) || is_stats_path(path)) return -EBADF;
+
+    struct entry entry;
+    off_t entry_off;
+    int result = get_write_target(path, fi, &entry, &entry_off);
+    if (result != 0) return result;
+
+    return fallocate_file(path, &entry, entry_off, offset, length, mode & FALLOC_FL_KEEP_SIZE);
+}
+
+
+/*
+ * Move/rename the file at `path` to `newpath`.
+ * Returns 0 on succes, < 0 on error.
+ */
+static int sfs_rename(const char *path,
+                      const char *newpath) {
+    log("rename %s %s\n", path, newpath);
+
+    if (is_ctl_path(path) || is_stats_path(path)) return -EBUSY;
+    if (is_ctl_path(newpath) || is_stats_path(newpath)) return -EBUSY;
+
+    struct entry entry;
+    off_t entry_off;
+    int result = get_entry(path, &entry, &entry_off);
+    if (result != 0) return result;
+
+    // a directory cannot move below itself
+    size_t len = strlen(path);
+    if (strncmp(newpath, path, len) == 0 && newpath[len] == '/') return -EINVAL;
+
+    sfs2_blockidx_t dir, newdir;
+    off_t new_off, target_off;
+    result = check_name(get_path_name(newpath));
+    if (result == 0) result = get_parent_info(path, &dir);
+    if (result == 0) result = get_parent_info(newpath, &newdir);
+    if (result == 0) result = rename_entry(dir, &entry, entry_off, newdir,
+                                           get_path_name(newpath), &new_off, &target_off);
+    if (result != 0) return result;
+
+    // everything below both paths has moved or is gone
+    dcache_invalidate(path);
+    dcache_invalidate(newpath);
+    dcache_insert(path, NULL, 0);
+    dcache_insert(newpath, &entry, new_off);
+
+    return 0;
+}
+
+
+// write back the cached data blocks of `path` (open as `fi`, may be NULL)
+int writeback_file(const char *path, struct fuse_file_info *fi) {
+    if (is_ctl_path(path) || is_stats_path(path)) return 0;
+
+    struct sfs_file *file = file_get(fi);
+    struct entry entry;
+
+    if (file != NULL) {
+        entry = file->entry;
+    } else {
+        int result = get_entry(path, &entry, NULL);
+        if (result != 0) return result;
+    }
+
+    wb_writeback_chain(entry.first_block);
+
+    return 0;
+}
+
+
+/*
+ * Called on every close() of an open file. Writes back the file's cached data
+ * and any cached metadata.
+ * Returns 0 on success, < 0 on error.
+ */
+static int sfs_flush(const char *path, struct fuse_file_info *fi) {
+    log("flush %s\n", path);
+
+    int result = writeback_file(path, fi);
+    if (result != 0) return result;
+
+    block_table_flush();
+    disk_flush();
+
+    return 0;
+}
+
+
+/*
+ * Synchronize file contents and metadata with the image.
+ * Returns 0 on success, < 0 on error.
+ */
+static int sfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    log("fsync %s datasync=%d\n", path, datasync);
+
+    int result = writeback_file(path, fi);
+    if (result != 0) return result;
+
+    block_table_flush();
+    disk_sync();
+
+    return 0;
+}
+
+
+/*
+ * Called once when the filesystem is mounted, after fuse_main() has gone to the
+ * background, so threads started here survive.
+ */
+static void *sfs_init(struct fuse_conn_info *conn) {
+    log("init\n");
+
+    // let the kernel splice the data of write requests and read replies, see
+    // write_file_buf() and chain_map()
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE);
+
+    wb_thread_start();
+
+    return NULL;
+}
+
+
+/*
+ * Called once when the filesystem is unmounted.
+ */
+static void sfs_destroy(void *private_data) {
+    (void) private_data;
+    log("destroy\n");
+
+    wb_thread_stop_join();
+
+    pthread_rwlock_wrlock(&fs_lock);
+    wb_writeback_all();
+    block_table_flush();
+    disk_sync();
+    pthread_rwlock_unlock(&fs_lock);
+}
+
+
+/*
+ * Wrappers that run an operation under fs_lock, shared (rdlock) or exclusive
+ * (wrlock). See the description of fs_lock above. releasedir only frees its
+ * own handle and needs no lock; destroy takes the lock itself.
+ */
+#define LOCKED_OP(lock, op, params, args)       \
+    static int locked_##op params {             \
+        uint64_t start = stats_now();           \
+        pthread_rwlock_##lock(&fs_lock);        \
+        int ret = sfs_##op args;                \
+        pthread_rwlock_unlock(&fs_lock);        \
+        stats_op_done(STATS_OP_##op, start);    \
+        return ret;                             \
+    }
+
+LOCKED_OP(rdlock, getattr, (const char *path, struct stat *st), (path, st))
+LOCKED_OP(rdlock, opendir, (const char *path, struct fuse_file_info *fi), (path, fi))
+LOCKED_OP(rdlock, readdir, (const char *path, void *buf, fuse_fill_dir_t filler,
+                            off_t offset, struct fuse_file_info *fi),
+          (path, buf, filler, offset, fi))
+LOCKED_OP(rdlock, open, (const char *path, struct fuse_file_info *fi), (path, fi))
+LOCKED_OP(rdlock, read, (const char *path, char *buf, size_t size, off_t offset,
+                         struct fuse_file_info *fi),
+          (path, buf, size, offset, fi))
+// closing the last handle of an orphan frees it, see orphans_free()
+static int locked_release(const char *path, struct fuse_file_info *fi) {
+    uint64_t start = stats_now();
+    pthread_rwlock_rdlock(&fs_lock);
+    int ret = sfs_release(path, fi);
+    pthread_rwlock_unlock(&fs_lock);
+    orphans_free();
+    stats_op_done(STATS_OP_release, start);
+    return ret;
+}
+LOCKED_OP(wrlock, mkdir, (const char *path, mode_t mode), (path, mode))
+LOCKED_OP(wrlock, rmdir, (const char *path), (path))
+LOCKED_OP(wrlock, unlink, (const char *path), (path))
+LOCKED_OP(wrlock, create, (const char *path, mode_t mode, struct fuse_file_info *fi),
+          (path, mode, fi))
+LOCKED_OP(wrlock, truncate, (const char *path, off_t size), (path, size))
+LOCKED_OP(wrlock, write, (const char *path, const char *buf, size_t size, off_t offset,
+                          struct fuse_file_info *fi),
+          (path, buf, size, offset, fi))
+LOCKED_OP(wrlock, write_buf, (const char *path, struct fuse_bufvec *buf, off_t offset,
+                              struct fuse_file_info *fi),
+          (path, buf, offset, fi))
+LOCKED_OP(wrlock, rename, (const char *path, const char *newpath), (path, newpath))
+// most close() calls have nothing to write back, see wb_pending()
+static int locked_flush(const char *path, struct fuse_file_info *fi) {
+    uint64_t start = stats_now();
+    int ret = 0;
+    if (wb_pending(false)) {
+        pthread_rwlock_wrlock(&fs_lock);
+        ret = sfs_flush(path, fi);
+        pthread_rwlock_unlock(&fs_lock);
+    }
+    stats_op_done(STATS_OP_flush, start);
+    return ret;
+}
+LOCKED_OP(wrlock, fsync, (const char *path, int datasync, struct fuse_file_info *fi),
+          (path, datasync, fi))
+LOCKED_OP(wrlock, fallocate, (const char *path, int mode, off_t offset, off_t length,
+                              struct fuse_file_info *fi),
+          (path, mode, offset, length, fi))
+
+
+static const struct fuse_operations sfs_oper = {
+        .getattr    = locked_getattr,
+        .opendir    = locked_opendir,
+        .readdir    = locked_readdir,
+        .releasedir = sfs_releasedir,
+        .open       = locked_open,
+        .read       = locked_read,
+        .release    = locked_release,
+        .mkdir      = locked_mkdir,
+        .rmdir      = locked_rmdir,
+        .unlink     = locked_unlink,
+        .create     = locked_create,
+        .truncate   = locked_truncate,
+        .write      = locked_write,
+        .write_buf  = locked_write_buf,
+        .rename     = locked_rename,
+        .flush      = locked_flush,
+        .fsync      = locked_fsync,
+        .fallocate  = locked_fallocate,
+        .init       = sfs_init,
+        .destroy    = sfs_destroy,
+};
+
+
+/*
+ * Low-level frontend (-l): files are identified by inode number (see
+ * entry_ino()). Lookups are cached keyed "<parent ino>/<name>"; cached slots
+ * are checked before use, so only negative entries need invalidating.
+ */
+
+/*
+ * Entry of inode `ino`, which is not the root directory, and its offset on
+ * disk in `entry_off` (may be NULL), or that of the open file for an orphan.
+ * Returns -ENOENT if the slot is free, or the entry in it is not the one the
+ * inode was handed out for.
+ */
+int ll_get_entry(fuse_ino_t ino, struct entry *entry, off_t *entry_off) {
+    if (ino < INO_FIRST || ino >= INO_STATS) return -ENOENT;
+
+    off_t off = ino_entry_off(ino);
+    if (off < -1) {
+        // an orphan, still open
+        pthread_mutex_lock(&cache_lock);
+        struct sfs_file *file = file_find(off);
+        if (file != NULL) *entry = file->entry;
+        pthread_mutex_unlock(&cache_lock);
+
+        if (file == NULL) return -ENOENT;
+        if (entry_off != NULL) *entry_off = off;
+        return 0;
+    }
+    if (off < 0) return -ENOENT;
+    bool in_rootdir = off < (off_t) (geo.rootdir_off + SFS_ROOTDIR_SIZE);
+    bool in_data = off >= geo.data_off &&
+                   off < geo.data_off + (off_t) geo.nblocks * geo.block_size;
+    if (!in_rootdir && !in_data) return -ENOENT;
+
+    entry_load(entry, off);
+    if (entry->filename[0] == '\0' || is_inline_data(entry)) return -ENOENT;
+
+    if (entry_off != NULL) *entry_off = off;
+    return 0;
+}
+
+// like get_dir_info(), for directory inode `ino`
+int ll_get_dir_info(fuse_ino_t ino, sfs2_blockidx_t *dir) {
+    if (ino == FUSE_ROOT_ID) {
+        *dir = DIR_ROOT;
+        return 0;
+    }
+
+    struct entry dir_entry;
+    int result = ll_get_entry(ino, &dir_entry, NULL);
+    if (result != 0) return result;
+    if (!(dir_entry.size & SFS2_DIRECTORY)) return -ENOTDIR;
+
+    *dir = dir_entry.first_block;
+
+    return 0;
+}
+
+#define LL_KEY_MAX   (24 + SFS_FILENAME_MAX)
+
+void ll_key(char *key, fuse_ino_t parent, const char *name) {
+    snprintf(key, LL_KEY_MAX, "%lu/%s", (unsigned long) parent, name);
+}
+
+// dir_lookup() of `name` in directory inode `parent`, through the lookup cache
+int ll_lookup(fuse_ino_t parent, const char *name, struct entry *entry, off_t *entry_off) {
+    char key[LL_KEY_MAX];
+    ll_key(key, parent, name);
+
+    pthread_mutex_lock(&cache_lock);
+    struct dcache_entry *cached = dcache_find(key);
+    bool negative = cached != NULL && cached->negative;
+    off_t cached_off = cached != NULL ? cached->entry_off : -1;
+    pthread_mutex_unlock(&cache_lock);
+
+    if (negative) {
+        STATS_ADD(stats_get()->dcache_hits, 1);
+        return -ENOENT;
+    }
+    if (cached_off >= 0) {
+        entry_load(entry, cached_off);
+        if (strcmp(entry->filename, name) == 0) {
+            STATS_ADD(stats_get()->dcache_hits, 1);
+            *entry_off = cached_off;
+            return 0;
+        }
+    }
+    STATS_ADD(stats_get()->dcache_misses, 1);
+
+    sfs2_blockidx_t dir;
+    int result = ll_get_dir_info(parent, &dir);
+    if (result != 0) return result;
+
+    result = dir_lookup(dir, name, entry, entry_off);
+    dcache_insert(key, result == 0 ? entry : NULL, result == 0 ? *entry_off : 0);
+
+    return result;
+}
+
+// answer a lookup (or create, when `fi` is given) with `entry` of inode `ino`
+void ll_reply_entry(fuse_req_t req, const struct entry *entry, fuse_ino_t ino,
+                    struct fuse_file_info *fi) {
+    struct fuse_entry_param e;
+
+    memset(&e, 0, sizeof(e));
+    e.ino = ino;
+    e.attr_timeout = options.timeout;
+    e.entry_timeout = options.timeout;
+    fill_stat(entry, &e.attr);
+    e.attr.st_ino = e.ino;
+
+    if (fi != NULL) {
+        fuse_reply_create(req, &e, fi);
+    } else {
+        fuse_reply_entry(req, &e);
+    }
+}
+
+static void sfs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+    (void) userdata;
+    sfs_init(conn);
+}
+
+static void sfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    log("lookup %lu %s\n", parent, name);
+
+    struct entry entry;
+    off_t entry_off;
+
+    bool is_ctl = strcmp(name, CTL_NAME) == 0;
+    if (parent == FUSE_ROOT_ID && (is_ctl || strcmp(name, STATS_NAME) == 0)) {
+        struct fuse_entry_param e;
+        memset(&e, 0, sizeof(e));
+        if (is_ctl) ctl_stat(&e.attr);
+        else stats_stat(&e.attr);
+        e.ino = e.attr.st_ino;
+        e.attr_timeout = options.timeout;
+        e.entry_timeout = options.timeout;
+        fuse_reply_entry(req, &e);
+        return;
+    }
+
+    fuse_ino_t ino = 0;
+    pthread_rwlock_rdlock(&fs_lock);
+    int result = check_name(name);
+    if (result == 0) result = ll_lookup(parent, name, &entry, &entry_off);
+    if (result == 0 && (ino = ino_hold(entry_off)) == 0) result = -ENOMEM;
+    pthread_rwlock_unlock(&fs_lock);
+
+    if (result != 0) {
+        fuse_reply_err(req, -result);
+    } else {
+        ll_reply_entry(req, &entry, ino, NULL);
+    }
+}
+
+static void sfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+    log("forget %lu %lu\n", ino, nlookup);
+
+    ino_forget(ino, nlookup);
+    fuse_reply_none(req);
+}
+
+static void sfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    (void) fi;
+    log("getattr %lu\n", ino);
+
+    struct stat st;
+    struct entry entry;
+    int result = 0;
+
+    if (ino == FUSE_ROOT_ID) {
+        fill_stat(NULL, &st);
+    } else if (ino == INO_CTL) {
+        ctl_stat(&st);
+    } else if (ino == INO_STATS) {
+        stats_stat(&st);
+    } else {
+        pthread_rwlock_rdlock(&fs_lock);
+        result = ll_get_entry(ino, &entry, NULL);
+        pthread_rwlock_unlock(&fs_lock);
+
+        if (result == 0) fill_stat(&entry, &st);
+    }
+
+    if (result != 0) {
+        fuse_reply_err(req, -result);
+    } else {
+        st.st_ino = ino;
+        fuse_reply_attr(req, &st, options.timeout);
+    }
 }
 
-char *get_path_name(const char *path) {
-    char *result = NULL;
-    char *buffer = strdup(path);
+/*
+ * Only the size can be changed (truncate). Timestamps are not stored, changes
+ * to them are accepted and ignored as they come along with truncation.
+ */
+static void sfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                           int to_set, struct fuse_file_info *fi) {
+    log("setattr %lu to_set=%#x\n", ino, to_set);
 
-    char *token = strtok(buffer, "/");
-    while (token != NULL) {
-        result = token;
-        token = strtok(NULL, "/");
+    if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+        fuse_reply_err(req, ENOSYS);
+        return;
+    }
+    if (ino == INO_CTL) {       // truncation along with a command, see sfs_truncate()
+        struct stat st;
+        ctl_stat(&st);
+        fuse_reply_attr(req, &st, options.timeout);
+        return;
+    }
+    if (ino == INO_STATS) {
+        struct stat st;
+        stats_stat(&st);
+        if (to_set & FUSE_SET_ATTR_SIZE) fuse_reply_err(req, EACCES);
+        else fuse_reply_attr(req, &st, options.timeout);
+        return;
     }
 
-    return result;
-}
-
-int get_parent_info(const char *path, size_t *parent_size, off_t *parent_offset) {
-    char path_copy[256];
-    strcpy(path_copy, path);
-    char *this_token = strtok(path_copy, "/");
-    char *next_token = strtok(NULL, "/");
+    struct sfs_file *file = file_get(fi);
+    struct entry entry;
+    off_t entry_off;
+    int result = 0;
 
-    // parent is root
-    if (next_token == NULL) {
-        *parent_size = SFS_ROOTDIR_SIZE;
-        *parent_offset = SFS_ROOTDIR_OFF;
-        return 0;
+    pthread_rwlock_wrlock(&fs_lock);
+    if (file != NULL) {
+        entry = file->entry;
+        entry_off = file->entry_off;
+    } else if (ino == FUSE_ROOT_ID) {
+        if (to_set & FUSE_SET_ATTR_SIZE) result = -EISDIR;
+    } else {
+        result = ll_get_entry(ino, &entry, &entry_off);
     }
 
-    // parent is a subdir
-    char parent_path[256] = "";
-    while (next_token != NULL) {
-        strcat(parent_path, "/");
-        strcat(parent_path, this_token);
-        this_token = next_token;
-        next_token = strtok(NULL, "/");
+    if (result == 0 && ino != FUSE_ROOT_ID && (to_set & FUSE_SET_ATTR_SIZE)) {
+        if (entry.size & SFS2_DIRECTORY) {
+            result = -EISDIR;
+        } else {
+            result = truncate_file(NULL, &entry, entry_off, attr->st_size);
+        }
     }
+    pthread_rwlock_unlock(&fs_lock);
 
-    struct sfs_entry parent_entry;
-    unsigned int result = get_entry(parent_path, &parent_entry);
     if (result != 0) {
-        return result;
+        fuse_reply_err(req, -result);
     } else {
-        *parent_size = SFS_DIR_SIZE;
-        *parent_offset = SFS_DATA_OFF + SFS_BLOCK_SIZE * (parent_entry.first_block - 1);
+        struct stat st;
+        fill_stat(ino == FUSE_ROOT_ID ? NULL : &entry, &st);
+        st.st_ino = ino;
+        fuse_reply_attr(req, &st, options.timeout);
     }
-
-    return 0;
 }
 
-blockidx_t alloc_dir_blocks() {
-    blockidx_t block_table[SFS_BLOCKTBL_NENTRIES];
-    disk_read(block_table, SFS_BLOCKTBL_SIZE, SFS_BLOCKTBL_OFF);
+static void sfs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    log("opendir %lu\n", ino);
 
-    blockidx_t index = 0;
-    bool hit = false;
+    sfs2_blockidx_t dir;
 
-    while (index < SFS_BLOCKTBL_NENTRIES - 1) {
-        if (block_table[index] != SFS_BLOCKIDX_EMPTY || block_table[index + 1] != SFS_BLOCKIDX_EMPTY) {
-            index++;
-            continue;
-        } else {
-            hit = true;
-            break;
-        }
+    pthread_rwlock_rdlock(&fs_lock);
+    int result = ll_get_dir_info(ino, &dir);
+    pthread_rwlock_unlock(&fs_lock);
+
+    struct sfs_dirhandle *handle = NULL;
+    if (result == 0) {
+        handle = malloc(sizeof(struct sfs_dirhandle));
+        if (handle == NULL) result = -ENOMEM;
     }
 
-    if (hit) {
-        blockidx_t value_1 = index + 2;
-        blockidx_t value_2 = SFS_BLOCKIDX_END;
+    if (result != 0) {
+        fuse_reply_err(req, -result);
+        return;
+    }
 
-        // write block_table
-        disk_write(&value_1, sizeof(blockidx_t), SFS_BLOCKTBL_OFF + sizeof(blockidx_t) * index);
-        disk_write(&value_2, sizeof(blockidx_t), SFS_BLOCKTBL_OFF + sizeof(blockidx_t) * (index + 1));
+    handle->dir = dir;
+    fi->fh = (uintptr_t) handle;
+    fuse_reply_open(req, fi);
+}
 
-        // write empty entry in data
-        struct sfs_entry empty_entries[SFS_DIR_NENTRIES];
-        memset(empty_entries, 0, SFS_DIR_SIZE);
-        disk_write(empty_entries, SFS_DIR_SIZE, SFS_DATA_OFF + SFS_BLOCK_SIZE * index);
+static void sfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    log("releasedir %lu\n", ino);
 
-        return index + 1;
-    } else {
-        return -1;
-    }
+    free((struct sfs_dirhandle *) (uintptr_t) fi->fh);
+    fuse_reply_err(req, 0);
 }
 
-// trash
-//char *get_parent_path(char *path) {
-//    char *result;
-//
-//    char temp[256];
-//    strcpy(temp, path);
-//
-//    char *this_token = strtok(temp, "/");
-//    char *next_token = strtok(NULL, "/");
-//
-//    while (next_token != NULL) {
-//        strcat(result, "/");
-//        strcat(result, this_token);
-//        this_token = next_token;
-//        next_token = strtok(NULL, "/");
-//    }
-//
-//    return result;
-//}
-
 /*
- * Retrieve information about a file or directory.
- * You should populate fields of `stbuf` with appropriate information if the
- * file exists and is accessible, or return an error otherwise.
- *
- * For directories, you should at least set st_mode (with S_IFDIR) and st_nlink.
- * For files, you should at least set st_mode (with S_IFREG), st_nlink and
- * st_size.
- *
- * Return 0 on success, < 0 on error.
+ * Directory offsets are 0 and 1 for "." and "..", then slot index + 2, counting
+ * the slots of all units. The parent of a directory is not known here, ".."
+ * gets the root's inode number, which readers of d_ino do not rely on.
  */
-static int sfs_getattr(const char *path,
-                       struct stat *st) {
-    int res = 0;
+static void sfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                           struct fuse_file_info *fi) {
+    log("readdir %lu size=%zu off=%ld\n", ino, size, off);
 
-    log("getattr %s\n", path);
+    sfs2_blockidx_t dir = ((struct sfs_dirhandle *) (uintptr_t) fi->fh)->dir;
+    unsigned unit_nentries = dir_unit_size(dir) / ENTRY_SIZE;
+    struct entry entries[SFS_ROOTDIR_NENTRIES];
+    off_t unit_off = -1;
 
-    memset(st, 0, sizeof(struct stat));
-    /* Set owner to user/group who mounted the image */
-    st->st_uid = getuid();
-    st->st_gid = getgid();
-    /* Last accessed/modified just now */
-    st->st_atime = time(NULL);
-    st->st_mtime = time(NULL);
+    char *buf = malloc(size);
+    if (buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
 
-    if (strcmp(path, "/") == 0) {
-        st->st_mode = S_IFDIR | 0755;
-        st->st_nlink = 2;
-    } else {
-        struct sfs_entry entry;
-        int result = get_entry(path, &entry);
-
-        if (result == -ENAMETOOLONG) {
-            log("Error: name too long");
-            return -ENAMETOOLONG;
-        };
-        if (result == -ENOENT) {
-            log("Error: file or directory not found\n");
-            return -ENOENT;
-        };
-
-        // read target entry
-        if (entry.size & SFS_DIRECTORY) {
-            st->st_mode = S_IFDIR | 0755;
-            st->st_nlink = 2;
-            res = 0;
+    pthread_rwlock_rdlock(&fs_lock);
+    size_t pos = 0;
+    int result = 0;
+    for (off_t i = off; ; i++) {
+        struct stat st;
+        const char *name;
+
+        memset(&st, 0, sizeof(st));
+        if (i < 2) {
+            name = i == 0 ? "." : "..";
+            st.st_ino = i == 0 ? ino : FUSE_ROOT_ID;
+            st.st_mode = S_IFDIR;
         } else {
-            st->st_mode = S_IFREG | 0755;
-            st->st_nlink = 1;
-            st->st_size = entry.size & SFS_SIZEMASK;
-            res = 0;
+            unsigned slot = i - 2;
+            if (unit_off < 0 || slot % unit_nentries == 0) {
+                unit_off = dir_unit_offset(dir, slot / unit_nentries);
+                if (unit_off < 0) break;
+                dir_load(entries, dir_unit_size(dir), unit_off);
+            }
+
+            const struct entry *entry = &entries[slot % unit_nentries];
+            if (entry->filename[0] == '\0' || is_inline_data(entry)) continue;
+
+            name = entry->filename;
+            st.st_ino = entry_ino(unit_off + (slot % unit_nentries) * ENTRY_SIZE);
+            if (st.st_ino == 0) {
+                result = -ENOMEM;
+                break;
+            }
+            st.st_mode = entry->size & SFS2_DIRECTORY ? S_IFDIR : S_IFREG;
         }
+
+        size_t len = fuse_add_direntry(req, buf + pos, size - pos, name, &st, i + 1);
+        if (len > size - pos) break;
+        pos += len;
     }
+    pthread_rwlock_unlock(&fs_lock);
 
-    return res;
+    if (pos == 0 && result != 0) {
+        fuse_reply_err(req, -result);
+    } else {
+        fuse_reply_buf(req, buf, pos);
+    }
+    free(buf);
 }
 
+static void sfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    log("open %lu\n", ino);
 
-/*
- * Return directory contents for `path`. This function should simply fill the
- * filenames - any additional information (e.g., whether something is a file or
- * directory) is later retrieved through getattr calls.
- * Use the function `filler` to add an entry to the directory. Use it like:
- *  filler(buf, <dirname>, NULL, 0);
- * Return 0 on success, < 0 on error.
- */
+    struct entry entry;
+    off_t entry_off;
+    int result;
 
-static int sfs_readdir(const char *path,
-                       void *buf,
-                       fuse_fill_dir_t filler,
-                       off_t offset,
-                       struct fuse_file_info *fi) {
-    (void) offset, (void) fi;
-    log("readdir %s\n", path);
+    pthread_rwlock_rdlock(&fs_lock);
+    if (ino == INO_CTL) {
+        result = ctl_open(fi);
+    } else if (ino == INO_STATS) {
+        result = stats_open(fi);
+    } else {
+        result = ll_get_entry(ino, &entry, &entry_off);
+        if (result == 0 && (entry.size & SFS2_DIRECTORY)) result = -EISDIR;
+        if (result == 0) result = file_open(&entry, entry_off, fi);
+    }
+    pthread_rwlock_unlock(&fs_lock);
 
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
+    if (result != 0) {
+        fuse_reply_err(req, -result);
+    } else {
+        fuse_reply_open(req, fi);
+    }
+}
 
-    if (strcmp(path, "/") == 0) {
-        struct sfs_entry entries[SFS_ROOTDIR_NENTRIES];
-        disk_read(entries, SFS_ROOTDIR_SIZE, SFS_ROOTDIR_OFF);
+static void sfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    log("release %lu\n", ino);
 
-        for (unsigned i = 0; i < SFS_ROOTDIR_NENTRIES; i++) {
-            if (strlen(entries[i].filename) > 0) {
-                filler(buf, entries[i].filename, NULL, 0);
-            }
-        }
+    pthread_rwlock_rdlock(&fs_lock);
+    if (ino == INO_CTL || ino == INO_STATS) {
+        ctl_release(fi);
     } else {
-        struct sfs_entry entry;
-        int result = get_entry(path, &entry);
-
-        if (result != 0) return result;
+        file_release(file_get(fi));
+    }
+    pthread_rwlock_unlock(&fs_lock);
+    orphans_free();
 
-        struct sfs_entry entries[SFS_DIR_NENTRIES];
-        disk_read(entries, SFS_DIR_SIZE, SFS_DATA_OFF + SFS_BLOCK_SIZE * (entry.first_block - 1));
+    fuse_reply_err(req, 0);
+}
 
-        for (unsigned i = 0; i < SFS_DIR_NENTRIES; i++) {
-            if (strlen(entries[i].filename) > 0) {
-                filler(buf, entries[i].filename, NULL, 0);
-            }
-        }
+// read of the control file's output
+void ll_ctl_read(fuse_req_t req, size_t size, off_t off, struct fuse_file_info *fi) {
+    char *buf = malloc(size);
+    if (buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
     }
 
-    return 0;
-}
+    pthread_rwlock_rdlock(&fs_lock);
+    int done = ctl_read(fi, buf, size, off);
+    pthread_rwlock_unlock(&fs_lock);
 
+    fuse_reply_buf(req, buf, done);
+    free(buf);
+}
 
 /*
- * Read contents of `path` into `buf` for  up to `size` bytes.
- * Note that `size` may be bigger than the file actually is.
- * Reading should start at offset `offset`; the OS will generally read your file
- * in chunks of 4K byte.
- * Returns the number of bytes read (writting into `buf`), or < 0 on error.
+ * Where chain_map() allows, the reply refers to the image file, still under
+ * fs_lock so the blocks cannot change hands meanwhile.
  */
-static int sfs_read(const char *path,
-                    char *buf,
-                    size_t size,
-                    off_t offset,
-                    struct fuse_file_info *fi) {
-    (void) fi;
-    log("read %s size=%zu offset=%ld\n", path, size, offset);
-
-    // get file entry
-    struct sfs_entry file_entry;
-    int result = get_entry(path, &file_entry);
-    if (result != 0) return result;
-    if (file_entry.size & SFS_DIRECTORY) return -EISDIR;
-
-    // get block table
-    blockidx_t block_table[SFS_BLOCKTBL_NENTRIES];
-    disk_read(block_table, SFS_BLOCKTBL_SIZE, SFS_BLOCKTBL_OFF);
+static void sfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                        struct fuse_file_info *fi) {
+    log("read %lu size=%zu offset=%ld\n", ino, size, off);
 
-    // initial
-    blockidx_t this_block = file_entry.first_block - 1;
+    if (ino == INO_CTL || ino == INO_STATS) {
+        ll_ctl_read(req, size, off, fi);
+        return;
+    }
 
-    size_t position = 0;
-    off_t remain_offset = offset;
+    struct sfs_file *file = file_get(fi);
+    struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec) +
+                                      CHAIN_MAP_MAX_RUNS * sizeof(struct fuse_buf));
+    if (bufv == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
 
-    // ignore blocks
-    unsigned int ignore_blocks_num = remain_offset / SFS_BLOCK_SIZE;
-    for (; ignore_blocks_num > 0; ignore_blocks_num--) {
-        this_block = block_table[this_block] - 1;
-        if (this_block == 0xfffd) this_block++;
+    pthread_rwlock_rdlock(&fs_lock);
+    size_t file_size = file->entry.size & SFS2_SIZEMASK;
+    if ((size_t) off >= file_size) size = 0;
+    else if (size > file_size - off) size = file_size - off;
 
-        remain_offset -= SFS_BLOCK_SIZE;
+    *bufv = FUSE_BUFVEC_INIT(size);
+    // the hole of a sparse file is not in the image
+    unsigned count = 0;
+    if (size > 0 && off + size <= file_data_size(&file->entry, &file->chain)) {
+        count = chain_map(file->entry.first_block, size, off, false, &file->chain,
+                          bufv->buf, CHAIN_MAP_MAX_RUNS);
     }
-    // ignore left overs
-    if (remain_offset > 0) {
-        disk_read(buf + position,
-                  SFS_BLOCK_SIZE - remain_offset,
-                  SFS_DATA_OFF + this_block * SFS_BLOCK_SIZE + remain_offset);
 
-        position = SFS_BLOCK_SIZE - remain_offset;
-        remain_offset = 0;
+    if (count > 0) {
+        bufv->count = count;
+        fuse_reply_data(req, bufv, 0);
+        pthread_rwlock_unlock(&fs_lock);
+    } else {
+        char *buf = malloc(size);
+        size_t done = 0;
+        if (buf != NULL) {
+            done = read_file(&file->entry, file->entry_off, buf, size, off, &file->chain);
+        }
+        pthread_rwlock_unlock(&fs_lock);
 
-        this_block = block_table[this_block] - 1;
-        if (this_block == 0xfffd) this_block++;
+        if (buf == NULL && size > 0) {
+            fuse_reply_err(req, ENOMEM);
+        } else {
+            fuse_reply_buf(req, buf, done);
+        }
+        free(buf);
     }
 
-    while (this_block != SFS_BLOCKIDX_END) {
-        disk_read(buf + position,
-                  SFS_BLOCK_SIZE,
-                  SFS_DATA_OFF + this_block * SFS_BLOCK_SIZE);
+    free(bufv);
+}
+
+static void sfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+                         off_t off, struct fuse_file_info *fi) {
+    log("write %lu size=%zu offset=%ld\n", ino, size, off);
 
-        position += SFS_BLOCK_SIZE;
+    struct sfs_file *file = file_get(fi);
+    int result;
 
-        this_block = block_table[this_block] - 1;
-        if (this_block == 0xfffd) this_block++;
+    pthread_rwlock_wrlock(&fs_lock);
+    if (ino == INO_CTL) {
+        result = ctl_write(fi, buf, size);
+    } else if (ino == INO_STATS) {
+        result = -EBADF;
+    } else {
+        struct entry entry = file->entry;
+        result = write_file(NULL, &entry, file->entry_off, buf, size, off, &file->chain);
     }
+    pthread_rwlock_unlock(&fs_lock);
 
-    return size;
+    if (result < 0) {
+        fuse_reply_err(req, -result);
+    } else {
+        fuse_reply_write(req, result);
+    }
 }
 
+static void sfs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+                             off_t off, struct fuse_file_info *fi) {
+    log("write_buf %lu size=%zu offset=%ld\n", ino, fuse_buf_size(bufv), off);
 
-/*
- * Create directory at `path`.
- * The `mode` argument describes the permissions, which you may ignore for this
- * assignment.
- * Returns 0 on success, < 0 on error.
- */
-static int sfs_mkdir(const char *path,
-                     mode_t mode) {
-    log("mkdir %s mode=%o\n", path, mode);
+    struct sfs_file *file = file_get(fi);
+    int result;
 
-    struct sfs_entry target;
-    int result = get_entry(path, &target);
+    pthread_rwlock_wrlock(&fs_lock);
+    if (ino == INO_CTL) {
+        result = ctl_write_buf(fi, bufv);
+    } else if (ino == INO_STATS) {
+        result = -EBADF;
+    } else {
+        struct entry entry = file->entry;
+        result = write_file_buf(NULL, &entry, file->entry_off, bufv, off, &file->chain);
+    }
+    pthread_rwlock_unlock(&fs_lock);
 
-    // check existence
-    if (result == 0) return -EEXIST;
-    if (result == -ENAMETOOLONG) return -ENAMETOOLONG;
+    if (result < 0) {
+        fuse_reply_err(req, -result);
+    } else {
+        fuse_reply_write(req, result);
+    }
+}
 
-    // alloc 2 data block
-    blockidx_t first_block = alloc_dir_blocks();
+// mkdir and create
+void ll_add_entry(fuse_req_t req, fuse_ino_t parent, const char *name, bool is_dir,
+                  struct fuse_file_info *fi) {
+    sfs2_blockidx_t dir;
+    struct entry entry;
+    off_t entry_off;
+    char key[LL_KEY_MAX];
+    fuse_ino_t ino = 0;
 
+    ll_key(key, parent, name);
 
-    // get parent and find free entry slot
-    size_t parent_size;
-    off_t parent_offset;
-    get_parent_info(path, &parent_size, &parent_offset);
-    struct sfs_entry parent_entries[SFS_ROOTDIR_NENTRIES];
-    disk_read(parent_entries, SFS_ROOTDIR_SIZE, parent_offset);
+    pthread_rwlock_wrlock(&fs_lock);
+    int result = check_name(name);
+    if (result == 0) result = ll_get_dir_info(parent, &dir);
+    if (result == 0) result = dir_find_slot(dir, name, &entry_off);
+    if (result == 0) result = add_entry(key, dir, entry_off, name, is_dir, &entry);
+    if (result == 0 && (ino = ino_hold(entry_off)) == 0) result = -ENOMEM;
+    if (result == 0 && fi != NULL) {
+        result = file_open(&entry, entry_off, fi);
+        if (result != 0) ino_forget(ino, 1);
+    }
+    pthread_rwlock_unlock(&fs_lock);
 
-    unsigned int entries_num = 0;
-    if (parent_size == SFS_ROOTDIR_SIZE) {
-        entries_num = SFS_ROOTDIR_NENTRIES;
+    if (result != 0) {
+        fuse_reply_err(req, -result);
     } else {
-        entries_num = SFS_DIR_NENTRIES;
-    }
-    unsigned int index = NULL;
-    for (unsigned i = 0; i < entries_num; i++) {
-        if (parent_entries[i] == SFS_BLOCKIDX_EMPTY) {
-            index = i;
-            break;
-        }
+        ll_reply_entry(req, &entry, ino, fi);
     }
-    if(index == NULL) return -1;    // all full
+}
 
-    return 0;
+static void sfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    log("mkdir %lu %s mode=%o\n", parent, name, mode);
+
+    ll_add_entry(req, parent, name, true, NULL);
 }
 
+static void sfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+                          struct fuse_file_info *fi) {
+    log("create %lu %s mode=%o\n", parent, name, mode);
 
-/*
- * Remove directory at `path`.
- * Directories may only be removed if they are empty, otherwise this function
- * should return -ENOTEMPTY.
- * Returns 0 on success, < 0 on error.
- */
-static int sfs_rmdir(const char *path) {
-    log("rmdir %s\n", path);
+    ll_add_entry(req, parent, name, false, fi);
+}
 
-    struct sfs_entry target;
-    int result = get_entry(path, &target);
-    if (result != 0) {
-        return result;
-    }
+// unlink and rmdir
+void ll_remove_entry(fuse_req_t req, fuse_ino_t parent, const char *name, bool is_dir) {
+    sfs2_blockidx_t dir;
+    struct entry target;
+    off_t target_off;
+    char key[LL_KEY_MAX];
+    fuse_ino_t target_ino = 0;
 
-    struct sfs_entry target_entries[SFS_DIR_NENTRIES];
-    disk_read(target_entries, SFS_DIR_SIZE, SFS_DATA_OFF + SFS_BLOCK_SIZE * (target.first_block - 1));
-    for (unsigned i = 0; i < SFS_DIR_NENTRIES; ++i) {
-        if (target_entries[i].first_block != SFS_BLOCKIDX_EMPTY) {
-            return -ENOTEMPTY;
+    pthread_rwlock_wrlock(&fs_lock);
+    int result = check_name(name);
+    if (result == 0) result = ll_lookup(parent, name, &target, &target_off);
+    if (result == 0 && is_dir && !(target.size & SFS2_DIRECTORY)) result = -ENOTDIR;
+    if (result == 0 && !is_dir && (target.size & SFS2_DIRECTORY)) result = -EISDIR;
+    if (result == 0) result = ll_get_dir_info(parent, &dir);
+    if (result == 0 && (target_ino = entry_ino(target_off)) == 0) result = -ENOMEM;
+    if (result == 0) result = remove_entry(dir, &target, target_off);
+    if (result == 0) {
+        if (is_dir) {
+            snprintf(key, sizeof(key), "%lu", (unsigned long) target_ino);
+            dcache_invalidate(key);
         }
+        ll_key(key, parent, name);
+        dcache_insert(key, NULL, 0);
     }
+    pthread_rwlock_unlock(&fs_lock);
 
-    // unlink from parent
-    size_t parent_size;
-    off_t parent_offset;
-    get_parent_info(path, &parent_size, &parent_offset);
+    fuse_reply_err(req, -result);
+}
 
-//    if(parent_size == SFS_ROOTDIR_SIZE) {
-//        struct sfs_entry parent_entries[SFS_ROOTDIR_NENTRIES];
-//        disk_read(parent_entries, SFS_ROOTDIR_SIZE, parent_offset);
-//    } else if (parent_size == SFS_DIR_SIZE) {
-//        struct sfs_entry parent_entries[SFS_DIR_NENTRIES];
-//        disk_read(parent_entries, SFS_DIR_SIZE, parent_offset);
-//    }
+static void sfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    log("unlink %lu %s\n", parent, name);
 
-    struct sfs_entry parent_entries[SFS_ROOTDIR_NENTRIES];
-    disk_read(parent_entries, SFS_ROOTDIR_SIZE, parent_offset);
-    unsigned int entries_num = 0;
-    if (parent_size == SFS_ROOTDIR_SIZE) {
-        entries_num = SFS_ROOTDIR_NENTRIES;
-    } else {
-        entries_num = SFS_DIR_NENTRIES;
-    }
+    ll_remove_entry(req, parent, name, false);
+}
 
-    char *name = get_path_name(path);
-    for (unsigned i = 0; i < entries_num; i++) {
-        if (strcmp(name, parent_entries[i].filename) == 0) {
-            struct sfs_entry empty_entry;
-            memset(&empty_entry, 0, sizeof(struct sfs_entry));
+static void sfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    log("rmdir %lu %s\n", parent, name);
 
-            parent_entries[i] = empty_entry;
-            break;
-        }
-    }   // parent_entries is now ready
-    disk_write(parent_entries, parent_size, parent_offset);
+    ll_remove_entry(req, parent, name, true);
+}
 
-    // unlink from block table
-    blockidx_t block_table[SFS_BLOCKTBL_NENTRIES];
-    disk_read(block_table, SFS_BLOCKTBL_SIZE, SFS_BLOCKTBL_OFF);
-    blockidx_t first_block = target.first_block - 1;
+// whether directory `dir` is `sub` or has it somewhere below
+bool dir_contains(sfs2_blockidx_t dir, sfs2_blockidx_t sub) {
+    if (dir == sub) return true;
 
-    block_table[first_block] = SFS_BLOCKIDX_EMPTY;
-    block_table[first_block + 1] = SFS_BLOCKIDX_EMPTY;
-    disk_write(block_table, SFS_BLOCKTBL_SIZE, SFS_BLOCKTBL_OFF);
+    struct entry entries[SFS_ROOTDIR_NENTRIES];
+    off_t unit_off;
+    for (unsigned unit = 0; (unit_off = dir_unit_offset(dir, unit)) >= 0; unit++) {
+        unsigned int entries_num = dir_load(entries, dir_unit_size(dir), unit_off);
 
-    return 0;
-}
+        for (unsigned i = 0; i < entries_num; i++) {
+            if (entries[i].filename[0] == '\0' || is_inline_data(&entries[i])) continue;
+            if (!(entries[i].size & SFS2_DIRECTORY)) continue;
+            if (dir_contains(entries[i].first_block, sub)) return true;
+        }
+    }
 
+    return false;
+}
 
 /*
- * Remove file at `path`.
- * Can not be used to remove directories.
- * Returns 0 on success, < 0 on error.
+ * The entry keeps its inode, also when it moves to another directory (see
+ * entry_ino()); a directory cannot move below itself.
  */
-static int sfs_unlink(const char *path) {
-    log("unlink %s\n", path);
+static void sfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                          fuse_ino_t newparent, const char *newname) {
+    log("rename %lu %s %lu %s\n", parent, name, newparent, newname);
 
-    // find if exists
-    struct sfs_entry target;
-    int result = get_entry(path, &target);
-    if (result != 0) {
-        return result;
+    bool is_special = strcmp(name, CTL_NAME) == 0 || strcmp(name, STATS_NAME) == 0;
+    bool is_new_special = strcmp(newname, CTL_NAME) == 0 || strcmp(newname, STATS_NAME) == 0;
+    if ((parent == FUSE_ROOT_ID && is_special) || (newparent == FUSE_ROOT_ID && is_new_special)) {
+        fuse_reply_err(req, EBUSY);
+        return;
     }
 
-    // unlink from parent
-    size_t parent_size;
-    off_t parent_offset;
-    get_parent_info(path, &parent_size, &parent_offset);
+    sfs2_blockidx_t dir, newdir;
+    struct entry entry, target;
+    off_t entry_off, new_off, target_off;
+    char key[LL_KEY_MAX];
+    fuse_ino_t target_ino = 0;
 
-    struct sfs_entry parent_entries[SFS_ROOTDIR_NENTRIES];
-    disk_read(parent_entries, SFS_ROOTDIR_SIZE, parent_offset);
-    unsigned int entries_num = 0;
-    if (parent_size == SFS_ROOTDIR_SIZE) {
-        entries_num = SFS_ROOTDIR_NENTRIES;
-    } else {
-        entries_num = SFS_DIR_NENTRIES;
+    pthread_rwlock_wrlock(&fs_lock);
+    int result = check_name(name);
+    if (result == 0) result = check_name(newname);
+    if (result == 0) result = ll_lookup(parent, name, &entry, &entry_off);
+    if (result == 0) result = ll_get_dir_info(parent, &dir);
+    if (result == 0) result = ll_get_dir_info(newparent, &newdir);
+    if (result == 0 && newparent != parent && (entry.size & SFS2_DIRECTORY)) {
+        result = dir_contains(entry.first_block, newdir) ? -EINVAL : 0;
     }
-
-    char *name = get_path_name(path);
-    for (unsigned i = 0; i < entries_num; i++) {
-        if (strcmp(name, parent_entries[i].filename) == 0) {
-            struct sfs_entry empty_entry;
-            memset(&empty_entry, 0, sizeof(struct sfs_entry));
-
-            parent_entries[i] = empty_entry;
-            break;
+    if (result == 0 && ll_lookup(newparent, newname, &target, &target_off) == 0 &&
+        (target_ino = entry_ino(target_off)) == 0) {
+        result = -ENOMEM;
+    }
+    if (result == 0) result = rename_entry(dir, &entry, entry_off, newdir, newname,
+                                           &new_off, &target_off);
+    if (result == 0) {
+        if (target_off >= 0) {
+            snprintf(key, sizeof(key), "%lu", (unsigned long) target_ino);
+            dcache_invalidate(key);
         }
-    }   // parent_entries is now ready
-    disk_write(parent_entries, parent_size, parent_offset);
+        ll_key(key, parent, name);
+        dcache_insert(key, NULL, 0);
+        ll_key(key, newparent, newname);
+        dcache_insert(key, &entry, new_off);
+    }
+    pthread_rwlock_unlock(&fs_lock);
 
-    // unlink from block table
-    blockidx_t block_table[SFS_BLOCKTBL_NENTRIES];
-    disk_read(block_table, SFS_BLOCKTBL_SIZE, SFS_BLOCKTBL_OFF);
+    fuse_reply_err(req, -result);
+}
 
-    blockidx_t first_block = target.first_block;
-    blockidx_t prev_block;
+static void sfs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    log("flush %lu\n", ino);
 
-    while (first_block != SFS_BLOCKIDX_END) {
-        prev_block = first_block - 1;
-        first_block = block_table[prev_block];
-        block_table[prev_block] = SFS_BLOCKIDX_EMPTY;
+    if (!wb_pending(false)) {
+        fuse_reply_err(req, 0);
+        return;
     }
-    disk_write(block_table, SFS_BLOCKTBL_SIZE, SFS_BLOCKTBL_OFF);
 
+    pthread_rwlock_wrlock(&fs_lock);
+    if (ino != INO_CTL && ino != INO_STATS) wb_writeback_chain(file_get(fi)->entry.first_block);
+    block_table_flush();
+    disk_flush();
+    pthread_rwlock_unlock(&fs_lock);
 
-    return 0;
+    fuse_reply_err(req, 0);
 }
 
+static void sfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                         struct fuse_file_info *fi) {
+    log("fsync %lu datasync=%d\n", ino, datasync);
 
-/*
- * Create an empty file at `path`.
- * The `mode` argument describes the permissions, which you may ignore for this
- * assignment.
- * Returns 0 on success, < 0 on error.
- */
-static int sfs_create(const char *path,
-                      mode_t mode,
-                      struct fuse_file_info *fi) {
-    (void) fi;
-    log("create %s mode=%o\n", path, mode);
+    pthread_rwlock_wrlock(&fs_lock);
+    if (ino != INO_CTL && ino != INO_STATS) wb_writeback_chain(file_get(fi)->entry.first_block);
+    block_table_flush();
+    disk_sync();
+    pthread_rwlock_unlock(&fs_lock);
 
-    return -ENOSYS;
+    fuse_reply_err(req, 0);
 }
 
 
-/*
- * Shrink or grow the file at `path` to `size` bytes.
- * Excess bytes are thrown away, whereas any bytes added in the process should
- * be nil (\0).
- * Returns 0 on success, < 0 on error.
- */
-static int sfs_truncate(const char *path, off_t size) {
-    log("truncate %s size=%ld\n", path, size);
-
-    return -ENOSYS;
-}
+static void sfs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset,
+                             off_t length, struct fuse_file_info *fi) {
+    log("fallocate %lu mode=%#x offset=%ld length=%ld\n", ino, mode, offset, length);
 
+    struct sfs_file *file = file_get(fi);
+    int result;
 
-/*
- * Write contents of `buf` (of `size` bytes) to the file at `path`.
- * The file is grown if nessecary, and any bytes already present are overwritten
- * (whereas any other data is left intact). The `offset` argument specifies how
- * many bytes should be skipped in the file, after which `size` bytes from
- * buffer are written.
- * This means that the new file size will be max(old_size, offset + size).
- * Returns the number of bytes written, or < 0 on error.
- */
-static int sfs_write(const char *path,
-                     const char *buf,
-                     size_t size,
-                     off_t offset,
-                     struct fuse_file_info *fi) {
-    (void) fi;
-    log("write %s data='%.*s' size=%zu offset=%ld\n", path, (int) size, buf,
-        size, offset);
+    pthread_rwlock_wrlock(&fs_lock);
+    if (mode & ~FALLOC_FL_KEEP_SIZE) {
+        result = -EOPNOTSUPP;
+    } else if (ino == INO_CTL || ino == INO_STATS) {
+        result = -EBADF;
+    } else {
+        struct entry entry = file->entry;
+        result = fallocate_file(NULL, &entry, file->entry_off, offset, length,
+                                mode & FALLOC_FL_KEEP_SIZE);
+    }
+    pthread_rwlock_unlock(&fs_lock);
 
-    return -ENOSYS;
+    fuse_reply_err(req, -result);
 }
 
 
-/*
- * Move/rename the file at `path` to `newpath`.
- * Returns 0 on succes, < 0 on error.
- */
-static int sfs_rename(const char *path,
-                      const char *newpath) {
-    /* Implementing this function is optional, and not worth any points. */
-    log("rename %s %s\n", path, newpath);
+// operations that count in the statistics, timed up to the reply
+#define TIMED_LL_OP(op, params, args)           \
+    static void timed_ll_##op params {          \
+        uint64_t start = stats_now();           \
+        sfs_ll_##op args;                       \
+        stats_op_done(STATS_OP_##op, start);    \
+    }
 
-    return -ENOSYS;
-}
+TIMED_LL_OP(lookup, (fuse_req_t req, fuse_ino_t parent, const char *name), (req, parent, name))
+TIMED_LL_OP(getattr, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+TIMED_LL_OP(setattr, (fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+                      struct fuse_file_info *fi),
+            (req, ino, attr, to_set, fi))
+TIMED_LL_OP(opendir, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+TIMED_LL_OP(readdir, (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                      struct fuse_file_info *fi),
+            (req, ino, size, off, fi))
+TIMED_LL_OP(open, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+TIMED_LL_OP(read, (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                   struct fuse_file_info *fi),
+            (req, ino, size, off, fi))
+TIMED_LL_OP(release, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+TIMED_LL_OP(mkdir, (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode),
+            (req, parent, name, mode))
+TIMED_LL_OP(rmdir, (fuse_req_t req, fuse_ino_t parent, const char *name), (req, parent, name))
+TIMED_LL_OP(unlink, (fuse_req_t req, fuse_ino_t parent, const char *name), (req, parent, name))
+TIMED_LL_OP(create, (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+                     struct fuse_file_info *fi),
+            (req, parent, name, mode, fi))
+TIMED_LL_OP(write, (fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off,
+                    struct fuse_file_info *fi),
+            (req, ino, buf, size, off, fi))
+TIMED_LL_OP(write_buf, (fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off,
+                        struct fuse_file_info *fi),
+            (req, ino, bufv, off, fi))
+TIMED_LL_OP(rename, (fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent,
+                     const char *newname),
+            (req, parent, name, newparent, newname))
+TIMED_LL_OP(flush, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+TIMED_LL_OP(fsync, (fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi),
+            (req, ino, datasync, fi))
+TIMED_LL_OP(fallocate, (fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length,
+                        struct fuse_file_info *fi),
+            (req, ino, mode, offset, length, fi))
 
 
-static const struct fuse_operations sfs_oper = {
-        .getattr    = sfs_getattr,
-        .readdir    = sfs_readdir,
-        .read       = sfs_read,
-        .mkdir      = sfs_mkdir,
-        .rmdir      = sfs_rmdir,
-        .unlink     = sfs_unlink,
-        .create     = sfs_create,
-        .truncate   = sfs_truncate,
-        .write      = sfs_write,
-        .rename     = sfs_rename,
+static const struct fuse_lowlevel_ops sfs_ll_oper = {
+        .init       = sfs_ll_init,
+        .destroy    = sfs_destroy,
+        .lookup     = timed_ll_lookup,
+        .forget     = sfs_ll_forget,
+        .getattr    = timed_ll_getattr,
+        .setattr    = timed_ll_setattr,
+        .opendir    = timed_ll_opendir,
+        .readdir    = timed_ll_readdir,
+        .releasedir = sfs_ll_releasedir,
+        .open       = timed_ll_open,
+        .read       = timed_ll_read,
+        .release    = timed_ll_release,
+        .mkdir      = timed_ll_mkdir,
+        .rmdir      = timed_ll_rmdir,
+        .unlink     = timed_ll_unlink,
+        .create     = timed_ll_create,
+        .write      = timed_ll_write,
+        .write_buf  = timed_ll_write_buf,
+        .rename     = timed_ll_rename,
+        .flush      = timed_ll_flush,
+        .fsync      = timed_ll_fsync,
+        .fallocate  = timed_ll_fallocate,
 };
 
+// fuse_main() for the low-level frontend
+int sfs_ll_main(struct fuse_args *args) {
+    char *mountpoint;
+    int multithreaded, foreground;
+    int err = -1;
+
+    if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1)
+        return 1;
+    if (mountpoint == NULL) {
+        fprintf(stderr, "missing mountpoint\n");
+        return 1;
+    }
+
+    struct fuse_chan *ch = fuse_mount(mountpoint, args);
+    if (ch != NULL) {
+        struct fuse_session *se = fuse_lowlevel_new(args, &sfs_ll_oper, sizeof(sfs_ll_oper), NULL);
+        if (se != NULL) {
+            if (fuse_set_signal_handlers(se) != -1) {
+                fuse_session_add_chan(se, ch);
+                if (fuse_daemonize(foreground) != -1)
+                    err = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+                fuse_remove_signal_handlers(se);
+                fuse_session_remove_chan(ch);
+            }
+            fuse_session_destroy(se);
+        }
+        fuse_unmount(mountpoint, ch);
+    }
+    free(mountpoint);
+
+    return err ? 1 : 0;
+}
+
 
 #define OPTION(t, p)                            \
     { t, offsetof(struct options, p), 1 }
@@ -651,6 +4910,11 @@ static const struct fuse_operations sfs_oper = {
 static const struct fuse_opt option_spec[] = {
         LOPTION("-i %s", "--img=%s", img),
         LOPTION("-b", "--background", background),
+        LOPTION("-m", "--mmap", mmap),
+        LOPTION("-c %u", "--cache=%u", cache_size),
+        LOPTION("-l", "--lowlevel", lowlevel),
+        OPTION("--max-io=%u", max_io),
+        OPTION("--timeout=%lf", timeout),
         LOPTION("-v", "--verbose", verbose),
         LOPTION("-h", "--help", show_help),
         OPTION("--fuse-help", show_fuse_help),
@@ -667,16 +4931,30 @@ static void show_help(const char *progname) {
            "    -i, --img=FILE      filename of SFS image to mount\n"
            "                        (default: \"%s\")\n"
            "    -b, --background    run fuse in background\n"
+           "    -m, --mmap          access the image through mmap instead of\n"
+           "                        pread/pwrite\n"
+           "    -c, --cache=KB      size of the write-back data cache, 0 to\n"
+           "                        write through (default: %u)\n"
+           "    -l, --lowlevel      use the inode based low-level FUSE API\n"
+           "        --max-io=KB     largest read, write and readahead request\n"
+           "                        the kernel may send, 0 for FUSE defaults\n"
+           "                        (default: %u)\n"
+           "        --timeout=SECS  time the kernel may cache names and\n"
+           "                        attributes (default: %g)\n"
            "    -v, --verbose       print debug information\n"
            "    -h, --help          show this summarized help\n"
            "        --fuse-help     show full FUSE help\n"
-           "\n", default_img);
+           "\n", default_img, DEFAULT_CACHE_KB, DEFAULT_MAX_IO_KB,
+           DEFAULT_TIMEOUT);
 }
 
 int main(int argc, char **argv) {
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
     options.img = strdup(default_img);
+    options.cache_size = DEFAULT_CACHE_KB;
+    options.max_io = DEFAULT_MAX_IO_KB;
+    options.timeout = DEFAULT_TIMEOUT;
 
     fuse_opt_parse(&args, &options, option_spec, NULL);
 
@@ -693,7 +4971,34 @@ int main(int argc, char **argv) {
     if (!options.background)
         assert(fuse_opt_add_arg(&args, "-f") == 0);
 
+    // FUSE defaults to 4K writes and 128K reads and readahead
+    if (options.max_io > 0) {
+        char io_opts[128];
+        unsigned bytes = options.max_io * 1024;
+        snprintf(io_opts, sizeof(io_opts),
+                 "-obig_writes,max_write=%u,max_read=%u,max_readahead=%u",
+                 bytes, bytes, bytes);
+        assert(fuse_opt_add_arg(&args, io_opts) == 0);
+    }
+
     disk_open_image(options.img);
+    if (options.mmap)
+        disk_map_image();
+    geometry_load();
+    block_table_load();
+    block_refs_load();
+    wb_setup();
+    wb_max = options.cache_size * 1024 / geo.block_size;
+
+    if (options.lowlevel)
+        return sfs_ll_main(&args);
+
+    // report the inode numbers of entry_ino(), also in readdir
+    char hl_opts[128];
+    snprintf(hl_opts, sizeof(hl_opts),
+             "-ouse_ino,readdir_ino,entry_timeout=%g,attr_timeout=%g",
+             options.timeout, options.timeout);
+    assert(fuse_opt_add_arg(&args, hl_opts) == 0);
 
     return fuse_main(args.argc, args.argv, &sfs_oper, NULL);
 }
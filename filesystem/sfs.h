@@ -77,4 +77,97 @@ struct sfs_entry {
     uint32_t size;
 } __attribute__((__packed__));
 
+
+/*
+ * Version 2 of the format, selected by its own magic string, lifts the limits
+ * of the fixed layout above (8 MB disks, 256 MB files). The image starts with a
+ * superblock describing the layout, block indices are 32 bits wide and the
+ * block size is chosen when the image is created:
+ * +------------------------+
+ * | Superblock             |
+ * |  64 bytes              |
+ * +------------------------+
+ * | Root directory entries |
+ * |  4096 bytes            |
+ * +------------------------+
+ * | Block table            |
+ * |  4 bytes per block     |
+ * +------------------------+
+ * | Data area              |
+ * |  nblocks * block_size  |
+ * +------------------------+
+ *
+ * Directory entries keep their 64 bytes (names are shorter to make room for the
+ * wider fields), so do the rootdir and the special blockidx values. A
+ * subdirectory is a chain of one or more units of SFS2_DIR_SIZE bytes, each on
+ * consecutive blocks, so it grows by a unit of as many entries as the rootdir
+ * whenever it is full. The flags are in the top 4 bits of the 64-bit size
+ * field.
+ *
+ * A file with the SPARSE flag has a chain of fewer blocks than its size needs,
+ * down to none at all: the rest of the file is a hole and reads as zeroes. Or
+ * it has more: blocks reserved past its end (by fallocate), which hold no data
+ * of the file until it grows into them.
+ *
+ * Files with the SHARED flag are clones: the end of their chain, possibly all
+ * of it, may be a chain of other SHARED files as well. Such blocks are never
+ * written in place, a file first copies its shared blocks up to the ones it
+ * changes. The number of files sharing a block is not stored on disk, but
+ * follows from walking the chains of all SHARED files.
+ *
+ * A file of at most SFS_INLINE_MAX bytes may have the INLINE flag instead of a
+ * chain (its first block is END): the directory slot right after its entry, in
+ * the same unit, holds the data after SFS_INLINE_MARK, which no name starts
+ * with. Such a slot is neither an entry nor free. The driver only writes inline
+ * data on version 2 images, version 1 images stay as fsck.sfs expects them.
+ */
+
+#define SFS2_SUPER_SIZE       64u
+
+#define SFS2_ROOTDIR_OFF      SFS2_SUPER_SIZE
+
+#define SFS2_DIR_NENTRIES     64u
+#define SFS2_DIR_SIZE         (SFS2_DIR_NENTRIES * sizeof(struct sfs2_entry))
+
+#define SFS2_BLOCK_SIZE_MIN       512u
+#define SFS2_BLOCK_SIZE_MAX       65536u
+#define SFS2_BLOCK_SIZE_DEFAULT   4096u
+
+#define SFS2_BLOCKIDX_EMPTY   0x0
+#define SFS2_BLOCKIDX_END     0xfffffffeu
+#define SFS2_NBLOCKS_MAX      (SFS2_BLOCKIDX_END - 1)
+
+#define SFS2_SIZEMASK         ((1ull << 60) - 1)
+#define SFS2_DIRECTORY        (1ull << 63)
+#define SFS2_SPARSE           (1ull << 62)
+#define SFS2_SHARED           (1ull << 61)
+#define SFS2_INLINE           (1ull << 60)
+
+/* Slot after an INLINE entry: the mark, then the data */
+#define SFS_INLINE_MARK       '/'
+#define SFS_INLINE_MAX        (sizeof(struct sfs_entry) - 1)
+
+#define SFS2_FILENAME_MAX     52u
+
+__attribute__((used))
+static const char sfs2_magic[SFS_MAGIC_SIZE] = "**VUOS SFS2 IMG*";
+
+typedef uint32_t sfs2_blockidx_t;
+
+/* Superblock, at offset 0. */
+struct sfs2_super {
+    char magic[SFS_MAGIC_SIZE];
+    uint32_t block_size;        /* power of two, SFS2_BLOCK_SIZE_{MIN,MAX} */
+    uint32_t nblocks;           /* blocks in the data area, and table entries */
+    uint64_t blocktbl_off;      /* after the rootdir */
+    uint64_t data_off;          /* after the table, multiple of block_size */
+    char reserved[24];
+} __attribute__((__packed__));
+
+struct sfs2_entry {
+    char filename[SFS2_FILENAME_MAX];
+    sfs2_blockidx_t first_block;
+    uint64_t size;
+} __attribute__((__packed__));
+
 #endif
@@ -0,0 +1,241 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "sfsimage.h"
+
+// the layout a version 2 superblock describes makes sense (as in diskio)
+bool super_valid(const struct sfs2_super *super) {
+    uint32_t bs = super->block_size;
+
+    if (bs < SFS2_BLOCK_SIZE_MIN || bs > SFS2_BLOCK_SIZE_MAX || (bs & (bs - 1))) return false;
+    if (super->nblocks == 0 || super->nblocks > SFS2_NBLOCKS_MAX) return false;
+    if (super->blocktbl_off < SFS2_ROOTDIR_OFF + SFS_ROOTDIR_SIZE) return false;
+    if (super->data_off < super->blocktbl_off +
+                          (uint64_t) super->nblocks * sizeof(sfs2_blockidx_t)) return false;
+
+    return super->data_off % bs == 0;
+}
+
+void geometry_v1(struct sfs_image *img) {
+    img->version = 1;
+    img->block_size = SFS_BLOCK_SIZE;
+    img->nblocks = SFS_BLOCKTBL_NENTRIES;
+    img->rootdir_off = SFS_ROOTDIR_OFF;
+    img->blocktbl_off = SFS_BLOCKTBL_OFF;
+    img->data_off = SFS_DATA_OFF;
+    img->dir_size = SFS_DIR_SIZE;
+    img->filename_max = SFS_FILENAME_MAX;
+    img->size_max = SFS_SIZEMASK;
+}
+
+void geometry_v2(struct sfs_image *img, const struct sfs2_super *super) {
+    img->version = 2;
+    img->block_size = super->block_size;
+    img->nblocks = super->nblocks;
+    img->rootdir_off = SFS2_ROOTDIR_OFF;
+    img->blocktbl_off = super->blocktbl_off;
+    img->data_off = super->data_off;
+    img->dir_size = SFS2_DIR_SIZE;
+    img->filename_max = SFS2_FILENAME_MAX;
+    img->size_max = SFS2_SIZEMASK;
+}
+
+int image_open(struct sfs_image *img, const char *path, bool readonly) {
+    memset(img, 0, sizeof(struct sfs_image));
+    img->readonly = readonly;
+
+    img->fd = open(path, readonly ? O_RDONLY : O_RDWR);
+    if (img->fd < 0) {
+        perror("Could not open disk image");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(img->fd, &st) < 0) {
+        perror("Could not stat disk image");
+        return -1;
+    }
+    img->file_size = st.st_size;
+
+    struct sfs2_super super;
+    image_read(img, &super, sizeof(super), 0);
+
+    if (memcmp(super.magic, sfs_magic, SFS_MAGIC_SIZE) == 0) {
+        geometry_v1(img);
+    } else if (memcmp(super.magic, sfs2_magic, SFS_MAGIC_SIZE) == 0) {
+        if (!super_valid(&super)) {
+            fprintf(stderr, "Error: invalid superblock\n");
+            return -1;
+        }
+        geometry_v2(img, &super);
+    } else {
+        fprintf(stderr, "Error: invalid signature '%.*s'\n", SFS_MAGIC_SIZE, super.magic);
+        return -1;
+    }
+
+    img->table = malloc((size_t) img->nblocks * sizeof(sfs2_blockidx_t));
+    if (img->table == NULL) {
+        perror("Could not allocate block table");
+        return -1;
+    }
+
+    if (img->version == 1) {
+        uint16_t table[SFS_BLOCKTBL_NENTRIES];
+
+        image_read(img, table, sizeof(table), img->blocktbl_off);
+        for (unsigned i = 0; i < img->nblocks; i++) {
+            img->table[i] = table[i] == SFS_BLOCKIDX_END ? SFS2_BLOCKIDX_END : table[i];
+        }
+    } else {
+        image_read(img, img->table, (size_t) img->nblocks * sizeof(sfs2_blockidx_t),
+                   img->blocktbl_off);
+    }
+
+    return 0;
+}
+
+int image_init(struct sfs_image *img, int fd, int version, uint32_t block_size,
+               uint32_t nblocks) {
+    memset(img, 0, sizeof(struct sfs_image));
+    img->fd = fd;
+
+    if (version == 1) {
+        geometry_v1(img);
+    } else {
+        struct sfs2_super super;
+
+        memset(&super, 0, sizeof(super));
+        super.block_size = block_size;
+        super.nblocks = nblocks;
+        super.blocktbl_off = SFS2_ROOTDIR_OFF + SFS_ROOTDIR_SIZE;
+        super.data_off = super.blocktbl_off + (uint64_t) nblocks * sizeof(sfs2_blockidx_t);
+        super.data_off = (super.data_off + block_size - 1) / block_size * block_size;
+        if (!super_valid(&super)) return -1;
+
+        geometry_v2(img, &super);
+    }
+
+    img->table = calloc(img->nblocks, sizeof(sfs2_blockidx_t));
+    if (img->table == NULL) {
+        perror("Could not allocate block table");
+        exit(1);
+    }
+
+    return 0;
+}
+
+uint64_t image_disk_size(const struct sfs_image *img) {
+    return img->data_off + (uint64_t) img->nblocks * img->block_size;
+}
+
+void image_read(struct sfs_image *img, void *buf, size_t size, off_t offset) {
+    size_t done = 0;
+
+    while (done < size && offset + (off_t) done < img->file_size) {
+        ssize_t ret = pread(img->fd, (char *) buf + done, size - done, offset + done);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret < 0) {
+            perror("Error reading from disk");
+            exit(1);
+        }
+        if (ret == 0) break;
+        done += ret;
+    }
+
+    // images may be cut short after the last used block
+    memset((char *) buf + done, 0, size - done);
+}
+
+void image_write(struct sfs_image *img, const void *buf, size_t size, off_t offset) {
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t ret = pwrite(img->fd, (const char *) buf + done, size - done, offset + done);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret < 0) {
+            perror("Error writing to disk");
+            exit(1);
+        }
+        done += ret;
+    }
+
+    if (offset + (off_t) size > img->file_size) img->file_size = offset + size;
+}
+
+void image_write_header(struct sfs_image *img) {
+    if (img->version == 1) {
+        image_write(img, sfs_magic, SFS_MAGIC_SIZE, 0);
+        return;
+    }
+
+    struct sfs2_super super;
+    memset(&super, 0, sizeof(super));
+    memcpy(super.magic, sfs2_magic, SFS_MAGIC_SIZE);
+    super.block_size = img->block_size;
+    super.nblocks = img->nblocks;
+    super.blocktbl_off = img->blocktbl_off;
+    super.data_off = img->data_off;
+    image_write(img, &super, sizeof(super), 0);
+}
+
+void image_write_table(struct sfs_image *img) {
+    if (img->version == 2) {
+        image_write(img, img->table, (size_t) img->nblocks * sizeof(sfs2_blockidx_t),
+                    img->blocktbl_off);
+        return;
+    }
+
+    uint16_t table[SFS_BLOCKTBL_NENTRIES];
+    for (unsigned i = 0; i < img->nblocks; i++) {
+        table[i] = img->table[i] == SFS2_BLOCKIDX_END ? SFS_BLOCKIDX_END : img->table[i];
+    }
+    image_write(img, table, sizeof(table), img->blocktbl_off);
+}
+
+off_t image_block_offset(const struct sfs_image *img, sfs2_blockidx_t block) {
+    return img->data_off + (off_t) (block - 1) * img->block_size;
+}
+
+void image_entry_decode(const struct sfs_image *img, const void *raw, struct image_entry *entry) {
+    memset(entry, 0, sizeof(struct image_entry));
+
+    if (img->version == 1) {
+        const struct sfs_entry *v1 = raw;
+
+        memcpy(entry->filename, v1->filename, SFS_FILENAME_MAX);
+        entry->first_block = v1->first_block == SFS_BLOCKIDX_END ? SFS2_BLOCKIDX_END
+                                                                   : v1->first_block;
+        // flags move from the top of 32 to the top of 64 bits
+        entry->size = (v1->size & SFS_SIZEMASK) | (uint64_t) (v1->size & ~SFS_SIZEMASK) << 32;
+    } else {
+        const struct sfs2_entry *v2 = raw;
+
+        memcpy(entry->filename, v2->filename, SFS2_FILENAME_MAX);
+        entry->first_block = v2->first_block;
+        entry->size = v2->size;
+    }
+}
+
+void image_entry_encode(const struct sfs_image *img, const struct image_entry *entry, void *raw) {
+    memset(raw, 0, IMAGE_ENTRY_SIZE);
+
+    if (img->version == 1) {
+        struct sfs_entry *v1 = raw;
+
+        memcpy(v1->filename, entry->filename, SFS_FILENAME_MAX);
+        v1->first_block = entry->first_block == SFS2_BLOCKIDX_END ? SFS_BLOCKIDX_END
+                                                                : entry->first_block;
+        v1->size = (entry->size & SFS2_SIZEMASK) | (uint32_t) ((entry->size & ~SFS2_SIZEMASK) >> 32);
+    } else {
+        struct sfs2_entry *v2 = raw;
+
+        memcpy(v2->filename, entry->filename, SFS2_FILENAME_MAX);
+        v2->first_block = entry->first_block;
+        v2->size = entry->size;
+    }
+}
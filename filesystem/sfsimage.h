@@ -0,0 +1,77 @@
+#ifndef SFSIMAGE_H
+#define SFSIMAGE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "sfs.h"
+
+/*
+ * Whole-image access for the offline tools (mkfs and fsck), for both versions
+ * of the format. Unlike diskio, which serves the driver one entry or block at
+ * a time, these load and store the metadata in bulk: the block table is kept
+ * in memory in the version 2 form, and converted when it is read and written.
+ * I/O errors are fatal, as in diskio.
+ */
+
+struct sfs_image {
+    int fd;
+    bool readonly;
+    off_t file_size;            // may end before the disk does
+
+    int version;
+    uint32_t block_size;
+    uint32_t nblocks;
+    off_t rootdir_off;
+    off_t blocktbl_off;
+    off_t data_off;
+    size_t dir_size;            // bytes of (each unit of) a subdirectory
+    unsigned filename_max;      // including the terminating '\0'
+    uint64_t size_max;
+
+    sfs2_blockidx_t *table;     // nblocks entries, SFS2_BLOCKIDX_* values
+};
+
+/* Directory entry in memory, as in the driver. */
+struct image_entry {
+    char filename[SFS_FILENAME_MAX];
+    sfs2_blockidx_t first_block;
+    uint64_t size;              // SFS2_* flags
+};
+
+#define IMAGE_ENTRY_SIZE    sizeof(struct sfs_entry)    // on disk, in both versions
+
+/* Open the image at `path` and load its geometry and block table. Returns 0,
+ * or -1 after printing why the image is not usable. */
+int image_open(struct sfs_image *img, const char *path, bool readonly);
+
+/* Set up the geometry of a new image of `version` (for version 2 with
+ * `nblocks` blocks of `block_size` bytes) with an empty block table, to be
+ * written to `fd`. Returns 0, or -1 if the geometry is not valid. */
+int image_init(struct sfs_image *img, int fd, int version, uint32_t block_size,
+               uint32_t nblocks);
+
+/* Size in bytes of the disk the image describes. */
+uint64_t image_disk_size(const struct sfs_image *img);
+
+/* Read `size` bytes at `offset`; the disk reads as zeroes past the end of the
+ * image file. */
+void image_read(struct sfs_image *img, void *buf, size_t size, off_t offset);
+
+void image_write(struct sfs_image *img, const void *buf, size_t size, off_t offset);
+
+/* Write the magic string (and superblock) of the image. */
+void image_write_header(struct sfs_image *img);
+
+/* Write the whole block table, with a single write. */
+void image_write_table(struct sfs_image *img);
+
+/* Byte offset on disk of data block `block` (a blockidx, so 1-based). */
+off_t image_block_offset(const struct sfs_image *img, sfs2_blockidx_t block);
+
+void image_entry_decode(const struct sfs_image *img, const void *raw, struct image_entry *entry);
+
+void image_entry_encode(const struct sfs_image *img, const struct image_entry *entry, void *raw);
+
+#endif
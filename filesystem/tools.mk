@@ -0,0 +1,20 @@
+# mkfs, fsck and defrag for both versions of the format: make -f tools.mk
+# Kept apart from the Makefile, which gets replaced during testing.
+
+TOOLS = sfs-mkfs sfs-fsck sfs-defrag
+HEADERS = sfs.h sfsimage.h
+
+CFLAGS = -O2 -ggdb -std=gnu99 -Wall -Wextra -D_FILE_OFFSET_BITS=64 -pthread
+LDFLAGS = -pthread
+
+.PHONY: all clean
+
+all: $(TOOLS)
+
+sfs-%: %.o sfsimage.o
+	$(CC) -o $@ $^ $(LDFLAGS)
+
+mkfs.o fsck.o defrag.o sfsimage.o: $(HEADERS)
+
+clean:
+	rm -f $(TOOLS) mkfs.o fsck.o defrag.o sfsimage.o
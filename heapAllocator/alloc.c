@@ -4,6 +4,7 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <sys/mman.h>
 
 
 // increasing heap size page by page
@@ -11,6 +12,13 @@
 #define ALIGNMENT (sizeof(long))
 #define FLAG_BIT 63
 
+// transparent huge pages: large blocks get their own 2MB aligned huge pages,
+// and once the heap outgrows one huge page it is grown a huge page at a time
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+#define LARGE_ALLOC_THRESHOLD (HUGE_PAGE_SIZE / 2)
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((a) - 1))
+#define ALIGN_DOWN(x, a) ((x) & ~((a) - 1))
+
 typedef struct meta_t {
     // first bit used as free mark, 1 means Free, 0 means inuse
     // rest as the offset of ALIGNMENT bytes to next block
@@ -39,6 +47,10 @@ meta_t *get_free_block(size_t aligned_size);
 
 meta_t *expand_heap(size_t aligned_size);
 
+meta_t *expand_heap_huge(size_t aligned_size);
+
+void advise_huge_pages(void *start, void *end);
+
 meta_t *split_block(meta_t *left, size_t aligned_size);
 
 // beginning of heap chain
@@ -234,13 +246,26 @@ block_split:
 
 // only create when reach the sbrk(0)
 meta_t *expand_heap(size_t aligned_size) {
-    meta_t *result;
+    if (aligned_size >= LARGE_ALLOC_THRESHOLD) return expand_heap_huge(aligned_size);
+
+    meta_t *result = sbrk(0);
     // alloc pages
     size_t page_request = (aligned_size + sizeof(meta_t)) / PAGE_SIZE + 1;
-    result = sbrk(page_request * PAGE_SIZE);
+    size_t request_size = page_request * PAGE_SIZE;
+
+    // heap already spans a huge page, keep the break on huge page boundaries
+    // and advise the huge page the break is in, grown page by page so far
+    uintptr_t advise_start = (uintptr_t) result;
+    if (base_block != NULL && (uintptr_t) result - (uintptr_t) base_block >= HUGE_PAGE_SIZE) {
+        request_size = ALIGN_UP((uintptr_t) result + request_size, HUGE_PAGE_SIZE) - (uintptr_t) result;
+        advise_start = ALIGN_DOWN((uintptr_t) result, HUGE_PAGE_SIZE);
+    }
+
+    result = sbrk(request_size);
     // create block
-    set_descriptor(result, page_request * PAGE_SIZE);
+    set_descriptor(result, request_size);
     set_free(result);
+    advise_huge_pages((void *) advise_start, (char *) result + request_size);
 
     // see if is the front_most_free
     first_free = result;
@@ -248,6 +273,44 @@ meta_t *expand_heap(size_t aligned_size) {
     return result;
 }
 
+// large blocks: data starts on a huge page boundary and the block runs up to the
+// next one; get_free_block() splits off what the request leaves of the last huge
+// page as a free block, so small blocks fill it instead of it going to waste
+meta_t *expand_heap_huge(size_t aligned_size) {
+    uintptr_t curr_brk = (uintptr_t) sbrk(0);
+    uintptr_t data_start = ALIGN_UP(curr_brk + sizeof(meta_t), HUGE_PAGE_SIZE);
+    uintptr_t data_end = ALIGN_UP(data_start + aligned_size, HUGE_PAGE_SIZE);
+    meta_t *result = (meta_t *) (data_start - sizeof(meta_t));
+
+    sbrk(data_end - curr_brk);
+
+    // gap in front of the aligned block stays usable as a free block
+    if ((uintptr_t) result > curr_brk) {
+        meta_t *gap = (meta_t *) curr_brk;
+        set_descriptor(gap, (uintptr_t) result - curr_brk);
+        set_free(gap);
+        if (base_block == NULL) base_block = gap;
+        first_free = gap;
+    } else {
+        first_free = result;
+    }
+
+    set_descriptor(result, data_end - (uintptr_t) result);
+    set_free(result);
+    advise_huge_pages((void *) data_start, (void *) data_end);
+
+    return result;
+}
+
+// ask for huge pages on every whole 2MB page inside [start, end)
+void advise_huge_pages(void *start, void *end) {
+    uintptr_t lo = ALIGN_UP((uintptr_t) start, HUGE_PAGE_SIZE);
+    uintptr_t hi = ALIGN_DOWN((uintptr_t) end, HUGE_PAGE_SIZE);
+
+    // only a hint, kernels without THP simply refuse
+    if (hi > lo) madvise((void *) lo, hi - lo, MADV_HUGEPAGE);
+}
+
 meta_t *split_block(meta_t *left, size_t aligned_size) {
     size_t total_size = get_data_size(left);
     // adjust left size